@@ -15,6 +15,8 @@ Bus::Bus(std::vector<BusDevice*> devices)
 
 	for (BusDevice* device : devices)
 		device->connect(this);
+
+	buildPageTables();
 }
 
 Bus::~Bus()
@@ -31,7 +33,8 @@ void Bus::connectCPU(CPU* cpu)
 
 MemAccessResult Bus::write(uint32_t addr, uint32_t data, enum DataSize dataSize)
 {
-	for (BusDevice* device : devices)
+	const Page& page = (*regions[addr >> RegionBits])[(addr >> PageBits) & (PagesPerRegion - 1)];
+	for (BusDevice* device : *page.writers)
 	{
 		MemAccessResult accessResult = device->write(addr, data, dataSize);
 		if (accessResult == MemAccessResult::Success || accessResult == MemAccessResult::Misaligned)
@@ -43,7 +46,8 @@ MemAccessResult Bus::write(uint32_t addr, uint32_t data, enum DataSize dataSize)
 
 MemAccessResult Bus::read(uint32_t addr, uint32_t& result, bool bReadOnly, enum DataSize dataSize, bool isSigned)
 {
-	for (BusDevice* device : devices)
+	const Page& page = (*regions[addr >> RegionBits])[(addr >> PageBits) & (PagesPerRegion - 1)];
+	for (BusDevice* device : *page.readers)
 	{
 		MemAccessResult accessResult = device->read(addr, result, bReadOnly, dataSize, isSigned);
 		if (accessResult == MemAccessResult::Success || accessResult == MemAccessResult::Misaligned)
@@ -53,6 +57,125 @@ MemAccessResult Bus::read(uint32_t addr, uint32_t& result, bool bReadOnly, enum
 	return MemAccessResult::NotInRange;
 }
 
+uint8_t* Bus::getHostPointer(uint32_t addr)
+{
+	for (BusDevice* device : devices)
+	{
+		uint8_t* hostPointer = device->getHostPointer(addr);
+		if (hostPointer != nullptr)
+			return hostPointer;
+	}
+
+	return nullptr;
+}
+
+uint32_t Bus::getHostSize(uint32_t addr)
+{
+	for (BusDevice* device : devices)
+	{
+		uint8_t* hostPointer = device->getHostPointer(addr);
+		if (hostPointer == nullptr)
+			continue;
+
+		uint32_t limitAddr = device->getAddressRange().limitAddr;
+		if (device->getHostPointer(limitAddr) != hostPointer + (limitAddr - addr))
+			return 0;
+		return limitAddr - addr + 1;
+	}
+
+	return 0;
+}
+
+uint8_t* Bus::getHostPage(uint32_t addr)
+{
+	const Page& page = (*regions[addr >> RegionBits])[(addr >> PageBits) & (PagesPerRegion - 1)];
+	if (page.readers->size() != 1 || *page.writers != *page.readers)
+		return nullptr;
+
+	// The device has to back the whole page with one block of host memory
+	BusDevice* device = page.readers->front();
+	uint32_t pageBase = addr & ~(PageSize - 1);
+	AddressRange range = device->getAddressRange();
+	if (pageBase < range.baseAddr || range.limitAddr < pageBase + (PageSize - 1))
+		return nullptr;
+	uint8_t* hostPointer = device->getHostPointer(pageBase);
+	if (hostPointer == nullptr || device->getHostPointer(pageBase + (PageSize - 1)) != hostPointer + (PageSize - 1))
+		return nullptr;
+
+	return hostPointer;
+}
+
+void Bus::buildPageTables()
+{
+	// Regions whose pages are the same share a table, the lists are unique so a region is found by comparing pointers
+	std::vector<const PageTable*> uniformTables;
+
+	for (uint32_t region = 0; region < RegionCount; region++)
+	{
+		uint32_t regionBase = region << RegionBits;
+		bool uniform;
+		Page regionPage = findDevices(regionBase, regionBase + ((1U << RegionBits) - 1), uniform);
+
+		const PageTable* table = nullptr;
+		if (uniform)
+		{
+			for (const PageTable* uniformTable : uniformTables)
+				if ((*uniformTable)[0].readers == regionPage.readers && (*uniformTable)[0].writers == regionPage.writers)
+					table = uniformTable;
+		}
+
+		if (table == nullptr)
+		{
+			std::unique_ptr<PageTable> newTable = std::make_unique<PageTable>();
+			for (uint32_t page = 0; page < PagesPerRegion; page++)
+			{
+				uint32_t pageBase = regionBase + (page << PageBits);
+				bool pageUniform;
+				(*newTable)[page] = uniform ? regionPage : findDevices(pageBase, pageBase + ((1U << PageBits) - 1), pageUniform);
+			}
+			table = newTable.get();
+			pageTables.push_back(std::move(newTable));
+			if (uniform)
+				uniformTables.push_back(table);
+		}
+
+		regions[region] = table;
+	}
+}
+
+Bus::Page Bus::findDevices(uint32_t baseAddr, uint32_t limitAddr, bool& uniform)
+{
+	// Devices that share addresses, like the terminal and the keyboard, are kept apart by only responding to writes or
+	// reads. Otherwise the first one that is in range wins, like it always did.
+	DeviceList readers, writers;
+	uniform = true;
+	for (BusDevice* device : devices)
+	{
+		AddressRange range = device->getAddressRange();
+		if (range.limitAddr < baseAddr || limitAddr < range.baseAddr)
+			continue;
+		if (baseAddr < range.baseAddr || range.limitAddr < limitAddr)
+			uniform = false;
+
+		if (range.readable)
+			readers.push_back(device);
+		if (range.writable)
+			writers.push_back(device);
+	}
+
+	return { internDeviceList(readers), internDeviceList(writers) };
+}
+
+const Bus::DeviceList* Bus::internDeviceList(const DeviceList& list)
+{
+	for (const std::unique_ptr<DeviceList>& existing : deviceLists)
+		if (*existing == list)
+			return existing.get();
+
+	deviceLists.push_back(std::make_unique<DeviceList>(list));
+	return deviceLists.back().get();
+}
+
 bool Bus::hasInterrupt()
 {
 	return activeInterrupts != 0;
@@ -61,11 +184,34 @@ bool Bus::hasInterrupt()
 void Bus::postInterrupt()
 {
 	activeInterrupts++;
+	interruptsChanged();
 }
 
 void Bus::clearInterrupt()
 {
 	activeInterrupts--;
+	interruptsChanged();
+}
+
+void Bus::interruptsChanged()
+{
+	if (cpu != nullptr)
+		cpu->csr.interruptsChanged();
+}
+
+void Bus::freeze()
+{
+	for (BusDevice* device : devices)
+		device->freeze();
+	frozenInterrupts = activeInterrupts;
+}
+
+void Bus::restore()
+{
+	for (BusDevice* device : devices)
+		device->restore();
+	activeInterrupts = frozenInterrupts;
+	interruptsChanged();
 }
 
 // BUSDEVICE
@@ -82,3 +228,21 @@ void BusDevice::connect(Bus* bus)
 {
 	this->bus = bus;
 }
+
+uint8_t* BusDevice::getHostPointer(uint32_t)
+{
+	return nullptr;
+}
+
+AddressRange BusDevice::getAddressRange()
+{
+	return { BaseAddr, LimitAddr, true, true };
+}
+
+void BusDevice::freeze()
+{
+}
+
+void BusDevice::restore()
+{
+}
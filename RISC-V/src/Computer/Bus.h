@@ -1,5 +1,7 @@
 #pragma once
 #include <cstdint>
+#include <array>
+#include <memory>
 #include <vector>
 
 enum class DataSize {
@@ -10,6 +12,14 @@ enum class MemAccessResult {
 	Success = 0, NotInRange, Misaligned
 };
 
+// The addresses a device responds to, and whether it responds to reads and writes there
+struct AddressRange {
+	uint32_t baseAddr;
+	uint32_t limitAddr;
+	bool readable;
+	bool writable;
+};
+
 class CPU;
 class Timer;
 class BusDevice;
@@ -18,14 +28,34 @@ class Bus
 {
 public:
 	Bus(std::vector<BusDevice*> devices);
-	~Bus();
+	virtual ~Bus();
 
 public:
 	void connectCPU(CPU* cpu);
 
 public:
-	MemAccessResult write(uint32_t addr, uint32_t data, enum DataSize dataSize = DataSize::Word);
-	MemAccessResult read(uint32_t add, uint32_t& result, bool bReadOnly = false, enum DataSize dataSize = DataSize::Word, bool isSigned = true);
+	// Tries the devices of the page in order until one of them is in range. StaticBus overrides these for devices known at
+	// compile time.
+	virtual MemAccessResult write(uint32_t addr, uint32_t data, enum DataSize dataSize = DataSize::Word);
+	virtual MemAccessResult read(uint32_t add, uint32_t& result, bool bReadOnly = false, enum DataSize dataSize = DataSize::Word, bool isSigned = true);
+
+	// Returns a pointer to the host memory backing addr, or nullptr if the device at addr isn't plain memory
+	uint8_t* getHostPointer(uint32_t addr);
+	// Returns the amount of bytes from addr to the end of its device that are backed by one block of host memory, or 0 if
+	// the device at addr isn't plain memory
+	uint32_t getHostSize(uint32_t addr);
+
+	// The size of the pages that addresses are decoded in
+	static constexpr uint32_t PageBits = 12;
+	static constexpr uint32_t PageSize = 1U << PageBits;
+	// Returns the host memory backing the page of addr, starting at the start of the page, or nullptr if the page isn't
+	// plain memory of a single device. Reads and writes of the page may then be done on the host memory directly.
+	uint8_t* getHostPage(uint32_t addr);
+
+	// freeze saves the state of every device (and the pending interrupts) as a golden image, restore resets them to it.
+	// Together with CPU::freeze and CPU::restore this resets the whole machine without reloading it.
+	void freeze();
+	void restore();
 
 public:
 	Timer* timer = nullptr;
@@ -34,11 +64,40 @@ public:
 	bool hasInterrupt();
 	void postInterrupt();
 	void clearInterrupt();
+	// Tells the CPU to look at its interrupts again, eg. after the timer was written
+	void interruptsChanged();
 
-private:
+protected:
 	std::vector<BusDevice*> devices;
+
+private:
+	// Every 4 KiB page has a list of the devices whose address range overlaps it, one for reads and one for writes, in
+	// the order of devices. Pages without devices have empty lists. The pages are grouped in 1024 regions of 4 MiB, and
+	// regions whose pages all have the same lists (eg. all of RAM, or nothing) share one table of pages.
+	static constexpr uint32_t RegionBits = 22;
+	static constexpr uint32_t PagesPerRegion = 1U << (RegionBits - PageBits);
+	static constexpr uint32_t RegionCount = 1U << (32 - RegionBits);
+
+	typedef std::vector<BusDevice*> DeviceList;
+	struct Page {
+		const DeviceList* readers;
+		const DeviceList* writers;
+	};
+	typedef std::array<Page, PagesPerRegion> PageTable;
+
+	void buildPageTables();
+	// Returns the devices that overlap baseAddr to limitAddr, if every one of them covers the whole range, uniform is set
+	Page findDevices(uint32_t baseAddr, uint32_t limitAddr, bool& uniform);
+	const DeviceList* internDeviceList(const DeviceList& list);
+
+	std::array<const PageTable*, RegionCount> regions;
+	std::vector<std::unique_ptr<PageTable>> pageTables;
+	std::vector<std::unique_ptr<DeviceList>> deviceLists;
+
+private:
 	CPU* cpu = nullptr;
 	uint32_t activeInterrupts = 0;
+	uint32_t frozenInterrupts = 0;
 };
 
 class BusDevice
@@ -51,9 +110,22 @@ public:
 	virtual MemAccessResult write(uint32_t addr, uint32_t data, DataSize dataSize = DataSize::Word) = 0;
 	// Should not write result unless the read succeeded
 	virtual MemAccessResult read(uint32_t addr, uint32_t& result, bool bReadOnly = false, DataSize dataSize = DataSize::Word, bool isSigned = true) = 0;
+	// Devices that are plain memory can expose their (little-endian) backing storage, so it can be accessed directly
+	virtual uint8_t* getHostPointer(uint32_t addr);
+	// The addresses the device responds to, the bus only sends it accesses within them. The default is every address.
+	virtual AddressRange getAddressRange();
+	// Saves the state of the device, and resets the device to the saved state. Devices without state don't need these.
+	virtual void freeze();
+	virtual void restore();
 
 	void connect(Bus* bus);
 
+public:
+	// The addresses the device can respond to, which StaticBus uses to skip it. Devices that know their range at compile
+	// time hide these with their own.
+	static constexpr uint32_t BaseAddr = 0x0000'0000U;
+	static constexpr uint32_t LimitAddr = 0xFFFF'FFFFU;
+
 public:
 	Bus* bus;
 };
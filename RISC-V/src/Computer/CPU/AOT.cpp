@@ -0,0 +1,403 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <array>
+#include <map>
+#include <vector>
+#include <string>
+#include "AOT.h"
+#include "JIT.h"
+#include "BlockOptimizer.h"
+#include "../MemoryMap.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+namespace
+{
+	std::string hex(uint32_t value)
+	{
+		char buffer[16];
+		std::snprintf(buffer, sizeof(buffer), "0x%08XU", value);
+		return buffer;
+	}
+
+	std::string blockName(uint32_t startPc)
+	{
+		char buffer[32];
+		std::snprintf(buffer, sizeof(buffer), "block_%08X", startPc);
+		return buffer;
+	}
+
+	std::string reg(uint32_t index)
+	{
+		return index == 0 ? std::string("0U") : "x" + std::to_string(index);
+	}
+
+	bool isTextAddr(uint32_t addr)
+	{
+		return MemoryMap::Text.BaseAddr <= addr && addr <= MemoryMap::Text.LimitAddr && addr % 4 == 0;
+	}
+
+	typedef std::vector<CPU::MicroOp> AOTBlock;
+
+	// Builds the block at startPc exactly like CPU::lookupBlock does
+	AOTBlock readBlock(Bus* bus, uint32_t startPc)
+	{
+		AOTBlock block;
+		for (uint32_t addr = startPc; addr <= MemoryMap::Text.LimitAddr && block.size() < CPU::MaxBlockLength; addr += 4)
+		{
+			uint32_t instruction = 0;
+			if (bus->read(addr, instruction, true) != MemAccessResult::Success)
+				break;
+
+			CPU::MicroOp op;
+			static_cast<CPU::DecodedInstruction&>(op) = CPU::decode(instruction);
+			op.execute = CPU::executeLookup[(size_t)op.operation];
+			block.push_back(op);
+			if (CPU::endsBlock(block.back().operation))
+				break;
+		}
+		return block;
+	}
+
+	// Adds the addresses execution can continue at after block to targets
+	void findTargets(const AOTBlock& block, uint32_t startPc, std::vector<uint32_t>& targets)
+	{
+		// Code addresses that are built in a register (la, call through a register, mtvec...) are found by tracking the
+		// values of lui, auipc and addi
+		std::array<bool, 32> known = {};
+		std::array<uint32_t, 32> values = {};
+
+		for (uint32_t i = 0; i < block.size(); i++)
+		{
+			const CPU::DecodedInstruction& op = block[i];
+			uint32_t pc = startPc + 4 * i;
+			bool isKnown = false;
+			uint32_t value = 0;
+
+			switch (op.operation)
+			{
+			case CPU::Operation::Lui:
+				isKnown = true;
+				value = op.imm;
+				break;
+			case CPU::Operation::Auipc:
+				isKnown = true;
+				value = pc + op.imm;
+				break;
+			case CPU::Operation::AddI:
+				isKnown = known[op.rs1];
+				value = values[op.rs1] + op.imm;
+				break;
+			case CPU::Operation::Beq: case CPU::Operation::Bne: case CPU::Operation::Blt:
+			case CPU::Operation::Bge: case CPU::Operation::BltU: case CPU::Operation::BgeU:
+			case CPU::Operation::Jal:
+				targets.push_back(pc + op.imm);
+				break;
+			default:
+				break;
+			}
+
+			if (op.rd != 0)
+			{
+				known[op.rd] = isKnown;
+				values[op.rd] = value;
+				if (isKnown && isTextAddr(value))
+					targets.push_back(value);
+			}
+		}
+
+		// Whatever the last instruction was, the next one can be reached: the fallthrough of a branch, the return address
+		// of a call or the instruction after an ecall
+		targets.push_back(startPc + 4 * (uint32_t)block.size());
+	}
+
+	// Writes the C++ function for the first nativeLength instructions of block
+	void writeBlock(std::ostream& out, const AOTBlock& block, uint32_t startPc, uint32_t nativeLength)
+	{
+		std::array<bool, 32> used = {};
+		std::array<bool, 32> written = {};
+		for (uint32_t i = 0; i < nativeLength; i++)
+		{
+			used[block[i].rs1] = used[block[i].rs2] = used[block[i].rd] = true;
+			written[block[i].rd] = true;
+		}
+
+		out << "static uint64_t " << blockName(startPc) << "(uint32_t* regs, uint8_t* ram)\n{\n";
+		out << "\tuint32_t x0 = 0; (void)x0;\n";
+		for (uint32_t i = 1; i < 32; i++)
+			if (used[i])
+				out << "\tuint32_t x" << i << " = regs[" << i << "];\n";
+
+		// Leaving the block writes the registers back and returns the next pc and the amount of executed instructions
+		std::string writeBack;
+		for (uint32_t i = 1; i < 32; i++)
+			if (written[i])
+				writeBack += "regs[" + std::to_string(i) + "] = x" + std::to_string(i) + "; ";
+		auto leave = [&writeBack](uint32_t executed, const std::string& nextPc) {
+			return "{ " + writeBack + "return ((uint64_t)" + std::to_string(executed) + " << 32) | " + nextPc + "; }";
+		};
+
+		bool endsWithJump = false;
+		for (uint32_t i = 0; i < nativeLength; i++)
+		{
+			const CPU::DecodedInstruction& op = block[i];
+			uint32_t pc = startPc + 4 * i;
+			std::string a = reg(op.rs1), b = reg(op.rs2), imm = hex(op.imm);
+			std::string rd = "x" + std::to_string(op.rd) + " = "; // x0 is a local that is never read
+			std::string sideExit = leave(i, hex(pc));
+
+			out << "\t";
+			switch (op.operation)
+			{
+			// Immediate
+			case CPU::Operation::AddI: out << rd << a << " + " << imm << ";"; break;
+			case CPU::Operation::SltI: out << rd << "((int32_t)" << a << " < (int32_t)" << imm << " ? 1U : 0U);"; break;
+			case CPU::Operation::SltIU: out << rd << "(" << a << " < " << imm << " ? 1U : 0U);"; break;
+			case CPU::Operation::XorI: out << rd << a << " ^ " << imm << ";"; break;
+			case CPU::Operation::OrI: out << rd << a << " | " << imm << ";"; break;
+			case CPU::Operation::AndI: out << rd << a << " & " << imm << ";"; break;
+			case CPU::Operation::SllI: out << rd << a << " << " << (op.imm & 0x1F) << ";"; break;
+			case CPU::Operation::SrlI: out << rd << a << " >> " << (op.imm & 0x1F) << ";"; break;
+			case CPU::Operation::SraI: out << rd << "(uint32_t)((int32_t)" << a << " >> " << (op.imm & 0x1F) << ");"; break;
+
+			// Register
+			case CPU::Operation::Add: out << rd << a << " + " << b << ";"; break;
+			case CPU::Operation::Sub: out << rd << a << " - " << b << ";"; break;
+			case CPU::Operation::Sll: out << rd << a << " << (" << b << " & 0x1F);"; break;
+			case CPU::Operation::Slt: out << rd << "((int32_t)" << a << " < (int32_t)" << b << " ? 1U : 0U);"; break;
+			case CPU::Operation::SltU: out << rd << "(" << a << " < " << b << " ? 1U : 0U);"; break;
+			case CPU::Operation::Xor: out << rd << a << " ^ " << b << ";"; break;
+			case CPU::Operation::Srl: out << rd << a << " >> (" << b << " & 0x1F);"; break;
+			case CPU::Operation::Sra: out << rd << "(uint32_t)((int32_t)" << a << " >> (" << b << " & 0x1F));"; break;
+			case CPU::Operation::Or: out << rd << a << " | " << b << ";"; break;
+			case CPU::Operation::And: out << rd << a << " & " << b << ";"; break;
+
+			// Multiply
+			case CPU::Operation::Mul: out << rd << a << " * " << b << ";"; break;
+			case CPU::Operation::MulH: out << rd << "(uint32_t)(((int64_t)(int32_t)" << a << " * (int64_t)(int32_t)" << b << ") >> 32);"; break;
+			case CPU::Operation::MulHSU: out << rd << "(uint32_t)(((int64_t)(int32_t)" << a << " * (int64_t)" << b << ") >> 32);"; break;
+			case CPU::Operation::MulHU: out << rd << "(uint32_t)(((uint64_t)" << a << " * " << b << ") >> 32);"; break;
+			// Division by 0 (and by -1, which can overflow) is left to the interpreter
+			case CPU::Operation::Div:
+				out << "if (" << b << " == 0 || " << b << " == 0xFFFFFFFFU) " << sideExit << " " << rd << "(uint32_t)((int32_t)" << a << " / (int32_t)" << b << ");";
+				break;
+			case CPU::Operation::Rem:
+				out << "if (" << b << " == 0 || " << b << " == 0xFFFFFFFFU) " << sideExit << " " << rd << "(uint32_t)((int32_t)" << a << " % (int32_t)" << b << ");";
+				break;
+			case CPU::Operation::DivU: out << "if (" << b << " == 0) " << sideExit << " " << rd << a << " / " << b << ";"; break;
+			case CPU::Operation::RemU: out << "if (" << b << " == 0) " << sideExit << " " << rd << a << " % " << b << ";"; break;
+
+			// Load and store, accesses outside RAM and misaligned accesses are left to the interpreter
+			case CPU::Operation::Lb: case CPU::Operation::Lh: case CPU::Operation::Lw: case CPU::Operation::LbU: case CPU::Operation::LhU:
+			{
+				const char* load =
+					op.operation == CPU::Operation::Lb ? "int8_t" : op.operation == CPU::Operation::Lh ? "int16_t" :
+					op.operation == CPU::Operation::LbU ? "uint8_t" : op.operation == CPU::Operation::LhU ? "uint16_t" : "uint32_t";
+				uint32_t size = (op.operation == CPU::Operation::Lw) ? 4 : (op.operation == CPU::Operation::Lh || op.operation == CPU::Operation::LhU) ? 2 : 1;
+				out << "{ uint32_t addr = " << a << " + " << imm << " - RamBase; ";
+				out << "if (addr > RamSize - " << size << " || (addr & " << size - 1 << ") != 0) " << sideExit << " ";
+				out << load << " value; std::memcpy(&value, ram + addr, " << size << "); ";
+				out << rd << "(uint32_t)(int32_t)value; }";
+				break;
+			}
+			case CPU::Operation::Sb: case CPU::Operation::Sh: case CPU::Operation::Sw:
+			{
+				const char* store = op.operation == CPU::Operation::Sb ? "uint8_t" : op.operation == CPU::Operation::Sh ? "uint16_t" : "uint32_t";
+				uint32_t size = (op.operation == CPU::Operation::Sw) ? 4 : (op.operation == CPU::Operation::Sh) ? 2 : 1;
+				out << "{ uint32_t addr = " << a << " + " << imm << " - RamBase; ";
+				out << "if (addr > RamSize - " << size << " || (addr & " << size - 1 << ") != 0 || addr - TextOffset < TextSize) " << sideExit << " ";
+				out << store << " value = (" << store << ")" << b << "; std::memcpy(ram + addr, &value, " << size << "); }";
+				break;
+			}
+
+			// Lui and Auipc
+			case CPU::Operation::Lui: out << rd << imm << ";"; break;
+			case CPU::Operation::Auipc: out << rd << hex(pc + op.imm) << ";"; break;
+
+			// Branch
+			case CPU::Operation::Beq: case CPU::Operation::Bne: case CPU::Operation::Blt:
+			case CPU::Operation::Bge: case CPU::Operation::BltU: case CPU::Operation::BgeU:
+			{
+				bool isSigned = op.operation == CPU::Operation::Blt || op.operation == CPU::Operation::Bge;
+				const char* comparison =
+					op.operation == CPU::Operation::Beq ? " == " : op.operation == CPU::Operation::Bne ? " != " :
+					(op.operation == CPU::Operation::Blt || op.operation == CPU::Operation::BltU) ? " < " : " >= ";
+				std::string cast = isSigned ? "(int32_t)" : "";
+				out << "if (" << cast << a << comparison << cast << b << ") " << leave(i + 1, hex(pc + op.imm)) << "\n";
+				out << "\t" << leave(i + 1, hex(pc + 4));
+				endsWithJump = true;
+				break;
+			}
+
+			// Jal and Jalr
+			case CPU::Operation::Jal:
+				out << rd << hex(pc + 4) << ";\n\t" << leave(i + 1, hex(pc + op.imm));
+				endsWithJump = true;
+				break;
+			case CPU::Operation::Jalr:
+				// CPU::Jalr writes rd before reading rs1, so when they are the same register the target is relative to pc + 4
+				out << "{ uint32_t target = (" << ((op.rd == op.rs1 && op.rd != 0) ? hex(pc + 4) : a) << " + " << imm << ") & ~1U; ";
+				out << "if ((target & 3) != 0) " << sideExit << " " << rd << hex(pc + 4) << "; " << leave(i + 1, "target") << " }";
+				endsWithJump = true;
+				break;
+
+			// Fence and Nop
+			case CPU::Operation::Fence:
+			case CPU::Operation::Nop:
+			default:
+				out << "// " << CPU::operationNames[(size_t)op.operation];
+				break;
+			}
+			out << "\n";
+		}
+
+		if (!endsWithJump)
+			out << "\t" << leave(nativeLength, hex(startPc + 4 * nativeLength)) << "\n";
+		out << "}\n\n";
+	}
+}
+
+AOT::AOT()
+{
+}
+
+AOT::~AOT()
+{
+	if (library == nullptr)
+		return;
+
+#if defined(_WIN32)
+	FreeLibrary((HMODULE)library);
+#else
+	dlclose(library);
+#endif
+}
+
+uint32_t AOT::generate(Bus* bus, uint64_t imageHash, std::ostream& out)
+{
+	// Recover the control flow graph, starting at the reset address
+	std::map<uint32_t, AOTBlock> blocks;
+	std::vector<uint32_t> targets = { MemoryMap::Text.BaseAddr };
+	while (!targets.empty())
+	{
+		uint32_t startPc = targets.back();
+		targets.pop_back();
+		if (!isTextAddr(startPc) || blocks.count(startPc) != 0)
+			continue;
+
+		AOTBlock block = readBlock(bus, startPc);
+		if (block.empty())
+			continue;
+
+		findTargets(block, startPc, targets);
+		BlockOptimizer::optimize(block, startPc); // the same code as the block engine executes
+		blocks[startPc] = std::move(block);
+	}
+
+	out << "// Generated by RISC-V --aot, do not edit\n";
+	out << "#include <cstdint>\n#include <cstring>\n\n";
+	out << "#if defined(_WIN32)\n#define AOT_EXPORT extern \"C\" __declspec(dllexport)\n";
+	out << "#else\n#define AOT_EXPORT extern \"C\" __attribute__((visibility(\"default\")))\n#endif\n\n";
+	out << "static const uint32_t RamBase = " << hex(MemoryMap::RAM.BaseAddr) << ";\n";
+	out << "static const uint32_t RamSize = " << hex(MemoryMap::RAM.LimitAddr - MemoryMap::RAM.BaseAddr + 1) << ";\n";
+	out << "static const uint32_t TextOffset = " << hex(MemoryMap::Text.BaseAddr - MemoryMap::RAM.BaseAddr) << ";\n";
+	out << "static const uint32_t TextSize = " << hex(MemoryMap::Text.LimitAddr - MemoryMap::Text.BaseAddr + 1) << ";\n\n";
+
+	uint32_t translated = 0;
+	std::map<uint32_t, uint32_t> nativeLengths;
+	for (const auto& entry : blocks)
+	{
+		const AOTBlock& block = entry.second;
+		uint32_t nativeLength = 0;
+		while (nativeLength < block.size() && JIT::isTranslatable(block[nativeLength], entry.first + 4 * nativeLength))
+			nativeLength++;
+		if (nativeLength == 0)
+			continue;
+
+		nativeLengths[entry.first] = nativeLength;
+		out << "static const uint32_t " << blockName(entry.first) << "_instructions[] = {";
+		for (uint32_t i = 0; i < block.size(); i++)
+			out << (i % 8 == 0 ? "\n\t" : " ") << hex(block[i].instruction) << ",";
+		out << "\n};\n";
+		writeBlock(out, block, entry.first, nativeLength);
+		translated++;
+	}
+
+	// The table has to match AOT::Block and AOT::Module
+	out << "struct Block { uint32_t startPc; uint32_t length; uint32_t nativeLength; const uint32_t* instructions; uint64_t(*native)(uint32_t*, uint8_t*); };\n";
+	out << "struct Module { uint32_t version; uint64_t imageHash; uint32_t blockCount; const Block* blocks; };\n\n";
+	out << "static const Block blocks[] = {\n";
+	for (const auto& entry : nativeLengths)
+	{
+		std::string name = blockName(entry.first);
+		out << "\t{ " << hex(entry.first) << ", " << blocks[entry.first].size() << ", " << entry.second << ", " << name << "_instructions, " << name << " },\n";
+	}
+	if (nativeLengths.empty())
+		out << "\t{ 0, 0, 0, nullptr, nullptr },\n";
+	out << "};\n\n";
+	out << "static const Module table = { " << Version << ", 0x" << std::hex << imageHash << std::dec << "ULL, " << translated << ", blocks };\n\n";
+	out << "AOT_EXPORT const Module* aotModule()\n{\n\treturn &table;\n}\n";
+
+	return translated;
+}
+
+bool AOT::compile(const std::string& sourceFile, const std::string& libraryFile)
+{
+#if defined(_WIN32)
+	std::string command = "cl /nologo /O2 /LD \"" + sourceFile + "\" /Fe\"" + libraryFile + "\"";
+#else
+	std::string command = "c++ -std=c++17 -O2 -shared -fPIC -o \"" + libraryFile + "\" \"" + sourceFile + "\"";
+#endif
+	return std::system(command.c_str()) == 0;
+}
+
+bool AOT::load(const std::string& fileName, uint64_t imageHash)
+{
+#if defined(_WIN32)
+	HMODULE handle = LoadLibraryA(fileName.c_str());
+	if (handle == nullptr)
+		return false;
+	library = handle;
+	ModuleFunction moduleFunction = (ModuleFunction)GetProcAddress(handle, "aotModule");
+#else
+	library = dlopen(fileName.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (library == nullptr)
+		return false;
+	ModuleFunction moduleFunction = (ModuleFunction)dlsym(library, "aotModule");
+#endif
+	if (moduleFunction == nullptr)
+		return false;
+
+	const Module* module = moduleFunction();
+	if (module->version != Version || module->imageHash != imageHash)
+		return false;
+
+	for (uint32_t i = 0; i < module->blockCount; i++)
+		blocks[module->blocks[i].startPc] = &module->blocks[i];
+	return true;
+}
+
+CPU::NativeBlock AOT::find(const CPU::BasicBlock& block, uint32_t& nativeLength)
+{
+	auto it = blocks.find(block.startPc);
+	if (it == blocks.end())
+		return nullptr;
+
+	// The code could have been changed since the module was generated
+	const Block& aotBlock = *it->second;
+	if (aotBlock.length != block.ops.size())
+		return nullptr;
+	for (uint32_t i = 0; i < aotBlock.length; i++)
+		if (aotBlock.instructions[i] != block.ops[i].instruction)
+			return nullptr;
+
+	nativeLength = aotBlock.nativeLength;
+	return aotBlock.native;
+}
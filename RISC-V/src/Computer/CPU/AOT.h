@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <ostream>
+#include <unordered_map>
+#include "CPU.h"
+
+// Ahead-of-time translation of a program into a shared library. generate() recovers the blocks that can be reached from
+// the reset address through jumps, branches, return addresses and code addresses built with lui/auipc, and writes C++
+// with a NativeBlock function for each of them. The functions exit to the interpreter in exactly the same places as
+// the JIT's code (MMIO, stores to the Text range, CSR instructions, traps...), so the Bus devices keep working.
+// At runtime the module is a table of blocks indexed by their start address, which also serves jalr. A block is only
+// used when its instructions still match memory, code that is unknown or was modified runs on the interpreter.
+class AOT
+{
+public:
+	// The layout of the table exported by a module, the generated code declares the same structs
+	static constexpr uint32_t Version = 1;
+	struct Block
+	{
+		uint32_t startPc;
+		uint32_t length; // the amount of instructions in the block
+		uint32_t nativeLength; // the amount of them that native executes
+		const uint32_t* instructions;
+		CPU::NativeBlock native;
+	};
+	struct Module
+	{
+		uint32_t version;
+		uint64_t imageHash;
+		uint32_t blockCount;
+		const Block* blocks;
+	};
+	typedef const Module* (*ModuleFunction)();
+
+public:
+	AOT();
+	~AOT();
+
+public:
+	// Writes the C++ source of a module for the program that is currently in memory, imageHash identifies it (see
+	// RAM::imageHash). Returns the amount of blocks that were translated.
+	static uint32_t generate(Bus* bus, uint64_t imageHash, std::ostream& out);
+	// Compiles a generated source file into a shared library using the host's compiler, returns false if that failed
+	static bool compile(const std::string& sourceFile, const std::string& libraryFile);
+
+public:
+	// Returns false if the library can't be loaded, or was generated with another version or for another program
+	bool load(const std::string& fileName, uint64_t imageHash);
+	// Returns the native code for block and sets nativeLength, or nullptr if there is none or the code doesn't match
+	CPU::NativeBlock find(const CPU::BasicBlock& block, uint32_t& nativeLength);
+
+private:
+	void* library = nullptr;
+	std::unordered_map<uint32_t, const Block*> blocks;
+};
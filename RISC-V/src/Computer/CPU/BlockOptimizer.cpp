@@ -0,0 +1,179 @@
+#include <cstdint>
+#include <array>
+#include "BlockOptimizer.h"
+
+namespace
+{
+	// Returns the k for which value == 1 << k, or -1 if value isn't a power of two
+	int log2Exact(uint32_t value)
+	{
+		if (value == 0 || (value & (value - 1)) != 0)
+			return -1;
+
+		int k = 0;
+		while ((value >> k) != 1)
+			k++;
+		return k;
+	}
+}
+
+void BlockOptimizer::optimize(std::vector<CPU::MicroOp>& ops, uint32_t startPc)
+{
+	propagateConstants(ops, startPc);
+}
+
+void BlockOptimizer::propagateConstants(std::vector<CPU::MicroOp>& ops, uint32_t startPc)
+{
+	std::array<bool, 32> known = {};
+	std::array<uint32_t, 32> values = {};
+	known[0] = true;
+
+	for (uint32_t i = 0; i < ops.size(); i++)
+	{
+		CPU::MicroOp& op = ops[i];
+		uint32_t pc = startPc + 4 * i;
+		bool isImmediate = op.operation <= CPU::Operation::SraI;
+		bool isRegister = CPU::Operation::Add <= op.operation && op.operation <= CPU::Operation::RemU;
+
+		if (op.operation == CPU::Operation::Auipc)
+			rewrite(op, CPU::Operation::Lui, 0, pc + op.imm);
+		else if (isImmediate || isRegister)
+		{
+			uint32_t b = isImmediate ? op.imm : values[op.rs2];
+			uint32_t result = 0;
+			if (known[op.rs1] && (isImmediate || known[op.rs2]) && evaluate(op.operation, values[op.rs1], b, result))
+				rewrite(op, CPU::Operation::Lui, 0, result);
+			else if (isRegister)
+			{
+				// Turn a known operand into an immediate, or reduce the operation if the operand is a power of two
+				bool knownA = known[op.rs1], knownB = known[op.rs2];
+				uint32_t a = values[op.rs1];
+				switch (op.operation)
+				{
+				case CPU::Operation::Add:
+					if (knownB) rewrite(op, CPU::Operation::AddI, op.rs1, b);
+					else if (knownA) rewrite(op, CPU::Operation::AddI, op.rs2, a);
+					break;
+				case CPU::Operation::Sub:
+					if (knownB) rewrite(op, CPU::Operation::AddI, op.rs1, 0 - b);
+					break;
+				case CPU::Operation::Xor:
+					if (knownB) rewrite(op, CPU::Operation::XorI, op.rs1, b);
+					else if (knownA) rewrite(op, CPU::Operation::XorI, op.rs2, a);
+					break;
+				case CPU::Operation::Or:
+					if (knownB) rewrite(op, CPU::Operation::OrI, op.rs1, b);
+					else if (knownA) rewrite(op, CPU::Operation::OrI, op.rs2, a);
+					break;
+				case CPU::Operation::And:
+					if (knownB) rewrite(op, CPU::Operation::AndI, op.rs1, b);
+					else if (knownA) rewrite(op, CPU::Operation::AndI, op.rs2, a);
+					break;
+				case CPU::Operation::Sll:
+					if (knownB) rewrite(op, CPU::Operation::SllI, op.rs1, b & 0x1F);
+					break;
+				case CPU::Operation::Srl:
+					if (knownB) rewrite(op, CPU::Operation::SrlI, op.rs1, b & 0x1F);
+					break;
+				case CPU::Operation::Sra:
+					if (knownB) rewrite(op, CPU::Operation::SraI, op.rs1, b & 0x1F);
+					break;
+				case CPU::Operation::Slt:
+					if (knownB) rewrite(op, CPU::Operation::SltI, op.rs1, b);
+					break;
+				case CPU::Operation::SltU:
+					if (knownB) rewrite(op, CPU::Operation::SltIU, op.rs1, b);
+					break;
+				case CPU::Operation::Mul:
+					if (knownB && log2Exact(b) >= 0) rewrite(op, CPU::Operation::SllI, op.rs1, log2Exact(b));
+					else if (knownA && log2Exact(a) >= 0) rewrite(op, CPU::Operation::SllI, op.rs2, log2Exact(a));
+					else if ((knownA && a == 0) || (knownB && b == 0)) rewrite(op, CPU::Operation::Lui, 0, 0);
+					break;
+				case CPU::Operation::DivU:
+					if (knownB && log2Exact(b) >= 0) rewrite(op, CPU::Operation::SrlI, op.rs1, log2Exact(b));
+					break;
+				case CPU::Operation::RemU:
+					if (knownB && log2Exact(b) >= 0) rewrite(op, CPU::Operation::AndI, op.rs1, b - 1);
+					break;
+				default:
+					break;
+				}
+			}
+		}
+		else if (CPU::Operation::Beq <= op.operation && op.operation <= CPU::Operation::BgeU && known[op.rs1] && known[op.rs2])
+		{
+			// The direction of the branch is known, it becomes a jump or falls through
+			bool taken = false;
+			uint32_t a = values[op.rs1], b = values[op.rs2];
+			switch (op.operation)
+			{
+			case CPU::Operation::Beq: taken = a == b; break;
+			case CPU::Operation::Bne: taken = a != b; break;
+			case CPU::Operation::Blt: taken = (int32_t)a < (int32_t)b; break;
+			case CPU::Operation::Bge: taken = (int32_t)a >= (int32_t)b; break;
+			case CPU::Operation::BltU: taken = a < b; break;
+			case CPU::Operation::BgeU: taken = a >= b; break;
+			default: break;
+			}
+			if (taken)
+				rewrite(op, CPU::Operation::Jal, 0, op.imm);
+			else
+				rewrite(op, CPU::Operation::Nop, 0, 0);
+		}
+
+		// Track the value of the destination register
+		if (op.rd != 0)
+		{
+			known[op.rd] = op.operation == CPU::Operation::Lui;
+			values[op.rd] = op.imm;
+		}
+	}
+}
+
+bool BlockOptimizer::evaluate(CPU::Operation operation, uint32_t a, uint32_t b, uint32_t& result)
+{
+	switch (operation)
+	{
+	case CPU::Operation::AddI: case CPU::Operation::Add: result = a + b; return true;
+	case CPU::Operation::Sub: result = a - b; return true;
+	case CPU::Operation::SltI: case CPU::Operation::Slt: result = (int32_t)a < (int32_t)b ? 1 : 0; return true;
+	case CPU::Operation::SltIU: case CPU::Operation::SltU: result = a < b ? 1 : 0; return true;
+	case CPU::Operation::XorI: case CPU::Operation::Xor: result = a ^ b; return true;
+	case CPU::Operation::OrI: case CPU::Operation::Or: result = a | b; return true;
+	case CPU::Operation::AndI: case CPU::Operation::And: result = a & b; return true;
+	case CPU::Operation::SllI: case CPU::Operation::Sll: result = a << (b & 0x1F); return true;
+	case CPU::Operation::SrlI: case CPU::Operation::Srl: result = a >> (b & 0x1F); return true;
+	case CPU::Operation::SraI: case CPU::Operation::Sra: result = (uint32_t)((int32_t)a >> (b & 0x1F)); return true;
+	case CPU::Operation::Mul: result = a * b; return true;
+	case CPU::Operation::MulH: result = (uint32_t)((uint64_t)((int64_t)(int32_t)a * (int64_t)(int32_t)b) >> 32); return true;
+	case CPU::Operation::MulHSU: result = (uint32_t)((uint64_t)((int64_t)(int32_t)a * (int64_t)(uint64_t)b) >> 32); return true;
+	case CPU::Operation::MulHU: result = (uint32_t)(((uint64_t)a * (uint64_t)b) >> 32); return true;
+	case CPU::Operation::DivU: result = b == 0 ? 0xFFFF'FFFF : a / b; return true;
+	case CPU::Operation::RemU: result = b == 0 ? a : a % b; return true;
+	case CPU::Operation::Div:
+	case CPU::Operation::Rem:
+		// The overflowing INT_MIN / -1 is left to CPU::Div and CPU::Rem
+		if (a == 0x8000'0000U && b == 0xFFFF'FFFFU)
+			return false;
+		if (operation == CPU::Operation::Div)
+			result = b == 0 ? 0xFFFF'FFFF : (uint32_t)((int32_t)a / (int32_t)b);
+		else
+			result = b == 0 ? a : (uint32_t)((int32_t)a % (int32_t)b);
+		return true;
+	default:
+		return false;
+	}
+}
+
+void BlockOptimizer::rewrite(CPU::MicroOp& op, CPU::Operation operation, uint8_t rs1, uint32_t imm)
+{
+	// Operands an operation doesn't use are 0, the JIT relies on that
+	op.operation = operation;
+	op.argumentType = CPU::argumentTypes[(size_t)operation];
+	op.execute = CPU::executeLookup[(size_t)operation];
+	op.rs1 = rs1;
+	op.rs2 = 0;
+	op.imm = imm;
+	if (operation == CPU::Operation::Nop)
+		op.rd = 0;
+}
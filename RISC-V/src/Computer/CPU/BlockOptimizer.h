@@ -0,0 +1,27 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "CPU.h"
+
+// Optimises the MicroOps of a basic block before it is executed by the block engine or translated by the JIT and AOT.
+// The passes only rewrite the operation and operands of an op, the raw instruction is kept:
+// - constant propagation: x0 and the results of lui, auipc and other instructions with constant operands are tracked,
+//   instructions whose operands are all known become a lui of the result
+// - operand specialisation: a register operand with a known value is turned into an immediate, so it isn't read
+// - strength reduction: mul, divu and remu by a power of two become shifts and masks
+// Every instruction still writes the same register with the same value, only from the values written earlier in the
+// block. The block engine can stop after any instruction (when the budget runs out, at a debug stop or an interrupt)
+// and continues with a new block starting at the next one, so removing writes that are overwritten later in the block
+// isn't possible, their value would be missing there.
+class BlockOptimizer
+{
+public:
+	static void optimize(std::vector<CPU::MicroOp>& ops, uint32_t startPc);
+
+private:
+	static void propagateConstants(std::vector<CPU::MicroOp>& ops, uint32_t startPc);
+
+	// Calculates the result of a pure operation with operands a and b, returns false if it can't be folded
+	static bool evaluate(CPU::Operation operation, uint32_t a, uint32_t b, uint32_t& result);
+	static void rewrite(CPU::MicroOp& op, CPU::Operation operation, uint8_t rs1, uint32_t imm);
+};
@@ -1,18 +1,76 @@
 #include <cstdint>
 #include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
 #include "../MemoryMap.h"
 #include "CPU.h"
 #include "CSR.h"
+#include "JIT.h"
+#include "Fastmem.h"
+#include "AOT.h"
+#include "BlockOptimizer.h"
+#include "LoopIdiom.h"
+#include "CorePolicies.h"
+#include "ISA.h"
+
+const std::array<CPU::ExecuteFunction, (size_t)CPU::Operation::Count> CPU::executeLookup = {
+	&CPU::AddI, &CPU::SltI, &CPU::SltIU, &CPU::XorI, &CPU::OrI, &CPU::AndI, &CPU::SllI, &CPU::SrlI, &CPU::SraI,
+	&CPU::Add, &CPU::Sub, &CPU::Sll, &CPU::Slt, &CPU::SltU, &CPU::Xor, &CPU::Srl, &CPU::Sra, &CPU::Or, &CPU::And,
+	&CPU::Mul, &CPU::MulH, &CPU::MulHSU, &CPU::MulHU, &CPU::Div, &CPU::DivU, &CPU::Rem, &CPU::RemU,
+	&CPU::Lb<true>, &CPU::Lh<true>, &CPU::Lw<true>, &CPU::LbU<true>, &CPU::LhU<true>,
+	&CPU::Sb<true>, &CPU::Sh<true>, &CPU::Sw<true>,
+	&CPU::Lui, &CPU::Auipc,
+	&CPU::Beq, &CPU::Bne, &CPU::Blt, &CPU::Bge, &CPU::BltU, &CPU::BgeU,
+	&CPU::Jal, &CPU::Jalr,
+	&CPU::Fence,
+	&CPU::CsrRW, &CPU::CsrRS, &CPU::CsrRC, &CPU::CsrRWI, &CPU::CsrRSI, &CPU::CsrRCI,
+	&CPU::Ebreak, &CPU::Ecall, &CPU::Mret,
+	&CPU::Illegal, &CPU::Nop
+};
+
+const std::array<const wchar_t*, (size_t)CPU::Operation::Count> CPU::operationNames = {
+	L"addi", L"slti", L"sltiu", L"xori", L"ori", L"andi", L"slli", L"srli", L"srai",
+	L"add", L"sub", L"sll", L"slt", L"sltu", L"xor", L"srl", L"sra", L"or", L"and",
+	L"mul", L"mulh", L"mulhsu", L"mulhu", L"div", L"divu", L"rem", L"remu",
+	L"lb", L"lh", L"lw", L"lbu", L"lhu",
+	L"sb", L"sh", L"sw",
+	L"lui", L"auipc",
+	L"beq", L"bne", L"blt", L"bge", L"bltu", L"bgeu",
+	L"jal", L"jalr",
+	L"fence",
+	L"csrrw", L"csrrs", L"csrrc", L"csrrwi", L"csrrsi", L"csrrci",
+	L"ebreak", L"ecall", L"mret",
+	L"???", L"nop"
+};
+
+const std::array<CPU::ArgumentType, (size_t)CPU::Operation::Count> CPU::argumentTypes = {
+	ArgumentType::Immediate, ArgumentType::Immediate, ArgumentType::Immediate, ArgumentType::Immediate, ArgumentType::Immediate, 
+	ArgumentType::Immediate, ArgumentType::Immediate, ArgumentType::Immediate, ArgumentType::Immediate,
+	ArgumentType::Register, ArgumentType::Register, ArgumentType::Register, ArgumentType::Register, ArgumentType::Register, 
+	ArgumentType::Register, ArgumentType::Register, ArgumentType::Register, ArgumentType::Register, ArgumentType::Register,
+	ArgumentType::Register, ArgumentType::Register, ArgumentType::Register, ArgumentType::Register, ArgumentType::Register, 
+	ArgumentType::Register, ArgumentType::Register, ArgumentType::Register,
+	ArgumentType::LoadType, ArgumentType::LoadType, ArgumentType::LoadType, ArgumentType::LoadType, ArgumentType::LoadType,
+	ArgumentType::StoreType, ArgumentType::StoreType, ArgumentType::StoreType,
+	ArgumentType::Upper, ArgumentType::Upper,
+	ArgumentType::Branch, ArgumentType::Branch, ArgumentType::Branch, ArgumentType::Branch, ArgumentType::Branch, ArgumentType::Branch,
+	ArgumentType::Jump, ArgumentType::Immediate,
+	ArgumentType::FenceType,
+	ArgumentType::CSRRegister, ArgumentType::CSRRegister, ArgumentType::CSRRegister, 
+	ArgumentType::CSRImmediate, ArgumentType::CSRImmediate, ArgumentType::CSRImmediate,
+	ArgumentType::None, ArgumentType::None, ArgumentType::None,
+	ArgumentType::None, ArgumentType::None
+};
 
 CPU::CPU(const std::function<void()>& startDebug)
-	: csr(this, startDebug)
+	: csr(this, [this, startDebug]() { debugStarted = true; startDebug(); })
 {
-	opcodeLookup = {
-		&CPU::LOAD,   &CPU::XXX,  &CPU::XXX, &CPU::MISC_MEM, &CPU::OP_IMM, &CPU::AUIPC, &CPU::XXX, &CPU::XXX,
-		&CPU::STORE,  &CPU::XXX,  &CPU::XXX, &CPU::XXX,      &CPU::OP,     &CPU::LUI,   &CPU::XXX, &CPU::XXX,
-		&CPU::XXX,    &CPU::XXX,  &CPU::XXX, &CPU::XXX,      &CPU::XXX,    &CPU::XXX,   &CPU::XXX, &CPU::XXX,
-		&CPU::BRANCH, &CPU::JALR, &CPU::XXX, &CPU::JAL,      &CPU::SYSTEM, &CPU::XXX,   &CPU::XXX, &CPU::XXX,
-	};
+	predecodeCache.resize((MemoryMap::Text.LimitAddr - MemoryMap::Text.BaseAddr + 1) / PredecodePageSize);
+	blockPages.resize(predecodeCache.size());
+	fetchFaultOp.execute = &CPU::Nop;
+	fetchFaultOp.operation = Operation::Nop;
+	flushTlbs();
 
 	reset();
 }
@@ -25,41 +83,84 @@ void CPU::connectBus(Bus* bus)
 {
 	this->bus = bus;
 	timer = bus->timer;
+
+	flushTlbs();
+	fastmemBase = fastmem != nullptr && fastmem->matchesBus(bus) ? fastmem->getBase() : nullptr;
+
+	// Native code accesses RAM directly, so it needs RAM to be one block of host memory. That can be smaller than the RAM
+	// range when the size of RAM is set at runtime, the rest of the range is then accessed like MMIO.
+	jit.reset();
+	ramHostPointer = bus->getHostPointer(MemoryMap::RAM.BaseAddr);
+	ramHostSize = ramHostPointer != nullptr ? bus->getHostSize(MemoryMap::RAM.BaseAddr) : 0;
+	if (ramHostSize == 0)
+		ramHostPointer = nullptr;
+	if (ramHostPointer != nullptr)
+	{
+		// The translated code can only use the window if RAM is the memory in it
+		bool jitFastmem = fastmemBase != nullptr && ramHostPointer == fastmemBase + MemoryMap::RAM.BaseAddr;
+		jit = std::make_unique<JIT>(MemoryMap::RAM.BaseAddr, ramHostSize, jitFastmem ? fastmem : nullptr);
+		if (!jit->isAvailable())
+			jit.reset();
+	}
+	flushBlockCache();
+}
+
+void CPU::useFastmem(Fastmem* fastmem)
+{
+	this->fastmem = fastmem != nullptr && fastmem->isAvailable() ? fastmem : nullptr;
 }
 
 void CPU::clock()
+{
+	const MicroOp* op = beginInstruction();
+	(this->*op->execute)(*op);
+	retireInstruction();
+}
+
+void CPU::clock(uint64_t count)
+{
+	switch (engine)
+	{
+	case Engine::Threaded:
+		clockThreaded(count);
+		break;
+	case Engine::Blocks:
+	case Engine::JIT:
+		clockBlocks(count);
+		break;
+	case Engine::Interpreter:
+	default:
+		// The core stops early when debugging starts, clock() carries on
+		while (count > 0)
+			count -= runCore(count, nullptr, false).executed;
+		break;
+	}
+}
+
+const CPU::MicroOp* CPU::beginInstruction()
 {
 	csr.clock();
 
 	currentExceptionType = ExceptionType::NoException;
 	newPc = pc + 4;
-	MemAccessResult instrAccessResult = bus->read(pc, instruction);
-	if (instrAccessResult == MemAccessResult::NotInRange)
-		createException(ExceptionType::InstructionAccessFault, pc);
-	else if (instrAccessResult == MemAccessResult::Misaligned) // This should not be possible, pc should always be 4-byte aligned
-		throw "instruction accesses should never be misaligned";
-	else
+	const MicroOp* op = fetch(pc);
+	if (op == nullptr)
 	{
-		// Succes
-		uint32_t opcode = ((InstructionType::B*)&instruction)->opcode;
+		createException(ExceptionType::InstructionAccessFault, pc);
+		return &fetchFaultOp;
+	}
 
-		if ((opcode & 0b11) != 0b11)
-		{
-			createException(ExceptionType::IllegalInstruction, instruction);
-		}
-		else
-		{
-			InstructionDecoder decoder = opcodeLookup[opcode >> 2];
-			Instruction instr = (this->*decoder)(instruction);
-		
-			(this->*instr.execute)();
+	instruction = op->instruction;
+	return op;
+}
 
-			if ((newPc & 3) != 0)
-				createException(ExceptionType::InstructionAddressMisaligned, newPc);
-		}
-	}
+bool CPU::retireInstruction(bool checkInterrupts)
+{
+	if ((newPc & 3) != 0)
+		createException(ExceptionType::InstructionAddressMisaligned, newPc);
 
-	if (currentExceptionType != ExceptionType::NoException)
+	bool trapped = currentExceptionType != ExceptionType::NoException;
+	if (trapped)
 	{
 		// An exception occured
 		pc = csr.executeException(pc, getCause(currentExceptionType), exceptionVal, false);
@@ -67,6 +168,9 @@ void CPU::clock()
 	else
 		pc = newPc;
 
+	if (!checkInterrupts || !csr.isInterruptCheckPending())
+		return trapped;
+
 	// Interrupts are checked at the very end to simulate being at the very front while keeping both exception types close together
 	// Being at the front avoids getting the wrong mepc when an interrupt is available immediately upon executing an mret, as
 	// well as the problem of an exception getting lost when an interrupt occurs on the same instruction.
@@ -74,14 +178,301 @@ void CPU::clock()
 
 	if (interrupts.hasInterrupt) {
 		pc = interrupts.newPc;
+		trapped = true;
+	}
+	return trapped;
+}
+
+CPU::RunResult CPU::run(uint64_t maxInstructions)
+{
+	if (engine == Engine::Interpreter)
+		return runCore(maxInstructions, nullptr, false);
+
+	// The engines run until count is used up, so they are given no more than the debug countdown and stop right after it
+	debugStarted = false;
+	uint64_t executed = 0;
+	while (executed < maxInstructions)
+	{
+		uint64_t count = maxInstructions - executed;
+		// A countdown of 0 already started debugging during the last instruction
+		uint32_t debugCountdown = csr.getDebugCountdown();
+		if (debugCountdown != 0xFFFF'FFFF && debugCountdown != 0)
+			count = std::min<uint64_t>(count, debugCountdown);
+
+		clock(count);
+		executed += count;
+		if (debugStarted)
+			return { StopReason::Debug, executed };
+	}
+
+	return { StopReason::Budget, executed };
+}
+
+CPU::RunResult CPU::runUntil(uint32_t addr, uint64_t maxInstructions)
+{
+	return runCore(maxInstructions, &addr, false);
+}
+
+CPU::RunResult CPU::runUntilTrap(uint64_t maxInstructions)
+{
+	return runCore(maxInstructions, nullptr, true);
+}
+
+const std::array<CPU::CoreFunction, (size_t)CPU::Core::Count> CPU::coreLookup = {
+	&CPU::runInterpreted<FastCore>,
+	&CPU::runInterpreted<InstrumentedCore>,
+	&CPU::runInterpreted<RV32ICore>
+};
+
+// The execute functions of cores that send every load and store through the bus
+static const std::array<CPU::ExecuteFunction, (size_t)CPU::Operation::Count> busExecuteLookup = []()
+{
+	std::array<CPU::ExecuteFunction, (size_t)CPU::Operation::Count> lookup = CPU::executeLookup;
+	lookup[(size_t)CPU::Operation::Lb] = &CPU::Lb<false>;
+	lookup[(size_t)CPU::Operation::Lh] = &CPU::Lh<false>;
+	lookup[(size_t)CPU::Operation::Lw] = &CPU::Lw<false>;
+	lookup[(size_t)CPU::Operation::LbU] = &CPU::LbU<false>;
+	lookup[(size_t)CPU::Operation::LhU] = &CPU::LhU<false>;
+	lookup[(size_t)CPU::Operation::Sb] = &CPU::Sb<false>;
+	lookup[(size_t)CPU::Operation::Sh] = &CPU::Sh<false>;
+	lookup[(size_t)CPU::Operation::Sw] = &CPU::Sw<false>;
+	return lookup;
+}();
+
+CPU::RunResult CPU::runCore(uint64_t maxInstructions, const uint32_t* stopPc, bool stopOnTrap)
+{
+	return (this->*coreLookup[(size_t)core])(maxInstructions, stopPc, stopOnTrap);
+}
+
+std::vector<CPU::TraceEntry> CPU::getTrace()
+{
+	std::vector<TraceEntry> trace;
+	for (uint64_t i = traced - std::min<uint64_t>(traced, TraceSize); i < traced; i++)
+		trace.push_back(traceBuffer[i % TraceSize]);
+	return trace;
+}
+
+template <typename Config>
+CPU::RunResult CPU::runInterpreted(uint64_t maxInstructions, const uint32_t* stopPc, bool stopOnTrap)
+{
+	// Whether an interrupt can be taken only changes with the SYSTEM instructions (CSR writes and mret) and traps, so it
+	// is only checked again after those instead of every instruction
+	bool interruptsEnabled = csr.interruptsEnabled();
+	debugStarted = false;
+
+	uint64_t executed = 0;
+	while (executed < maxInstructions)
+	{
+		const MicroOp* op = beginInstruction();
+		Config::Tracer::trace(*this, *op);
+
+		ExecuteFunction execute = Config::Memory::Direct ? op->execute : busExecuteLookup[(size_t)op->operation];
+		if (!Config::Extensions::M && Operation::Mul <= op->operation && op->operation <= Operation::RemU)
+			execute = &CPU::Illegal;
+		(this->*execute)(*op);
+
+		Config::Timing::execute(*this, *op);
+		bool trapped = retireInstruction(interruptsEnabled);
+		executed++;
+
+		if (trapped || (Operation::CsrRW <= op->operation && op->operation <= Operation::Mret))
+		{
+			bool wereEnabled = interruptsEnabled;
+			interruptsEnabled = csr.interruptsEnabled();
+			if (!trapped && !wereEnabled && interruptsEnabled)
+			{
+				// The CSR write or mret can enable an interrupt that is already pending
+				auto interrupts = csr.checkInterrupts(pc);
+				if (interrupts.hasInterrupt)
+				{
+					pc = interrupts.newPc;
+					trapped = true;
+					interruptsEnabled = csr.interruptsEnabled();
+				}
+			}
+		}
+
+		if (debugStarted)
+			return { StopReason::Debug, executed };
+		if (trapped && stopOnTrap)
+			return { StopReason::Trap, executed };
+		if (stopPc != nullptr && pc == *stopPc)
+			return { StopReason::ReachedPc, executed };
+	}
+
+	return { StopReason::Budget, executed };
+}
+
+// Threaded interpreter
+// Every operation has its own block of code which ends by jumping directly to the block of the next instruction. On GCC and
+// Clang this uses computed gotos, so there is a separate (and better predicted) indirect jump at the end of every operation.
+// Other compilers fall back to a switch in a loop, which still avoids the calls through member function pointers.
+#if defined(__GNUC__)
+#define THREADED_OPERATION(name) L_##name:
+#define THREADED_NEXT() \
+	retireInstruction(); \
+	if (count-- == 0) return; \
+	op = beginInstruction(); \
+	goto *dispatchTable[(size_t)op->operation]
+#else
+#define THREADED_OPERATION(name) case Operation::name:
+#define THREADED_NEXT() \
+	retireInstruction(); \
+	continue
+#endif
+
+void CPU::clockThreaded(uint64_t count)
+{
+	if (count == 0)
+		return;
+	count--;
+	const MicroOp* op = beginInstruction();
+
+#if defined(__GNUC__)
+	static void* const dispatchTable[(size_t)Operation::Count] = {
+		&&L_AddI, &&L_SltI, &&L_SltIU, &&L_XorI, &&L_OrI, &&L_AndI, &&L_SllI, &&L_SrlI, &&L_SraI,
+		&&L_Add, &&L_Sub, &&L_Sll, &&L_Slt, &&L_SltU, &&L_Xor, &&L_Srl, &&L_Sra, &&L_Or, &&L_And,
+		&&L_Mul, &&L_MulH, &&L_MulHSU, &&L_MulHU, &&L_Div, &&L_DivU, &&L_Rem, &&L_RemU,
+		&&L_Lb, &&L_Lh, &&L_Lw, &&L_LbU, &&L_LhU,
+		&&L_Sb, &&L_Sh, &&L_Sw,
+		&&L_Lui, &&L_Auipc,
+		&&L_Beq, &&L_Bne, &&L_Blt, &&L_Bge, &&L_BltU, &&L_BgeU,
+		&&L_Jal, &&L_Jalr,
+		&&L_Fence,
+		&&L_CsrRW, &&L_CsrRS, &&L_CsrRC, &&L_CsrRWI, &&L_CsrRSI, &&L_CsrRCI,
+		&&L_Ebreak, &&L_Ecall, &&L_Mret,
+		&&L_Illegal, &&L_Nop
+	};
+	goto *dispatchTable[(size_t)op->operation];
+#else
+	for (bool first = true; ; first = false)
+	{
+		if (!first)
+		{
+			if (count-- == 0) return;
+			op = beginInstruction();
+		}
+
+		switch (op->operation)
+		{
+#endif
+
+	// Immediate
+	THREADED_OPERATION(AddI) writeReg(op->rd, readReg(op->rs1) + op->imm); THREADED_NEXT();
+	THREADED_OPERATION(SltI) writeReg(op->rd, ((int32_t)readReg(op->rs1) < (int32_t)op->imm) ? 1 : 0); THREADED_NEXT();
+	THREADED_OPERATION(SltIU) writeReg(op->rd, (readReg(op->rs1) < op->imm) ? 1 : 0); THREADED_NEXT();
+	THREADED_OPERATION(XorI) writeReg(op->rd, readReg(op->rs1) ^ op->imm); THREADED_NEXT();
+	THREADED_OPERATION(OrI) writeReg(op->rd, readReg(op->rs1) | op->imm); THREADED_NEXT();
+	THREADED_OPERATION(AndI) writeReg(op->rd, readReg(op->rs1) & op->imm); THREADED_NEXT();
+	THREADED_OPERATION(SllI) writeReg(op->rd, readReg(op->rs1) << (op->imm & 0x1F)); THREADED_NEXT();
+	THREADED_OPERATION(SrlI) writeReg(op->rd, readReg(op->rs1) >> (op->imm & 0x1F)); THREADED_NEXT();
+	THREADED_OPERATION(SraI) writeReg(op->rd, (int32_t)readReg(op->rs1) >> (op->imm & 0x1F)); THREADED_NEXT();
+	// Register
+	THREADED_OPERATION(Add) writeReg(op->rd, readReg(op->rs1) + readReg(op->rs2)); THREADED_NEXT();
+	THREADED_OPERATION(Sub) writeReg(op->rd, readReg(op->rs1) - readReg(op->rs2)); THREADED_NEXT();
+	THREADED_OPERATION(Sll) writeReg(op->rd, readReg(op->rs1) << (readReg(op->rs2) & 0x1F)); THREADED_NEXT();
+	THREADED_OPERATION(Slt) writeReg(op->rd, ((int32_t)readReg(op->rs1) < (int32_t)readReg(op->rs2)) ? 1 : 0); THREADED_NEXT();
+	THREADED_OPERATION(SltU) writeReg(op->rd, (readReg(op->rs1) < readReg(op->rs2)) ? 1 : 0); THREADED_NEXT();
+	THREADED_OPERATION(Xor) writeReg(op->rd, readReg(op->rs1) ^ readReg(op->rs2)); THREADED_NEXT();
+	THREADED_OPERATION(Srl) writeReg(op->rd, readReg(op->rs1) >> (readReg(op->rs2) & 0x1F)); THREADED_NEXT();
+	THREADED_OPERATION(Sra) writeReg(op->rd, (int32_t)readReg(op->rs1) >> (readReg(op->rs2) & 0x1F)); THREADED_NEXT();
+	THREADED_OPERATION(Or) writeReg(op->rd, readReg(op->rs1) | readReg(op->rs2)); THREADED_NEXT();
+	THREADED_OPERATION(And) writeReg(op->rd, readReg(op->rs1) & readReg(op->rs2)); THREADED_NEXT();
+	THREADED_OPERATION(Mul) writeReg(op->rd, readReg(op->rs1) * readReg(op->rs2)); THREADED_NEXT();
+	THREADED_OPERATION(MulH) MulH(*op); THREADED_NEXT();
+	THREADED_OPERATION(MulHSU) MulHSU(*op); THREADED_NEXT();
+	THREADED_OPERATION(MulHU) MulHU(*op); THREADED_NEXT();
+	THREADED_OPERATION(Div) Div(*op); THREADED_NEXT();
+	THREADED_OPERATION(DivU) DivU(*op); THREADED_NEXT();
+	THREADED_OPERATION(Rem) Rem(*op); THREADED_NEXT();
+	THREADED_OPERATION(RemU) RemU(*op); THREADED_NEXT();
+	// Load
+	THREADED_OPERATION(Lb) Lb(*op); THREADED_NEXT();
+	THREADED_OPERATION(Lh) Lh(*op); THREADED_NEXT();
+	THREADED_OPERATION(Lw) Lw(*op); THREADED_NEXT();
+	THREADED_OPERATION(LbU) LbU(*op); THREADED_NEXT();
+	THREADED_OPERATION(LhU) LhU(*op); THREADED_NEXT();
+	// Store
+	THREADED_OPERATION(Sb) Sb(*op); THREADED_NEXT();
+	THREADED_OPERATION(Sh) Sh(*op); THREADED_NEXT();
+	THREADED_OPERATION(Sw) Sw(*op); THREADED_NEXT();
+	// Lui and Auipc
+	THREADED_OPERATION(Lui) writeReg(op->rd, op->imm); THREADED_NEXT();
+	THREADED_OPERATION(Auipc) writeReg(op->rd, op->imm + pc); THREADED_NEXT();
+	// Branch
+	THREADED_OPERATION(Beq) if (readReg(op->rs1) == readReg(op->rs2)) newPc = pc + op->imm; THREADED_NEXT();
+	THREADED_OPERATION(Bne) if (readReg(op->rs1) != readReg(op->rs2)) newPc = pc + op->imm; THREADED_NEXT();
+	THREADED_OPERATION(Blt) if ((int32_t)readReg(op->rs1) < (int32_t)readReg(op->rs2)) newPc = pc + op->imm; THREADED_NEXT();
+	THREADED_OPERATION(Bge) if ((int32_t)readReg(op->rs1) >= (int32_t)readReg(op->rs2)) newPc = pc + op->imm; THREADED_NEXT();
+	THREADED_OPERATION(BltU) if (readReg(op->rs1) < readReg(op->rs2)) newPc = pc + op->imm; THREADED_NEXT();
+	THREADED_OPERATION(BgeU) if (readReg(op->rs1) >= readReg(op->rs2)) newPc = pc + op->imm; THREADED_NEXT();
+	// Jal and Jalr
+	THREADED_OPERATION(Jal) Jal(*op); THREADED_NEXT();
+	THREADED_OPERATION(Jalr) Jalr(*op); THREADED_NEXT();
+	// Fence
+	THREADED_OPERATION(Fence) THREADED_NEXT();
+	// System
+	THREADED_OPERATION(CsrRW) CsrRW(*op); THREADED_NEXT();
+	THREADED_OPERATION(CsrRS) CsrRS(*op); THREADED_NEXT();
+	THREADED_OPERATION(CsrRC) CsrRC(*op); THREADED_NEXT();
+	THREADED_OPERATION(CsrRWI) CsrRWI(*op); THREADED_NEXT();
+	THREADED_OPERATION(CsrRSI) CsrRSI(*op); THREADED_NEXT();
+	THREADED_OPERATION(CsrRCI) CsrRCI(*op); THREADED_NEXT();
+	THREADED_OPERATION(Ebreak) Ebreak(*op); THREADED_NEXT();
+	THREADED_OPERATION(Ecall) Ecall(*op); THREADED_NEXT();
+	THREADED_OPERATION(Mret) Mret(*op); THREADED_NEXT();
+	// Illegal instruction and nop
+	THREADED_OPERATION(Illegal) Illegal(*op); THREADED_NEXT();
+	THREADED_OPERATION(Nop) THREADED_NEXT();
+
+#if !defined(__GNUC__)
+		default:
+			retireInstruction();
+			continue;
+		}
 	}
+#endif
 }
 
+#undef THREADED_OPERATION
+#undef THREADED_NEXT
+
 void CPU::reset()
 {
 	pc = MemoryMap::Text.BaseAddr;
 
 	csr.reset(0);
+	flushPredecodeCache();
+}
+
+void CPU::freeze()
+{
+	frozenState.reset(new FrozenState{ pc, regs, csr });
+	textWritten = false;
+}
+
+void CPU::restore()
+{
+	if (!frozenState)
+		return;
+
+	pc = frozenState->pc;
+	regs = frozenState->regs;
+	csr = frozenState->csr;
+	csr.interruptsChanged();
+	debugStarted = false;
+
+	if (textWritten)
+		flushPredecodeCache();
+	textWritten = false;
+}
+
+void CPU::flushPredecodeCache()
+{
+	for (std::unique_ptr<PredecodePage>& page : predecodeCache)
+		page.reset();
+
+	flushBlockCache();
 }
 
 uint32_t CPU::readReg(uint32_t index)
@@ -97,467 +488,743 @@ void CPU::writeReg(uint32_t index, uint32_t data)
 		regs[index] = data;
 }
 
-// OPCODES
-CPU::Instruction CPU::XXX(uint32_t instr)
-{
-	createException(ExceptionType::IllegalInstruction, instruction);
-	return { L"???", ArgumentType::None, &CPU::Nop };
-}
-
-CPU::Instruction CPU::OP_IMM(uint32_t instr)
+// Decoding
+CPU::DecodedInstruction CPU::decode(uint32_t instr)
 {
-	InstructionType::I i = punnInstruction<InstructionType::I>(instr);
+	DecodedInstruction decoded;
+	decoded.instruction = instr;
+	decoded.operation = ISA::decodeOperation(instr);
+	decoded.argumentType = argumentTypes[(size_t)decoded.operation];
 
-	switch (i.func3)
+	switch (decoded.argumentType)
 	{
-	case 0b000:
-		return { L"addi", ArgumentType::Immediate, &CPU::AddI };
-	case 0b010:
-		return { L"slti", ArgumentType::Immediate, &CPU::SltI };
-	case 0b011:
-		return { L"sltiu", ArgumentType::Immediate, &CPU::SltIU };
-	case 0b100:
-		return { L"xori", ArgumentType::Immediate, &CPU::XorI };
-	case 0b110:
-		return { L"ori", ArgumentType::Immediate, &CPU::OrI };
-	case 0b111:
-		return { L"andi", ArgumentType::Immediate, &CPU::AndI };
-	case 0b001:
-		if (i.imm & 0xFFE0) break;
-		return { L"slli", ArgumentType::Immediate, &CPU::SllI };
-	case 0b101:
-		switch ((i.imm & 0xFFE0) >> 5)
-		{
-		case 0:
-			return { L"srli", ArgumentType::Immediate, &CPU::SrlI };
-		case 32:
-			return { L"srai", ArgumentType::Immediate, &CPU::SraI };
-		default:
-			break;
-		}
+	case CPU::ArgumentType::Immediate:
+	case CPU::ArgumentType::LoadType:
+	case CPU::ArgumentType::FenceType:
+		decoded.rd = ISA::rd(instr); decoded.rs1 = ISA::rs1(instr); decoded.imm = ISA::immI(instr);
+		break;
+	case CPU::ArgumentType::Register:
+		decoded.rd = ISA::rd(instr); decoded.rs1 = ISA::rs1(instr); decoded.rs2 = ISA::rs2(instr);
+		break;
+	case CPU::ArgumentType::StoreType:
+		decoded.rs1 = ISA::rs1(instr); decoded.rs2 = ISA::rs2(instr); decoded.imm = ISA::immS(instr);
+		break;
+	case CPU::ArgumentType::Upper:
+		decoded.rd = ISA::rd(instr); decoded.imm = ISA::immU(instr);
+		break;
+	case CPU::ArgumentType::Branch:
+		decoded.rs1 = ISA::rs1(instr); decoded.rs2 = ISA::rs2(instr); decoded.imm = ISA::immB(instr);
+		break;
+	case CPU::ArgumentType::Jump:
+		decoded.rd = ISA::rd(instr); decoded.imm = ISA::immJ(instr);
 		break;
+	case CPU::ArgumentType::CSRRegister:
+	case CPU::ArgumentType::CSRImmediate:
+		decoded.rd = ISA::rd(instr); decoded.rs1 = ISA::rs1(instr); decoded.imm = ISA::csr(instr);
+		break;
+	case CPU::ArgumentType::None:
 	default:
 		break;
 	}
 
-	createException(ExceptionType::IllegalInstruction, instruction);
-	return { L"???", ArgumentType::None, &CPU::Nop };
+	return decoded;
 }
 
-CPU::Instruction CPU::OP(uint32_t instr)
+// Predecoding
+CPU::MicroOp CPU::predecode(uint32_t instr)
 {
-	InstructionType::R i = punnInstruction<InstructionType::R>(instr);
+	MicroOp op;
+	static_cast<DecodedInstruction&>(op) = decode(instr);
+	op.execute = executeLookup[(size_t)op.operation];
+	return op;
+}
 
-	switch (i.func7)
+const CPU::MicroOp* CPU::fetch(uint32_t addr)
+{
+	MicroOp* op = &uncachedOp;
+	if (MemoryMap::Text.BaseAddr <= addr && addr <= MemoryMap::Text.LimitAddr)
 	{
-	case 0:
-		switch (i.func3)
-		{
-		case 0b000:
-			return { L"add", ArgumentType::Register, &CPU::Add };
-		case 0b001:
-			return { L"sll", ArgumentType::Register, &CPU::Sll };
-		case 0b010:
-			return { L"slt", ArgumentType::Register, &CPU::Slt };
-		case 0b011:
-			return { L"sltu", ArgumentType::Register, &CPU::SltU };
-		case 0b100:
-			return { L"xor", ArgumentType::Register, &CPU::Xor };
-		case 0b101:
-			return { L"srl", ArgumentType::Register, &CPU::Srl };
-		case 0b110:
-			return { L"or", ArgumentType::Register, &CPU::Or };
-		case 0b111:
-			return { L"and", ArgumentType::Register, &CPU::And };
-		default:
-			break;
-		}
-		break;
-	case 32:
-		switch (i.func3)
-		{
-		case 0b000:
-			return { L"sub", ArgumentType::Register, &CPU::Sub };
-		case 0b101:
-			return { L"sra", ArgumentType::Register, &CPU::Sra };
-		default:
-			break;
-		}
-		break;
-	case 1:
-		switch (i.func3)
-		{
-		case 0b000:
-			return { L"mul", ArgumentType::Register, &CPU::Mul };
-		case 0b001:
-			return { L"mulh", ArgumentType::Register, &CPU::MulH };
-		case 0b010:
-			return { L"mulhsu", ArgumentType::Register, &CPU::MulHSU };
-		case 0b011:
-			return { L"mulhu", ArgumentType::Register, &CPU::MulHU };
-		case 0b100:
-			return { L"div", ArgumentType::Register, &CPU::Div };
-		case 0b101:
-			return { L"divu", ArgumentType::Register, &CPU::DivU };
-		case 0b110:
-			return { L"rem", ArgumentType::Register, &CPU::Rem };
-		case 0b111:
-			return { L"remu", ArgumentType::Register, &CPU::RemU };
-		default:
-			break;
-		}
-		break;
-	default:
-		break;
+		uint32_t offset = addr - MemoryMap::Text.BaseAddr;
+		std::unique_ptr<PredecodePage>& page = predecodeCache[offset / PredecodePageSize];
+		if (!page)
+			page = std::make_unique<PredecodePage>();
+
+		op = &(*page)[(offset % PredecodePageSize) / 4];
+		if (op->execute != nullptr)
+			return op;
 	}
 
-	createException(ExceptionType::IllegalInstruction, instruction);
-	return { L"???", ArgumentType::None, &CPU::Nop };
+	uint32_t instr;
+	MemAccessResult instrAccessResult = bus->read(addr, instr);
+	if (instrAccessResult == MemAccessResult::NotInRange)
+		return nullptr;
+	else if (instrAccessResult == MemAccessResult::Misaligned) // This should not be possible, pc should always be 4-byte aligned
+		throw "instruction accesses should never be misaligned";
+
+	*op = predecode(instr);
+	return op;
+}
+
+void CPU::invalidatePredecoded(uint32_t addr)
+{
+	if (addr < MemoryMap::Text.BaseAddr || MemoryMap::Text.LimitAddr < addr)
+		return;
+
+	textWritten = true;
+	uint32_t offset = addr - MemoryMap::Text.BaseAddr;
+	std::unique_ptr<PredecodePage>& page = predecodeCache[offset / PredecodePageSize];
+	if (page)
+		(*page)[(offset % PredecodePageSize) / 4].execute = nullptr;
+
+	if (blockPages[offset / PredecodePageSize])
+		blockCacheStale = true;
 }
 
-CPU::Instruction CPU::LOAD(uint32_t instr)
+void CPU::flushTlbs()
 {
-	InstructionType::I i = punnInstruction<InstructionType::I>(instr);
+	loadTlb.fill({ InvalidTlbPage, nullptr });
+	storeTlb.fill({ InvalidTlbPage, nullptr });
+}
+
+bool CPU::fillTlb(TlbEntry& entry, uint32_t addr, bool isStore)
+{
+	uint32_t pageBase = addr & ~(Bus::PageSize - 1);
+	if (isStore && pageBase <= MemoryMap::Text.LimitAddr && MemoryMap::Text.BaseAddr <= pageBase + (Bus::PageSize - 1))
+		return false;
+
+	uint8_t* host = bus->getHostPage(addr);
+	if (host == nullptr)
+		return false;
+
+	entry = { addr >> Bus::PageBits, host };
+	return true;
+}
+
+template <typename T>
+bool CPU::loadDirect(uint32_t addr, T& value)
+{
+	if (addr % sizeof(T) != 0)
+		return false;
+
+	if (fastmemBase != nullptr)
+		return Fastmem::load(fastmemBase + addr, value);
+
+	TlbEntry& entry = loadTlb[(addr >> Bus::PageBits) % TlbSize];
+	if (entry.page != addr >> Bus::PageBits && !fillTlb(entry, addr, false))
+		return false;
+
+	std::memcpy(&value, entry.host + (addr & (Bus::PageSize - 1)), sizeof(T));
+	return true;
+}
+
+template <typename T>
+bool CPU::storeDirect(uint32_t addr, T value)
+{
+	if (addr % sizeof(T) != 0)
+		return false;
 
-	switch (i.func3)
+	if (fastmemBase != nullptr)
+		return (addr < MemoryMap::Text.BaseAddr || MemoryMap::Text.LimitAddr < addr) && Fastmem::store(fastmemBase + addr, value);
+
+	TlbEntry& entry = storeTlb[(addr >> Bus::PageBits) % TlbSize];
+	if (entry.page != addr >> Bus::PageBits && !fillTlb(entry, addr, true))
+		return false;
+
+	std::memcpy(entry.host + (addr & (Bus::PageSize - 1)), &value, sizeof(T));
+	return true;
+}
+
+// Basic blocks
+bool CPU::endsBlock(Operation operation)
+{
+	switch (operation)
 	{
-	case 0b000:
-		return { L"lb", ArgumentType::LoadType, &CPU::Lb };
-	case 0b001:
-		return { L"lh", ArgumentType::LoadType, &CPU::Lh };
-	case 0b010:
-		return { L"lw", ArgumentType::LoadType, &CPU::Lw };
-	case 0b100:
-		return { L"lbu", ArgumentType::LoadType, &CPU::LbU };
-	case 0b101:
-		return { L"lhu", ArgumentType::LoadType, &CPU::LhU };
+	case Operation::Beq: case Operation::Bne: case Operation::Blt: case Operation::Bge: case Operation::BltU: case Operation::BgeU:
+	case Operation::Jal: case Operation::Jalr:
+	case Operation::CsrRW: case Operation::CsrRS: case Operation::CsrRC: case Operation::CsrRWI: case Operation::CsrRSI: case Operation::CsrRCI:
+	case Operation::Ebreak: case Operation::Ecall: case Operation::Mret:
+	case Operation::Illegal:
+		return true;
 	default:
-		break;
+		return false;
 	}
-
-	createException(ExceptionType::IllegalInstruction, instruction);
-	return { L"???", ArgumentType::None, &CPU::Nop };
 }
 
-CPU::Instruction CPU::STORE(uint32_t instr)
+CPU::ExecuteFunction CPU::fuse(const MicroOp& first, const MicroOp& second)
 {
-	InstructionType::I i = punnInstruction<InstructionType::I>(instr);
+	// The second instruction has to use the result of the first one
+	uint8_t rd = first.rd;
+	if (rd == 0)
+		return nullptr;
 
-	switch (i.func3)
+	bool isZeroTest = (second.operation == Operation::Beq || second.operation == Operation::Bne) && second.rs1 == rd && second.rs2 == 0;
+	switch (first.operation)
 	{
-	case 0b000:
-		return { L"sb", ArgumentType::StoreType, &CPU::Sb };
-	case 0b001:
-		return { L"sh", ArgumentType::StoreType, &CPU::Sh };
-	case 0b010:
-		return { L"sw", ArgumentType::StoreType, &CPU::Sw };
+	// The pairs are matched after BlockOptimizer::optimize, which turns every auipc into a lui of its result and the addi
+	// of a li into a lui of the whole constant
+	case Operation::Lui:
+		if (second.operation == Operation::Lui && second.rd == rd) // li and la of a 32-bit constant
+			return &CPU::Fused<&CPU::Lui, &CPU::Lui>;
+		if (second.operation == Operation::Jalr && second.rs1 == rd) // far calls
+			return &CPU::Fused<&CPU::Lui, &CPU::Jalr>;
+		if (second.operation == Operation::Lw && second.rs1 == rd) // pc-relative loads
+			return &CPU::Fused<&CPU::Lui, &CPU::Lw<true>>;
+		break;
+	case Operation::Slt: // slt + beqz / bnez
+		if (isZeroTest)
+			return second.operation == Operation::Bne ? &CPU::Fused<&CPU::Slt, &CPU::Bne> : &CPU::Fused<&CPU::Slt, &CPU::Beq>;
+		break;
+	case Operation::SltU:
+		if (isZeroTest)
+			return second.operation == Operation::Bne ? &CPU::Fused<&CPU::SltU, &CPU::Bne> : &CPU::Fused<&CPU::SltU, &CPU::Beq>;
+		break;
+	case Operation::SltI:
+		if (isZeroTest)
+			return second.operation == Operation::Bne ? &CPU::Fused<&CPU::SltI, &CPU::Bne> : &CPU::Fused<&CPU::SltI, &CPU::Beq>;
+		break;
+	case Operation::SltIU:
+		if (isZeroTest)
+			return second.operation == Operation::Bne ? &CPU::Fused<&CPU::SltIU, &CPU::Bne> : &CPU::Fused<&CPU::SltIU, &CPU::Beq>;
+		break;
+	case Operation::AddI: // loop counters
+		if (second.operation == Operation::Bne && (second.rs1 == rd || second.rs2 == rd))
+			return &CPU::Fused<&CPU::AddI, &CPU::Bne>;
+		break;
 	default:
 		break;
 	}
 
-	createException(ExceptionType::IllegalInstruction, instruction);
-	return { L"???", ArgumentType::None, &CPU::Nop };
+	return nullptr;
 }
 
-CPU::Instruction CPU::LUI(uint32_t instr)
+void CPU::flushBlockCache()
 {
-	return { L"lui", ArgumentType::Upper, &CPU::Lui };
+	// The compile thread has to be done with the blocks before they are freed
+	if (jit)
+		jit->flush();
+	blockCache.clear();
+	std::fill(blockPages.begin(), blockPages.end(), false);
+	blockCacheStale = false;
+	returnStack.fill({});
 }
 
-CPU::Instruction CPU::AUIPC(uint32_t instr)
+CPU::BasicBlock* CPU::lookupBlock(uint32_t addr)
 {
-	return { L"auipc", ArgumentType::Upper, &CPU::Auipc };
+	if (addr < MemoryMap::Text.BaseAddr || MemoryMap::Text.LimitAddr < addr)
+		return nullptr;
+
+	std::unique_ptr<BasicBlock>& block = blockCache[addr];
+	if (block)
+		return block.get();
+
+	block = std::make_unique<BasicBlock>();
+	block->startPc = addr;
+	block->ops.reserve(MaxBlockLength);
+	for (uint32_t instrAddr = addr; instrAddr <= MemoryMap::Text.LimitAddr && block->ops.size() < MaxBlockLength; instrAddr += 4)
+	{
+		const MicroOp* op = fetch(instrAddr);
+		if (op == nullptr)
+			break;
+
+		block->ops.push_back(*op);
+		blockPages[(instrAddr - MemoryMap::Text.BaseAddr) / PredecodePageSize] = true;
+		if (endsBlock(op->operation))
+			break;
+	}
+
+	if (block->ops.empty())
+	{
+		// The first instruction can't be fetched, let clock() create the exception
+		blockCache.erase(addr);
+		return nullptr;
+	}
+
+	BlockOptimizer::optimize(block->ops, block->startPc);
+
+	// The link registers are ra and t0, like the hints in the specification. A jalr from one link register to the other
+	// returns and calls at the same time.
+	const MicroOp& last = block->ops.back();
+	auto isLink = [](uint8_t reg) { return reg == 1 || reg == 5; };
+	block->isCall = (last.operation == Operation::Jal || last.operation == Operation::Jalr) && isLink(last.rd);
+	block->isReturn = last.operation == Operation::Jalr && isLink(last.rs1) && last.rs1 != last.rd;
+	block->loop = LoopIdiom::recognize(block->ops, block->startPc);
+
+	block->fused.assign(block->ops.size(), nullptr);
+	for (size_t i = 0; i + 1 < block->ops.size(); i++)
+	{
+		block->fused[i] = fuse(block->ops[i], block->ops[i + 1]);
+		if (block->fused[i] != nullptr)
+			i++; // pairs don't overlap
+	}
+
+	if (aot)
+	{
+		uint32_t nativeLength = 0;
+		NativeBlock native = aot->find(*block, nativeLength);
+		block->nativeLength = nativeLength;
+		block->native.store(native, std::memory_order_release);
+	}
+
+	return block.get();
 }
 
-CPU::Instruction CPU::BRANCH(uint32_t instr)
+void CPU::clockBlocks(uint64_t count)
 {
-	InstructionType::B i = punnInstruction<InstructionType::B>(instr);
+	if (blockCacheStale)
+		flushBlockCache();
 
-	switch (i.func3)
+	BasicBlock* block = lookupBlock(pc);
+	while (count > 0)
 	{
-	case 0b000:
-		return { L"beq", ArgumentType::Branch, &CPU::Beq };
-	case 0b001:
-		return { L"bne", ArgumentType::Branch, &CPU::Bne };
-	case 0b100:
-		return { L"blt", ArgumentType::Branch, &CPU::Blt };
-	case 0b101:
-		return { L"bge", ArgumentType::Branch, &CPU::Bge };
-	case 0b110:
-		return { L"bltu", ArgumentType::Branch, &CPU::BltU };
-	case 0b111:
-		return { L"bgeu", ArgumentType::Branch, &CPU::BgeU };
-	default:
-		break;
-	}
+		if (block == nullptr)
+		{
+			clock();
+			count--;
+			block = lookupBlock(pc);
+			continue;
+		}
+
+		uint32_t index = 0;
+		if (block->loop && runLoopIdiom(*block, count))
+			index = (uint32_t)block->ops.size();
+		else if (engine == Engine::JIT)
+			index = runNative(*block, count);
+
+		// Every instruction is still executed and retired one by one, so exceptions and interrupts are taken exactly as in clock().
+		// The loop stops as soon as control flow leaves the block (a trap, an interrupt or the final branch).
+		for (; index < block->ops.size() && pc == block->startPc + 4 * index; index++)
+		{
+			if (count == 0)
+				return;
+
+			const MicroOp& op = block->ops[index];
+			ExecuteFunction fused = block->fused[index];
+			if (fused != nullptr && count >= 2 && !csr.isEventDue(2))
+			{
+				// Both instructions are counted, but only the second one can trap, so they are retired together. Interrupts
+				// are checked after the pair, which is why it is only fused when no event is due before its end.
+				count -= 2;
+				csr.clock();
+				csr.clock();
+				currentExceptionType = ExceptionType::NoException;
+				newPc = pc + 8;
+				instruction = block->ops[index + 1].instruction;
+				(this->*fused)(op);
+				retireInstruction();
+				index++;
+			}
+			else
+			{
+				count--;
+				csr.clock();
+				currentExceptionType = ExceptionType::NoException;
+				newPc = pc + 4;
+				instruction = op.instruction;
+				(this->*op.execute)(op);
+				retireInstruction();
+			}
+
+			if (blockCacheStale)
+				break; // the code was overwritten
+		}
+
+		if (blockCacheStale)
+		{
+			flushBlockCache();
+			block = lookupBlock(pc);
+			continue;
+		}
+
+		// A return goes to the block predicted by the return address stack, otherwise the links to the next block are
+		// followed, only looking it up if it wasn't linked yet
+		BasicBlock* nextBlock = nullptr;
+		if ((block->isCall || block->isReturn) && index == block->ops.size())
+			nextBlock = predictReturn(*block);
+
+		if (nextBlock == nullptr)
+		{
+			for (BasicBlock::Link& link : block->links)
+			{
+				if (link.block != nullptr && link.pc == pc)
+				{
+					nextBlock = link.block;
+					break;
+				}
+			}
+		}
 
-	createException(ExceptionType::IllegalInstruction, instruction);
-	return { L"???", ArgumentType::None, &CPU::Nop };
+		if (nextBlock == nullptr)
+		{
+			nextBlock = lookupBlock(pc);
+			if (nextBlock != nullptr)
+			{
+				block->links[block->nextLink] = { pc, nextBlock };
+				block->nextLink = (block->nextLink + 1) % block->links.size();
+			}
+		}
+
+		block = nextBlock;
+	}
 }
 
-CPU::Instruction CPU::JAL(uint32_t instr)
+CPU::BasicBlock* CPU::predictReturn(BasicBlock& block)
 {
-	return { L"jal", ArgumentType::Jump, &CPU::Jal };
+	BasicBlock* returnBlock = nullptr;
+	if (block.isReturn)
+	{
+		ReturnAddress& top = returnStack[returnStackTop];
+		if (top.caller != nullptr && top.pc == pc)
+		{
+			if (top.caller->returnBlock == nullptr)
+				top.caller->returnBlock = lookupBlock(pc);
+			returnBlock = top.caller->returnBlock;
+		}
+		top = {};
+		returnStackTop = (returnStackTop + ReturnStackSize - 1) % ReturnStackSize;
+	}
+
+	if (block.isCall)
+	{
+		returnStackTop = (returnStackTop + 1) % ReturnStackSize;
+		returnStack[returnStackTop] = { block.startPc + 4 * (uint32_t)block.ops.size(), &block };
+	}
+
+	return returnBlock;
 }
 
-CPU::Instruction CPU::JALR(uint32_t instr)
+uint32_t CPU::runNative(BasicBlock& block, uint64_t& count)
 {
-	InstructionType::I i = punnInstruction<InstructionType::I>(instr);
+	// Hot blocks are translated in the background, they keep being interpreted until the translation is published
+	NativeBlock native = block.native.load(std::memory_order_acquire);
+	if (native == nullptr)
+	{
+		if (!jit)
+			return 0;
+		if (block.executions < JitThreshold)
+		{
+			if (++block.executions == JitThreshold)
+				jit->queue(&block);
+		}
+		else if (jit->isFull())
+			blockCacheStale = true; // start over with an empty code cache at the next block boundary
+		return 0;
+	}
+
+	// The native code can't stop halfway, and it doesn't count down to the debugger
+	if (count < block.nativeLength)
+		return 0;
+	uint32_t debugCountdown = csr.getDebugCountdown();
+	if (debugCountdown != 0xFFFF'FFFF && debugCountdown <= block.nativeLength)
+		return 0;
 
-	if (i.func3 == 0)
-		return { L"jalr", ArgumentType::Immediate, &CPU::Jalr };
+	uint64_t result = native(regs.data(), ramHostPointer);
+	uint32_t executed = (uint32_t)(result >> 32);
+	if (executed == 0)
+		return 0;
 
-	createException(ExceptionType::IllegalInstruction, instruction);
-	return { L"???", ArgumentType::None, &CPU::Nop };
+	// Retire everything that was executed, interrupts are only checked after the last instruction
+	count -= executed;
+	csr.clock(executed);
+	pc = (uint32_t)result;
+	auto interrupts = csr.checkInterrupts(pc);
+	if (interrupts.hasInterrupt)
+		pc = interrupts.newPc;
+
+	return executed;
+}
+
+bool CPU::runLoopIdiom(BasicBlock& block, uint64_t& count)
+{
+	if (ramHostPointer == nullptr)
+		return false;
+
+	// Only whole iterations are run, stopping before the debug countdown runs out
+	uint32_t length = block.loop->length;
+	uint64_t maxIterations = std::min<uint64_t>(count / length, MaxLoopIterations);
+	uint32_t debugCountdown = csr.getDebugCountdown();
+	if (debugCountdown == 0)
+		return false;
+	if (debugCountdown != 0xFFFF'FFFF)
+		maxIterations = std::min<uint64_t>(maxIterations, (debugCountdown - 1) / length);
+	if (maxIterations < 2)
+		return false;
+
+	bool finished = false;
+	uint32_t iterations = block.loop->execute(regs, ramHostPointer, ramHostSize, (uint32_t)maxIterations, finished);
+	if (iterations == 0)
+		return false;
+
+	// Retire every iteration, interrupts are only checked after the last one
+	uint32_t executed = iterations * length;
+	count -= executed;
+	csr.clock(executed);
+	pc = finished ? block.startPc + 4 * length : block.startPc;
+	auto interrupts = csr.checkInterrupts(pc);
+	if (interrupts.hasInterrupt)
+		pc = interrupts.newPc;
+
+	return true;
 }
 
-CPU::Instruction CPU::MISC_MEM(uint32_t instr)
+// The profile file starts with "RVBP", BlockProfileVersion, imageHash and the amount of blocks. Every block is stored as
+// its start address, its executions, its length and the instructions themselves. Everything is in host byte order.
+bool CPU::saveBlockProfile(const std::string& fileName, uint64_t imageHash)
 {
-	InstructionType::I i = punnInstruction<InstructionType::I>(instr);
+	std::ofstream file(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file)
+		return false;
 
-	if (i.func3 == 0)
-		return { L"fence", ArgumentType::FenceType, &CPU::Fence };
+	auto writeWord = [&file](uint32_t word) { file.write((const char*)&word, sizeof(word)); };
+
+	file.write("RVBP", 4);
+	writeWord(BlockProfileVersion);
+	file.write((const char*)&imageHash, sizeof(imageHash));
+	writeWord((uint32_t)blockCache.size());
+	for (const auto& entry : blockCache)
+	{
+		const BasicBlock& block = *entry.second;
+		writeWord(block.startPc);
+		writeWord(block.executions);
+		writeWord((uint32_t)block.ops.size());
+		for (const MicroOp& op : block.ops)
+			writeWord(op.instruction);
+	}
 
-	createException(ExceptionType::IllegalInstruction, instruction);
-	return { L"???", ArgumentType::None, &CPU::Nop };
+	return (bool)file;
 }
 
-CPU::Instruction CPU::SYSTEM(uint32_t instr)
+bool CPU::loadBlockProfile(const std::string& fileName, uint64_t imageHash)
 {
-	InstructionType::R i = punnInstruction<InstructionType::R>(instr);
+	std::ifstream file(fileName, std::ios::in | std::ios::binary);
+	if (!file)
+		return false;
+
+	auto readWord = [&file](uint32_t& word) { return (bool)file.read((char*)&word, sizeof(word)); };
+
+	char magic[4] = {};
+	uint32_t version = 0;
+	uint64_t savedHash = 0;
+	uint32_t blockCount = 0;
+	file.read(magic, 4);
+	readWord(version);
+	file.read((char*)&savedHash, sizeof(savedHash));
+	if (!readWord(blockCount) || std::string(magic, 4) != "RVBP" || version != BlockProfileVersion || savedHash != imageHash)
+		return false;
 
-	switch (i.func3)
+	std::vector<uint32_t> instructions;
+	for (uint32_t i = 0; i < blockCount; i++)
 	{
-	case 0b000:
-		if (i.rd == 0 && i.rs1 == 0)
-			switch (i.func7)
-			{
-			case 0b0000000:
-				if (i.rs2 == 0)
-					return { L"ecall", ArgumentType::None, &CPU::Ecall };
-				else if (i.rs2 == 1)
-					return { L"ebreak", ArgumentType::None, &CPU::Ebreak };
-				break;
-			case 0b0011000:
-				if (i.rs2 == 2)
-					return { L"mret", ArgumentType::None, &CPU::Mret };
-				break;
-			default:
-				break;
-			}
-		break;
-	case 0b001:
-		return { L"csrrw", ArgumentType::CSRRegister, &CPU::CsrRW };
-	case 0b010:
-		return { L"csrrs", ArgumentType::CSRRegister, &CPU::CsrRS };
-	case 0b011:
-		return { L"csrrc", ArgumentType::CSRRegister, &CPU::CsrRC };
-	case 0b101:
-		return { L"csrrwi", ArgumentType::CSRImmediate, &CPU::CsrRWI };
-	case 0b110:
-		return { L"csrrsi", ArgumentType::CSRImmediate, &CPU::CsrRSI };
-	case 0b111:
-		return { L"csrrci", ArgumentType::CSRImmediate, &CPU::CsrRCI };
-	default:
-		break;
+		uint32_t startPc, executions, length;
+		if (!readWord(startPc) || !readWord(executions) || !readWord(length) || length == 0 || length > MaxBlockLength)
+			return false; // truncated or corrupt, the blocks loaded so far are still valid
+
+		instructions.resize(length);
+		for (uint32_t& instruction : instructions)
+			if (!readWord(instruction))
+				return false;
+
+		// The block is built from memory, the saved instructions only decide whether the profile still applies
+		BasicBlock* block = lookupBlock(startPc);
+		if (block == nullptr || block->ops.size() != length)
+			continue;
+		bool matches = true;
+		for (uint32_t j = 0; j < length; j++)
+			matches = matches && block->ops[j].instruction == instructions[j];
+		if (!matches)
+			continue;
+
+		block->executions = std::min(executions, JitThreshold);
+		if (jit && block->executions == JitThreshold && block->native.load() == nullptr)
+			jit->queue(block);
 	}
 
-	createException(ExceptionType::IllegalInstruction, instruction);
-	return { L"???", ArgumentType::None, &CPU::Nop };
+	return true;
+}
+
+bool CPU::loadAOT(const std::string& fileName, uint64_t imageHash)
+{
+	// The modules access RAM directly up to the end of the RAM range
+	std::unique_ptr<AOT> module = std::make_unique<AOT>();
+	if (ramHostSize != MemoryMap::RAM.LimitAddr - MemoryMap::RAM.BaseAddr + 1 || !module->load(fileName, imageHash))
+		return false;
+
+	aot = std::move(module);
+	flushBlockCache(); // the blocks that already exist don't have the native code yet
+	return true;
 }
 
 // Instructions
 // Immediate
-void CPU::AddI()
+void CPU::AddI(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) + getImm(instr));
+	writeReg(op.rd, readReg(op.rs1) + op.imm);
 }
 
-void CPU::SltI()
+void CPU::SltI(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	writeReg(instr.rd, ((int32_t)readReg(instr.rs1) < (int32_t)getImm(instr)) ? 1 : 0);
+	writeReg(op.rd, ((int32_t)readReg(op.rs1) < (int32_t)op.imm) ? 1 : 0);
 }
 
-void CPU::SltIU()
+void CPU::SltIU(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	writeReg(instr.rd, (readReg(instr.rs1) < getImm(instr)) ? 1 : 0);
+	writeReg(op.rd, (readReg(op.rs1) < op.imm) ? 1 : 0);
 }
 
-void CPU::XorI()
+void CPU::XorI(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) ^ getImm(instr));
+	writeReg(op.rd, readReg(op.rs1) ^ op.imm);
 }
 
-void CPU::OrI()
+void CPU::OrI(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) | getImm(instr));
+	writeReg(op.rd, readReg(op.rs1) | op.imm);
 }
 
-void CPU::AndI()
+void CPU::AndI(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) & getImm(instr));
+	writeReg(op.rd, readReg(op.rs1) & op.imm);
 }
 
-void CPU::SllI()
+void CPU::SllI(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) << (instr.imm & 0x1F));
+	writeReg(op.rd, readReg(op.rs1) << (op.imm & 0x1F));
 }
 
-void CPU::SrlI()
+void CPU::SrlI(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) >> (instr.imm & 0x1F));
+	writeReg(op.rd, readReg(op.rs1) >> (op.imm & 0x1F));
 }
 
-void CPU::SraI()
+void CPU::SraI(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	writeReg(instr.rd, (int32_t)readReg(instr.rs1) >> (instr.imm & 0x1F));
+	writeReg(op.rd, (int32_t)readReg(op.rs1) >> (op.imm & 0x1F));
 }
 
 // Register
-void CPU::Add()
+void CPU::Add(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) + readReg(instr.rs2));
+	writeReg(op.rd, readReg(op.rs1) + readReg(op.rs2));
 }
 
-void CPU::Sub()
+void CPU::Sub(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) - readReg(instr.rs2));
+	writeReg(op.rd, readReg(op.rs1) - readReg(op.rs2));
 }
 
-void CPU::Sll()
+void CPU::Sll(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) << (readReg(instr.rs2) & 0x1F));
+	writeReg(op.rd, readReg(op.rs1) << (readReg(op.rs2) & 0x1F));
 }
 
-void CPU::Slt()
+void CPU::Slt(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, ((int32_t)readReg(instr.rs1) < (int32_t)readReg(instr.rs2)) ? 1 : 0);
+	writeReg(op.rd, ((int32_t)readReg(op.rs1) < (int32_t)readReg(op.rs2)) ? 1 : 0);
 }
 
-void CPU::SltU()
+void CPU::SltU(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, (readReg(instr.rs1) < readReg(instr.rs2)) ? 1 : 0);
+	writeReg(op.rd, (readReg(op.rs1) < readReg(op.rs2)) ? 1 : 0);
 }
 
-void CPU::Xor()
+void CPU::Xor(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) ^ readReg(instr.rs2));
+	writeReg(op.rd, readReg(op.rs1) ^ readReg(op.rs2));
 }
 
-void CPU::Srl()
+void CPU::Srl(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) >> (readReg(instr.rs2) & 0x1F));
+	writeReg(op.rd, readReg(op.rs1) >> (readReg(op.rs2) & 0x1F));
 }
 
-void CPU::Sra()
+void CPU::Sra(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, (int32_t)readReg(instr.rs1) >> (readReg(instr.rs2) & 0x1F));
+	writeReg(op.rd, (int32_t)readReg(op.rs1) >> (readReg(op.rs2) & 0x1F));
 }
 
-void CPU::Or()
+void CPU::Or(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) | readReg(instr.rs2));
+	writeReg(op.rd, readReg(op.rs1) | readReg(op.rs2));
 }
 
-void CPU::And()
+void CPU::And(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) & readReg(instr.rs2));
+	writeReg(op.rd, readReg(op.rs1) & readReg(op.rs2));
 }
 
-void CPU::Mul()
+void CPU::Mul(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, readReg(instr.rs1) * readReg(instr.rs2));
+	writeReg(op.rd, readReg(op.rs1) * readReg(op.rs2));
 }
 
-void CPU::MulH()
+void CPU::MulH(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, (uint64_t)((int64_t)(int32_t)readReg(instr.rs1) * (int64_t)(int32_t)readReg(instr.rs2)) >> 32);
+	writeReg(op.rd, (uint64_t)((int64_t)(int32_t)readReg(op.rs1) * (int64_t)(int32_t)readReg(op.rs2)) >> 32);
 }
 
-void CPU::MulHSU()
+void CPU::MulHSU(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, (uint64_t)((int64_t)(int32_t)readReg(instr.rs1) * (int64_t)(uint64_t)readReg(instr.rs2)) >> 32);
+	writeReg(op.rd, (uint64_t)((int64_t)(int32_t)readReg(op.rs1) * (int64_t)(uint64_t)readReg(op.rs2)) >> 32);
 }
 
-void CPU::MulHU()
+void CPU::MulHU(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	writeReg(instr.rd, ((uint64_t)readReg(instr.rs1) * (uint64_t)readReg(instr.rs2)) >> 32);
+	writeReg(op.rd, ((uint64_t)readReg(op.rs1) * (uint64_t)readReg(op.rs2)) >> 32);
 }
 
-void CPU::Div()
+void CPU::Div(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	int32_t divisor = (int32_t)readReg(instr.rs2);
+	int32_t divisor = (int32_t)readReg(op.rs2);
 	if (divisor == 0)
-		writeReg(instr.rd, 0xFFFF'FFFF);
+		writeReg(op.rd, 0xFFFF'FFFF);
 	else
-		writeReg(instr.rd, (int32_t)readReg(instr.rs1) / divisor);
+		writeReg(op.rd, (int32_t)readReg(op.rs1) / divisor);
 }
 
-void CPU::DivU()
+void CPU::DivU(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	uint32_t divisor = readReg(instr.rs2);
+	uint32_t divisor = readReg(op.rs2);
 	if (divisor == 0)
-		writeReg(instr.rd, 0xFFFF'FFFF);
+		writeReg(op.rd, 0xFFFF'FFFF);
 	else
-		writeReg(instr.rd, readReg(instr.rs1) / divisor);
+		writeReg(op.rd, readReg(op.rs1) / divisor);
 }
 
-void CPU::Rem()
+void CPU::Rem(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	int32_t divisor = (int32_t)readReg(instr.rs2);
+	int32_t divisor = (int32_t)readReg(op.rs2);
 	if (divisor == 0)
-		writeReg(instr.rd, readReg(instr.rs1));
+		writeReg(op.rd, readReg(op.rs1));
 	else
-		writeReg(instr.rd, (int32_t)readReg(instr.rs1) % divisor);
+		writeReg(op.rd, (int32_t)readReg(op.rs1) % divisor);
 }
 
-void CPU::RemU()
+void CPU::RemU(const MicroOp& op)
 {
-	InstructionType::R instr = punnInstruction<InstructionType::R>(instruction);
-	uint32_t divisor = readReg(instr.rs2);
+	uint32_t divisor = readReg(op.rs2);
 	if (divisor == 0)
-		writeReg(instr.rd, readReg(instr.rs1));
+		writeReg(op.rd, readReg(op.rs1));
 	else
-		writeReg(instr.rd, readReg(instr.rs1) % divisor);
+		writeReg(op.rd, readReg(op.rs1) % divisor);
 }
 
 // Load
-void CPU::Lb()
+template <bool Direct>
+void CPU::Lb(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	uint32_t addr = getImm(instr) + readReg(instr.rs1);
+	uint32_t addr = op.imm + readReg(op.rs1);
+	int8_t hostValue;
+	if (Direct && loadDirect(addr, hostValue))
+	{
+		writeReg(op.rd, (uint32_t)(int32_t)hostValue);
+		return;
+	}
+
 	uint32_t value;
 	MemAccessResult accessResult = bus->read(addr, value, false, DataSize::Byte, true);
 	switch (accessResult)
 	{
 	case MemAccessResult::Success:
-		writeReg(instr.rd, value);
+		writeReg(op.rd, value);
 		return;
 	case MemAccessResult::NotInRange:
 		createException(ExceptionType::LoadAccessFault, addr);
@@ -570,16 +1237,23 @@ void CPU::Lb()
 	}
 }
 
-void CPU::Lh()
+template <bool Direct>
+void CPU::Lh(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	uint32_t addr = getImm(instr) + readReg(instr.rs1);
+	uint32_t addr = op.imm + readReg(op.rs1);
+	int16_t hostValue;
+	if (Direct && loadDirect(addr, hostValue))
+	{
+		writeReg(op.rd, (uint32_t)(int32_t)hostValue);
+		return;
+	}
+
 	uint32_t value;
 	MemAccessResult accessResult = bus->read(addr, value, false, DataSize::HalfWord, true);
 	switch (accessResult)
 	{
 	case MemAccessResult::Success:
-		writeReg(instr.rd, value);
+		writeReg(op.rd, value);
 		return;
 	case MemAccessResult::NotInRange:
 		createException(ExceptionType::LoadAccessFault, addr);
@@ -592,16 +1266,23 @@ void CPU::Lh()
 	}
 }
 
-void CPU::Lw()
+template <bool Direct>
+void CPU::Lw(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	uint32_t addr = getImm(instr) + readReg(instr.rs1);
+	uint32_t addr = op.imm + readReg(op.rs1);
+	uint32_t hostValue;
+	if (Direct && loadDirect(addr, hostValue))
+	{
+		writeReg(op.rd, hostValue);
+		return;
+	}
+
 	uint32_t value;
 	MemAccessResult accessResult = bus->read(addr, value, false, DataSize::Word, true);
 	switch (accessResult)
 	{
 	case MemAccessResult::Success:
-		writeReg(instr.rd, value);
+		writeReg(op.rd, value);
 		return;
 	case MemAccessResult::NotInRange:
 		createException(ExceptionType::LoadAccessFault, addr);
@@ -614,16 +1295,23 @@ void CPU::Lw()
 	}
 }
 
-void CPU::LbU()
+template <bool Direct>
+void CPU::LbU(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	uint32_t addr = getImm(instr) + readReg(instr.rs1);
+	uint32_t addr = op.imm + readReg(op.rs1);
+	uint8_t hostValue;
+	if (Direct && loadDirect(addr, hostValue))
+	{
+		writeReg(op.rd, hostValue);
+		return;
+	}
+
 	uint32_t value;
 	MemAccessResult accessResult = bus->read(addr, value, false, DataSize::Byte, false);
 	switch (accessResult)
 	{
 	case MemAccessResult::Success:
-		writeReg(instr.rd, value);
+		writeReg(op.rd, value);
 		return;
 	case MemAccessResult::NotInRange:
 		createException(ExceptionType::LoadAccessFault, addr);
@@ -636,16 +1324,23 @@ void CPU::LbU()
 	}
 }
 
-void CPU::LhU()
+template <bool Direct>
+void CPU::LhU(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	uint32_t addr = getImm(instr) + readReg(instr.rs1);
+	uint32_t addr = op.imm + readReg(op.rs1);
+	uint16_t hostValue;
+	if (Direct && loadDirect(addr, hostValue))
+	{
+		writeReg(op.rd, hostValue);
+		return;
+	}
+
 	uint32_t value;
 	MemAccessResult accessResult = bus->read(addr, value, false, DataSize::HalfWord, false);
 	switch (accessResult)
 	{
 	case MemAccessResult::Success:
-		writeReg(instr.rd, value);
+		writeReg(op.rd, value);
 		return;
 	case MemAccessResult::NotInRange:
 		createException(ExceptionType::LoadAccessFault, addr);
@@ -659,292 +1354,297 @@ void CPU::LhU()
 }
 
 // Store
-void CPU::Sb()
+template <bool Direct>
+void CPU::Sb(const MicroOp& op)
 {
-	InstructionType::S instr = punnInstruction<InstructionType::S>(instruction);
-	uint32_t addr = getImm(instr) + readReg(instr.rs1);
-	MemAccessResult accessResult = bus->write(addr, readReg(instr.rs2), DataSize::Byte);
+	uint32_t addr = op.imm + readReg(op.rs1);
+	if (Direct && storeDirect(addr, (uint8_t)readReg(op.rs2)))
+		return;
+
+	MemAccessResult accessResult = bus->write(addr, readReg(op.rs2), DataSize::Byte);
 	
 	if (accessResult == MemAccessResult::NotInRange)
 		createException(ExceptionType::StoreAccessFault, addr);
 	else if (accessResult == MemAccessResult::Misaligned)
 		createException(ExceptionType::StoreAddressMisaligned, addr);
+	else
+		invalidatePredecoded(addr);
 }
 
-void CPU::Sh()
+template <bool Direct>
+void CPU::Sh(const MicroOp& op)
 {
-	InstructionType::S instr = punnInstruction<InstructionType::S>(instruction);
-	uint32_t addr = getImm(instr) + readReg(instr.rs1);
-	MemAccessResult accessResult = bus->write(addr, readReg(instr.rs2), DataSize::HalfWord);
+	uint32_t addr = op.imm + readReg(op.rs1);
+	if (Direct && storeDirect(addr, (uint16_t)readReg(op.rs2)))
+		return;
+
+	MemAccessResult accessResult = bus->write(addr, readReg(op.rs2), DataSize::HalfWord);
 
 	if (accessResult == MemAccessResult::NotInRange)
 		createException(ExceptionType::StoreAccessFault, addr);
 	else if (accessResult == MemAccessResult::Misaligned)
 		createException(ExceptionType::StoreAddressMisaligned, addr);
+	else
+		invalidatePredecoded(addr);
 }
 
-void CPU::Sw()
+template <bool Direct>
+void CPU::Sw(const MicroOp& op)
 {
-	InstructionType::S instr = punnInstruction<InstructionType::S>(instruction);
-	uint32_t addr = getImm(instr) + readReg(instr.rs1);
-	MemAccessResult accessResult = bus->write(addr, readReg(instr.rs2), DataSize::Word);
+	uint32_t addr = op.imm + readReg(op.rs1);
+	if (Direct && storeDirect(addr, (uint32_t)readReg(op.rs2)))
+		return;
+
+	MemAccessResult accessResult = bus->write(addr, readReg(op.rs2), DataSize::Word);
 
 	if (accessResult == MemAccessResult::NotInRange)
 		createException(ExceptionType::StoreAccessFault, addr);
 	else if (accessResult == MemAccessResult::Misaligned)
 		createException(ExceptionType::StoreAddressMisaligned, addr);
+	else
+		invalidatePredecoded(addr);
 }
 
 // Lui
-void CPU::Lui()
+void CPU::Lui(const MicroOp& op)
 {
-	InstructionType::U instr = punnInstruction<InstructionType::U>(instruction);
-	writeReg(instr.rd, getImm(instr));
+	writeReg(op.rd, op.imm);
 }
 
 // Auipc
-void CPU::Auipc()
+void CPU::Auipc(const MicroOp& op)
 {
-	InstructionType::U instr = punnInstruction<InstructionType::U>(instruction);
-	writeReg(instr.rd, getImm(instr) + pc);
+	writeReg(op.rd, op.imm + pc);
 }
 
 // Branch
-void CPU::Beq()
+void CPU::Beq(const MicroOp& op)
 {
-	InstructionType::B instr = punnInstruction<InstructionType::B>(instruction);
-	if (readReg(instr.rs1) == readReg(instr.rs2))
-		newPc = pc + getImm(instr);
+	if (readReg(op.rs1) == readReg(op.rs2))
+		newPc = pc + op.imm;
 }
 
-void CPU::Bne()
+void CPU::Bne(const MicroOp& op)
 {
-	InstructionType::B instr = punnInstruction<InstructionType::B>(instruction);
-	if (readReg(instr.rs1) != readReg(instr.rs2))
-		newPc = pc + getImm(instr);
+	if (readReg(op.rs1) != readReg(op.rs2))
+		newPc = pc + op.imm;
 }
 
-void CPU::Blt()
+void CPU::Blt(const MicroOp& op)
 {
-	InstructionType::B instr = punnInstruction<InstructionType::B>(instruction);
-	if ((int32_t)readReg(instr.rs1) < (int32_t)readReg(instr.rs2))
-		newPc = pc + getImm(instr);
+	if ((int32_t)readReg(op.rs1) < (int32_t)readReg(op.rs2))
+		newPc = pc + op.imm;
 }
 
-void CPU::Bge()
+void CPU::Bge(const MicroOp& op)
 {
-	InstructionType::B instr = punnInstruction<InstructionType::B>(instruction);
-	if ((int32_t)readReg(instr.rs1) >= (int32_t)readReg(instr.rs2))
-		newPc = pc + getImm(instr);
+	if ((int32_t)readReg(op.rs1) >= (int32_t)readReg(op.rs2))
+		newPc = pc + op.imm;
 }
 
-void CPU::BltU()
+void CPU::BltU(const MicroOp& op)
 {
-	InstructionType::B instr = punnInstruction<InstructionType::B>(instruction);
-	if (readReg(instr.rs1) < readReg(instr.rs2))
-		newPc = pc + getImm(instr);
+	if (readReg(op.rs1) < readReg(op.rs2))
+		newPc = pc + op.imm;
 }
 
-void CPU::BgeU()
+void CPU::BgeU(const MicroOp& op)
 {
-	InstructionType::B instr = punnInstruction<InstructionType::B>(instruction);
-	if (readReg(instr.rs1) >= readReg(instr.rs2))
-		newPc = pc + getImm(instr);
+	if (readReg(op.rs1) >= readReg(op.rs2))
+		newPc = pc + op.imm;
 }
 
 // Jal
-void CPU::Jal()
+void CPU::Jal(const MicroOp& op)
 {
-	InstructionType::J instr = punnInstruction<InstructionType::J>(instruction);
-	writeReg(instr.rd, pc + 4);
-	newPc = pc + getImm(instr);
+	writeReg(op.rd, pc + 4);
+	newPc = pc + op.imm;
 }
 
 // Jalr
-void CPU::Jalr()
+void CPU::Jalr(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	writeReg(instr.rd, pc + 4);
-	newPc = (readReg(instr.rs1) + getImm(instr)) & 0xFFFF'FFFEU;
+	writeReg(op.rd, pc + 4);
+	newPc = (readReg(op.rs1) + op.imm) & 0xFFFF'FFFEU;
 }
 
 // Fence
-void CPU::Fence()
+void CPU::Fence(const MicroOp&)
 { // Can be implemented as nop, memory ordering is already strict
 }
 
 // System
-void CPU::CsrRW()
+void CPU::CsrRW(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	uint32_t csrAddr = instr.imm;
+	uint32_t csrAddr = op.imm;
 
-	uint32_t writeVal = readReg(instr.rs1);
+	uint32_t writeVal = readReg(op.rs1);
 
-	if (instr.rd != 0)
+	if (op.rd != 0)
 	{
 		uint32_t value;
 		if (!csr.read(csrAddr, value, false)) {
-			createException(ExceptionType::IllegalInstruction, instruction);
+			createException(ExceptionType::IllegalInstruction, op.instruction);
 			return;
 		}
 
-		writeReg(instr.rd, value);
+		writeReg(op.rd, value);
 	}
 
 	if (!csr.write(csrAddr, writeVal)) {
-		createException(ExceptionType::IllegalInstruction, instruction);
+		createException(ExceptionType::IllegalInstruction, op.instruction);
 		return;
 	}
 }
 
-void CPU::CsrRS()
+void CPU::CsrRS(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	uint32_t csrAddr = instr.imm;
+	uint32_t csrAddr = op.imm;
 
 	// read old value
 	uint32_t value;
 	if (!csr.read(csrAddr, value, false)) {
-		createException(ExceptionType::IllegalInstruction, instruction);
+		createException(ExceptionType::IllegalInstruction, op.instruction);
 		return;
 	}
 
-	writeReg(instr.rd, value);
+	writeReg(op.rd, value);
 
 
-	if (instr.rs1 != 0)
+	if (op.rs1 != 0)
 	{
 		// write new value
-		uint32_t newValue = value | readReg(instr.rs1);
+		uint32_t newValue = value | readReg(op.rs1);
 
 		if (!csr.write(csrAddr, newValue)) {
-			createException(ExceptionType::IllegalInstruction, instruction);
+			createException(ExceptionType::IllegalInstruction, op.instruction);
 			return;
 		}
 	}
 }
 
-void CPU::CsrRC()
+void CPU::CsrRC(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	uint32_t csrAddr = instr.imm;
+	uint32_t csrAddr = op.imm;
 
 	// read old value
 	uint32_t value;
 	if (!csr.read(csrAddr, value, false)) {
-		createException(ExceptionType::IllegalInstruction, instruction);
+		createException(ExceptionType::IllegalInstruction, op.instruction);
 		return;
 	}
 
-	writeReg(instr.rd, value);
+	writeReg(op.rd, value);
 
 
-	if (instr.rs1 != 0)
+	if (op.rs1 != 0)
 	{
 		// write new value
-		uint32_t newValue = value & (~readReg(instr.rs1));
+		uint32_t newValue = value & (~readReg(op.rs1));
 
 		if (!csr.write(csrAddr, newValue)) {
-			createException(ExceptionType::IllegalInstruction, instruction);
+			createException(ExceptionType::IllegalInstruction, op.instruction);
 			return;
 		}
 	}
 }
 
-void CPU::CsrRWI()
+void CPU::CsrRWI(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	uint32_t csrAddr = instr.imm;
+	uint32_t csrAddr = op.imm;
 
-	if (instr.rd != 0)
+	if (op.rd != 0)
 	{
 		uint32_t value;
 		if (!csr.read(csrAddr, value, false)) {
-			createException(ExceptionType::IllegalInstruction, instruction);
+			createException(ExceptionType::IllegalInstruction, op.instruction);
 			return;
 		}
 
-		writeReg(instr.rd, value);
+		writeReg(op.rd, value);
 	}
 
-	if (!csr.write(csrAddr, instr.rs1)) {
-		createException(ExceptionType::IllegalInstruction, instruction);
+	if (!csr.write(csrAddr, op.rs1)) {
+		createException(ExceptionType::IllegalInstruction, op.instruction);
 		return;
 	}
 }
 
-void CPU::CsrRSI()
+void CPU::CsrRSI(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	uint32_t csrAddr = instr.imm;
+	uint32_t csrAddr = op.imm;
 
 	// read old value
 	uint32_t value;
 	if (!csr.read(csrAddr, value, false)) {
-		createException(ExceptionType::IllegalInstruction, instruction);
+		createException(ExceptionType::IllegalInstruction, op.instruction);
 		return;
 	}
 
-	writeReg(instr.rd, value);
+	writeReg(op.rd, value);
 
 
-	if (instr.rs1 != 0)
+	if (op.rs1 != 0)
 	{
 		// write new value
-		uint32_t newValue = value | instr.rs1;
+		uint32_t newValue = value | op.rs1;
 
 		if (!csr.write(csrAddr, newValue)) {
-			createException(ExceptionType::IllegalInstruction, instruction);
+			createException(ExceptionType::IllegalInstruction, op.instruction);
 			return;
 		}
 	}
 }
 
-void CPU::CsrRCI()
+void CPU::CsrRCI(const MicroOp& op)
 {
-	InstructionType::I instr = punnInstruction<InstructionType::I>(instruction);
-	uint32_t csrAddr = instr.imm;
+	uint32_t csrAddr = op.imm;
 
 	// read old value
 	uint32_t value;
 	if (!csr.read(csrAddr, value, false)) {
-		createException(ExceptionType::IllegalInstruction, instruction);
+		createException(ExceptionType::IllegalInstruction, op.instruction);
 		return;
 	}
 
-	writeReg(instr.rd, value);
+	writeReg(op.rd, value);
 
 
-	if (instr.rs1 != 0)
+	if (op.rs1 != 0)
 	{
 		// write new value
-		uint32_t newValue = value & (~instr.rs1);
+		uint32_t newValue = value & (~op.rs1);
 
 		if (!csr.write(csrAddr, newValue)) {
-			createException(ExceptionType::IllegalInstruction, instruction);
+			createException(ExceptionType::IllegalInstruction, op.instruction);
 			return;
 		}
 	}
 }
 
-void CPU::Ebreak()
+void CPU::Ebreak(const MicroOp&)
 {
 	createException(ExceptionType::EnvironmentBreak);
 }
 
-void CPU::Ecall()
+void CPU::Ecall(const MicroOp&)
 {
 	createException(ExceptionType::MEnvironmentCall);
 }
 
-void CPU::Mret()
+void CPU::Mret(const MicroOp&)
 {
 	newPc = csr.returnExcepion();
 }
 
+// Illegal instruction
+void CPU::Illegal(const MicroOp& op)
+{
+	createException(ExceptionType::IllegalInstruction, op.instruction);
+}
+
 // Nop
-void CPU::Nop()
+void CPU::Nop(const MicroOp&)
 {
 }
 
@@ -992,89 +1692,44 @@ uint32_t CPU::getCause(ExceptionType type)
 // Disassembly and convenience functions
 std::wstring CPU::disassemble(uint32_t instr)
 {
-	uint32_t opcode = ((InstructionType::B*)&instr)->opcode;
-
-	if ((opcode & 0b11) != 0b11)
+	DecodedInstruction decoded = decode(instr);
+	if (decoded.operation == Operation::Illegal)
 		return L"???";
 
-	InstructionDecoder decoder = opcodeLookup[opcode >> 2];
-	Instruction decodedInstr = (this->*decoder)(instr);
-
-	std::wstring name = decodedInstr.name;
+	std::wstring name = operationNames[(size_t)decoded.operation];
 	std::wstring args;
-	switch (decodedInstr.argumentType)
+	switch (decoded.argumentType)
 	{
 	case CPU::ArgumentType::Immediate:
-	{
-		InstructionType::I i = punnInstruction<InstructionType::I>(instr);
-
-		args = regName(i.rd) + L", " + regName(i.rs1) + L", " + hex(getImm(i));
+		args = regName(decoded.rd) + L", " + regName(decoded.rs1) + L", " + hex(decoded.imm);
 		break;
-	}
 	case CPU::ArgumentType::Register:
-	{
-		InstructionType::R i = punnInstruction<InstructionType::R>(instr);
-
-		args = regName(i.rd) + L", " + regName(i.rs1) + L", " + regName(i.rs2);
+		args = regName(decoded.rd) + L", " + regName(decoded.rs1) + L", " + regName(decoded.rs2);
 		break;
-	}
 	case CPU::ArgumentType::LoadType:
-	{
-		InstructionType::I i = punnInstruction<InstructionType::I>(instr);
-
-		args = regName(i.rd) + L", " + hex(getImm(i)) + L"(" + regName(i.rs1) + L")";
+		args = regName(decoded.rd) + L", " + hex(decoded.imm) + L"(" + regName(decoded.rs1) + L")";
 		break;
-	}
 	case CPU::ArgumentType::StoreType:
-	{
-		InstructionType::S i = punnInstruction<InstructionType::S>(instr);
-
-		args = regName(i.rs2) + L", " + hex(getImm(i)) + L"(" + regName(i.rs1) + L")";
+		args = regName(decoded.rs2) + L", " + hex(decoded.imm) + L"(" + regName(decoded.rs1) + L")";
 		break;
-	}
 	case CPU::ArgumentType::Upper:
-	{
-		InstructionType::U i = punnInstruction<InstructionType::U>(instr);
-		
-		args = regName(i.rd) + L", " + hex(getImm(i));
+		args = regName(decoded.rd) + L", " + hex(decoded.imm);
 		break;
-	}
 	case CPU::ArgumentType::Branch:
-	{
-		InstructionType::B i = punnInstruction<InstructionType::B>(instr);
-
-		args = regName(i.rs1) + L", " + regName(i.rs2) + L", " + hex(getImm(i));
+		args = regName(decoded.rs1) + L", " + regName(decoded.rs2) + L", " + hex(decoded.imm);
 		break;
-	}
 	case CPU::ArgumentType::Jump:
-	{
-		InstructionType::J i = punnInstruction<InstructionType::J>(instr);
-
-		args = regName(i.rd) + L", " + hex(getImm(i));
+		args = regName(decoded.rd) + L", " + hex(decoded.imm);
 		break;
-	}
 	case CPU::ArgumentType::FenceType:
-	{
-		InstructionType::I i = punnInstruction<InstructionType::I>(instr);
-
-		uint32_t imm = getImm(i);
-		args = ((imm & 0x0F0) >> 4) + L", " + (imm & 0x00F);
+		args = std::to_wstring((decoded.imm & 0x0F0) >> 4) + L", " + std::to_wstring(decoded.imm & 0x00F);
 		break;
-	}
 	case CPU::ArgumentType::CSRRegister:
-	{
-		InstructionType::I i = punnInstruction<InstructionType::I>(instr);
-
-		args = regName(i.rd) + L", " + this->csr.getName(i.imm) + L", " + regName(i.rs1);
+		args = regName(decoded.rd) + L", " + this->csr.getName(decoded.imm) + L", " + regName(decoded.rs1);
 		break;
-	}
 	case CPU::ArgumentType::CSRImmediate:
-	{
-		InstructionType::I i = punnInstruction<InstructionType::I>(instr);
-
-		args = regName(i.rd) + L", " + this->csr.getName(i.imm) + L", " + std::to_wstring(i.rs1);
+		args = regName(decoded.rd) + L", " + this->csr.getName(decoded.imm) + L", " + std::to_wstring(decoded.rs1);
 		break;
-	}
 	case CPU::ArgumentType::None:
 		args = L"";
 		break;
@@ -1102,56 +1757,3 @@ std::wstring CPU::hex(uint32_t n)
 		s[i] = L"0123456789abcdef"[n & 0xF];
 	return s;
 };
-
-uint32_t signExtend12(uint32_t imm)
-{
-	return (imm & 0xFFF) | ((imm & 0x800) ? 0xFFFFF000 : 0x0000'0000);
-}
-
-uint32_t signExtend13(uint32_t imm)
-{
-	return (imm & 0x1FFF) | ((imm & 0x1000) ? 0xFFFFE000 : 0x0000'0000);
-}
-
-uint32_t signExtend21(uint32_t imm)
-{
-	return (imm & 0x1FFFFF) | ((imm & 0x100000) ? 0xFFE00000 : 0x0000'0000);
-}
-
-uint32_t CPU::getImm(InstructionType::I instr)
-{
-	return signExtend12(instr.imm);
-}
-
-uint32_t CPU::getImm(InstructionType::S instr)
-{
-	return signExtend12(
-		instr.imm11_5 << 5 | 
-		instr.imm4_0
-	);
-}
-
-uint32_t CPU::getImm(InstructionType::B instr)
-{
-	return signExtend13(
-		instr.imm12   << 12 |
-		instr.imm11   << 11 |
-		instr.imm10_5 <<  5 |
-		instr.imm4_1  <<  1
-	);
-}
-
-uint32_t CPU::getImm(InstructionType::U instr)
-{
-	return instr.imm31_12 << 12;
-}
-
-uint32_t CPU::getImm(InstructionType::J instr)
-{
-	return signExtend21(
-		instr.imm20    << 20 |
-		instr.imm19_12 << 12 |
-		instr.imm11    << 11 |
-		instr.imm10_1  <<  1
-	);
-}
@@ -3,82 +3,99 @@
 #include <string>
 #include <array>
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
 #include <functional>
 #include "../Bus.h"
 #include "CSR.h"
 
-namespace InstructionType
+class JIT;
+class Fastmem;
+class AOT;
+class LoopIdiom;
+
+class CPU
 {
-	struct R
-	{
-		unsigned opcode : 7;
-		unsigned rd : 5;
-		unsigned func3 : 3;
-		unsigned rs1 : 5;
-		unsigned rs2 : 5;
-		unsigned func7 : 7;
-	};
+public:
+	CPU(const std::function<void()>& startDebug);
+	~CPU();
 
-	struct I
+public:
+	void connectBus(Bus* bus);
+	// Loads and stores go through fastmem's window instead of the TLBs when the bus has its memory at every address it
+	// allocated, it has to outlive the CPU. Takes effect with the next connectBus.
+	void useFastmem(Fastmem* fastmem);
+	void clock();
+	void reset();
+	void flushPredecodeCache();
+
+	// freeze saves the registers and CSRs as a golden image, restore resets them to it (see Bus::freeze). The predecoded
+	// and translated code is kept unless the Text range was written since freeze.
+	void freeze();
+	void restore();
+
+public:
+	// The interpreter executes every instruction through clock(), the threaded interpreter dispatches directly from one
+	// instruction to the next and the block engine executes cached basic blocks that are chained together. They behave
+	// identically, only their speed differs. The JIT engine is the block engine, but hot blocks are translated to native
+	// code. It falls back to the block engine when the host isn't x86-64.
+	enum class Engine
 	{
-		unsigned opcode : 7;
-		unsigned rd : 5;
-		unsigned func3 : 3;
-		unsigned rs1 : 5;
-		unsigned imm : 12;
+		Interpreter = 0,
+		Threaded,
+		Blocks,
+		JIT
 	};
+	Engine engine = Engine::Interpreter;
 
-	struct S
+	// The interpreter engine runs one of these builds of the interpreter core, see CorePolicies.h. Fast is the plain
+	// interpreter. Instrumented traces every instruction (see getTrace), counts cycles in mcycle with a simple timing
+	// model and sends every load and store through the bus. RV32I doesn't implement the M extension. The other engines
+	// always behave like Fast, as does single-stepping with clock().
+	enum class Core
 	{
-		unsigned opcode : 7;
-		unsigned imm4_0 : 5;
-		unsigned func3 : 3;
-		unsigned rs1 : 5;
-		unsigned rs2 : 5;
-		unsigned imm11_5 : 7;
+		Fast = 0,
+		Instrumented,
+		RV32I,
+		Count
 	};
+	Core core = Core::Fast;
 
-	struct B
+	struct TraceEntry
 	{
-		unsigned opcode : 7;
-		unsigned imm11 : 1;
-		unsigned imm4_1 : 4;
-		unsigned func3 : 3;
-		unsigned rs1 : 5;
-		unsigned rs2 : 5;
-		unsigned imm10_5 : 6;
-		unsigned imm12 : 1;
+		uint32_t pc;
+		uint32_t instruction;
 	};
+	static constexpr uint32_t TraceSize = 4096;
+	// Returns the last (up to TraceSize) instructions the instrumented core executed, oldest first
+	std::vector<TraceEntry> getTrace();
+	void recordTrace(uint32_t pc, uint32_t instruction) { traceBuffer[traced++ % TraceSize] = { pc, instruction }; }
 
-	struct U
+	// executes count instructions using the selected engine
+	void clock(uint64_t count);
+
+	// Why run(), runUntil() or runUntilTrap() returned
+	enum class StopReason
 	{
-		unsigned opcode : 7;
-		unsigned rd : 5;
-		unsigned imm31_12 : 20;
+		Budget = 0, // maxInstructions were executed
+		ReachedPc, // pc reached the address given to runUntil()
+		Trap, // runUntilTrap() took an exception or interrupt
+		Debug // the debug countdown ran out
 	};
-
-	struct J
+	struct RunResult
 	{
-		unsigned opcode : 7;
-		unsigned rd : 5;
-		unsigned imm19_12 : 8;
-		unsigned imm11 : 1;
-		unsigned imm10_1 : 10;
-		unsigned imm20 : 1;
+		StopReason reason;
+		uint64_t executed; // the amount of instructions that were executed
 	};
-}
 
-
-class CPU
-{
-public:
-	CPU(const std::function<void()>& startDebug);
-	~CPU();
-
-public:
-	void connectBus(Bus* bus);
-	void clock();
-	void reset();
+	// Executes up to maxInstructions instructions using the selected engine, it stops early when debugging starts. The
+	// engines other than the interpreter only stop right at that instruction if the debug countdown was already running.
+	RunResult run(uint64_t maxInstructions);
+	// Execute instructions until pc is addr after an instruction or a trap was taken. These are always interpreted, so
+	// they can stop at any instruction.
+	RunResult runUntil(uint32_t addr, uint64_t maxInstructions = UINT64_MAX);
+	RunResult runUntilTrap(uint64_t maxInstructions = UINT64_MAX);
 
 public:
 	Bus* bus;
@@ -121,62 +138,281 @@ public:
 		None // eg. 'ecall'
 	};
 
-	struct Instruction
+	// Every instruction that can be executed, this is used as an index in executeLookup and by the threaded interpreter
+	enum class Operation : uint8_t
+	{
+		AddI = 0, SltI, SltIU, XorI, OrI, AndI, SllI, SrlI, SraI,
+		Add, Sub, Sll, Slt, SltU, Xor, Srl, Sra, Or, And,
+		Mul, MulH, MulHSU, MulHU, Div, DivU, Rem, RemU,
+		Lb, Lh, Lw, LbU, LhU,
+		Sb, Sh, Sw,
+		Lui, Auipc,
+		Beq, Bne, Blt, Bge, BltU, BgeU,
+		Jal, Jalr,
+		Fence,
+		CsrRW, CsrRS, CsrRC, CsrRWI, CsrRSI, CsrRCI,
+		Ebreak, Ecall, Mret,
+		Illegal, Nop,
+		Count // amount of operations, not an operation itself
+	};
+
+	// The result of decoding an instruction. Decoding is pure: it doesn't allocate and doesn't create exceptions, an
+	// invalid instruction simply decodes to Operation::Illegal. The immediate is already sign-extended (or holds the CSR
+	// address for CSR instructions), rs1 doubles as the immediate for the CSRImmediate type.
+	struct DecodedInstruction
+	{
+		Operation operation = Operation::Illegal;
+		ArgumentType argumentType = ArgumentType::None;
+		uint8_t rd = 0;
+		uint8_t rs1 = 0;
+		uint8_t rs2 = 0;
+		uint32_t imm = 0;
+		uint32_t instruction = 0; // the raw instruction, used for exception values
+	};
+
+	// An instruction that has already been decoded together with its execute function, executing it doesn't need any
+	// more decoding.
+	struct MicroOp : DecodedInstruction
 	{
-		std::wstring name;
-		ArgumentType argumentType;
-		void (CPU::* execute)(void) = nullptr;
+		void (CPU::* execute)(const MicroOp& op) = nullptr;
 	};
 
-	typedef Instruction(CPU::* InstructionDecoder)(uint32_t instr);
+	typedef void (CPU::* ExecuteFunction)(const MicroOp& op);
+
+	// The execute function of every operation, indexed by Operation
+	static const std::array<ExecuteFunction, (size_t)Operation::Count> executeLookup;
+	// The name and argument type of every operation, indexed by Operation. These are only needed for disassembling.
+	static const std::array<const wchar_t*, (size_t)Operation::Count> operationNames;
+	static const std::array<ArgumentType, (size_t)Operation::Count> argumentTypes;
 
-	// This is an collection of 32 functions which decode an instruction. The index depends on bits 2-7 of the opcode (the first two have to be 0b11)
-	std::vector<InstructionDecoder> opcodeLookup; 
+	// Decodes with the tables generated from the instruction encodings in ISA.h
+	static DecodedInstruction decode(uint32_t instr);
 
 public:
-	// instruction decoders that will be placed in opcodeLookup
-	Instruction XXX(uint32_t instr);
-	Instruction OP_IMM(uint32_t instr);
-	Instruction OP(uint32_t instr);
-	Instruction LOAD(uint32_t instr);
-	Instruction STORE(uint32_t instr);
-	Instruction LUI(uint32_t instr);
-	Instruction AUIPC(uint32_t instr);
-	Instruction BRANCH(uint32_t instr);
-	Instruction JALR(uint32_t instr);
-	Instruction JAL(uint32_t instr);
-	Instruction MISC_MEM(uint32_t instr);
-	Instruction SYSTEM(uint32_t instr);
+	// Decodes an instruction into a MicroOp
+	MicroOp predecode(uint32_t instr);
+	// Returns the decoded instruction at addr, or nullptr if it could not be fetched. Instructions in the Text range are
+	// kept in the predecode cache, others are decoded again every time.
+	const MicroOp* fetch(uint32_t addr);
+	// Should be called after every write to memory, drops the cached instruction at addr if there is one
+	void invalidatePredecoded(uint32_t addr);
+
+private:
+	// Loads and stores to pages that are plain memory are done on the host memory directly. The host memory of recently
+	// accessed pages is kept in direct-mapped TLBs, a hit costs a tag compare. Stores have their own TLB that never
+	// holds a page of the Text range, so stores to code still go through the bus and invalidatePredecoded.
+	// Misaligned accesses always use the bus, which makes them fault.
+	// With fastmem the TLBs aren't used, every access is tried on the window and only goes through the bus if it faults.
+	struct TlbEntry {
+		uint32_t page; // addr >> Bus::PageBits, InvalidTlbPage if the entry is empty
+		uint8_t* host;
+	};
+	static constexpr uint32_t TlbSize = 256;
+	static constexpr uint32_t InvalidTlbPage = 0xFFFF'FFFF;
+	typedef std::array<TlbEntry, TlbSize> Tlb;
+	Tlb loadTlb;
+	Tlb storeTlb;
+
+	void flushTlbs();
+	// Returns false if the page of addr isn't plain memory, or is in the Text range for stores
+	bool fillTlb(TlbEntry& entry, uint32_t addr, bool isStore);
+
+	// These return false if the access has to go through the bus
+	template <typename T>
+	bool loadDirect(uint32_t addr, T& value);
+	template <typename T>
+	bool storeDirect(uint32_t addr, T value);
+
+	Fastmem* fastmem = nullptr;
+	uint8_t* fastmemBase = nullptr; // the base of fastmem's window, nullptr if it isn't used
 
+private:
+	// The predecode cache covers the Text range, split into pages that are only allocated when code in them is executed
+	static constexpr uint32_t PredecodePageSize = 4096;
+	typedef std::array<MicroOp, PredecodePageSize / 4> PredecodePage;
+	std::vector<std::unique_ptr<PredecodePage>> predecodeCache;
+	MicroOp uncachedOp;
+	MicroOp fetchFaultOp; // a nop, used when an instruction can't be fetched
 
+private:
+	// Every instruction is executed as beginInstruction(), followed by the MicroOp it returned, followed by retireInstruction()
+	// These are shared by all engines so they handle exceptions and interrupts in exactly the same way.
+	const MicroOp* beginInstruction();
+	// Returns true if an exception or interrupt was taken. Interrupts are only checked if checkInterrupts is set.
+	bool retireInstruction(bool checkInterrupts = true);
+
+	// The interpreter loop behind run(), runUntil() and runUntilTrap(), stopPc is nullptr if it doesn't stop at a pc.
+	// Config is a CoreConfig, runCore runs the one selected by core.
+	template <typename Config>
+	RunResult runInterpreted(uint64_t maxInstructions, const uint32_t* stopPc, bool stopOnTrap);
+	RunResult runCore(uint64_t maxInstructions, const uint32_t* stopPc, bool stopOnTrap);
+	typedef RunResult(CPU::* CoreFunction)(uint64_t maxInstructions, const uint32_t* stopPc, bool stopOnTrap);
+	static const std::array<CoreFunction, (size_t)Core::Count> coreLookup;
+	bool debugStarted = false; // set when the debug countdown ran out
+
+	std::array<TraceEntry, TraceSize> traceBuffer{};
+	uint64_t traced = 0; // the amount of instructions that were ever traced
+
+	struct FrozenState
+	{
+		uint32_t pc;
+		std::array<uint32_t, 32> regs;
+		CSR csr;
+	};
+	std::unique_ptr<FrozenState> frozenState; // set by freeze
+	bool textWritten = false; // set when the Text range is written
+
+	void clockThreaded(uint64_t count);
+
+public:
+	// Native code for (the start of) a basic block. It gets the registers and the host memory backing RAM and returns the
+	// next pc in the low 32 bits and the amount of instructions it executed in the high 32 bits.
+	typedef uint64_t(*NativeBlock)(uint32_t* regs, uint8_t* ram);
+
+	// A straight-line piece of code from the Text range, ending with the first instruction that can change the control flow
+	// (branches, jumps and SYSTEM instructions). Once the block that follows is known it is linked, so the next block can be
+	// found without a lookup in the block cache.
+	struct BasicBlock
+	{
+		struct Link
+		{
+			uint32_t pc = 0;
+			BasicBlock* block = nullptr;
+		};
+
+		uint32_t startPc = 0;
+		std::vector<MicroOp> ops;
+		std::vector<ExecuteFunction> fused; // the fused handler of the pair starting at every op, or nullptr
+		// A branch has two possible successors, a jalr that isn't a return (eg. a switch table) keeps its recent targets
+		std::array<Link, 4> links;
+		uint32_t nextLink = 0; // the link that will be replaced when a new successor is found
+		// Set if the block ends with a call or a return, see predictReturn
+		bool isCall = false;
+		bool isReturn = false;
+		BasicBlock* returnBlock = nullptr; // if the block ends with a call, the block it returns to once it was returned to
+
+		uint32_t executions = 0; // counted until the block is hot enough to be translated
+		// Set from the AOT module when the block is created, or published by the JIT's compile thread once the block is
+		// translated. nativeLength is set before native.
+		std::atomic<NativeBlock> native{ nullptr };
+		uint32_t nativeLength = 0; // the amount of instructions at the start of the block that were translated
+
+		std::unique_ptr<LoopIdiom> loop; // set if the block is a copy, fill or scan loop that can be run at once
+	};
+
+	void flushBlockCache();
+
+	// The block cache can be saved together with how often every block was executed, so the next run of the same program
+	// doesn't have to warm up again. imageHash identifies the program (see RAM::imageHash), a file saved for another
+	// program is ignored, as are saved blocks whose instructions don't match memory anymore. Hot blocks are queued for
+	// the JIT right away when loading. Both return false if the file couldn't be used.
+	bool saveBlockProfile(const std::string& fileName, uint64_t imageHash);
+	bool loadBlockProfile(const std::string& fileName, uint64_t imageHash);
+
+	// Blocks end after MaxBlockLength instructions or at the first instruction for which endsBlock returns true
+	static constexpr uint32_t MaxBlockLength = 64;
+	static bool endsBlock(Operation operation);
+
+private:
+	static constexpr uint32_t BlockProfileVersion = 1;
+
+	// Returns the cached block starting at addr, or translates a new one. Returns nullptr if addr is outside the Text range.
+	BasicBlock* lookupBlock(uint32_t addr);
+	void clockBlocks(uint64_t count);
+
+	// Calls (jal and jalr that link to ra or t0) push the block they were made from, so the return (jalr through ra or
+	// t0) can go to the block after the call without a lookup. Mispredictions, also after a trap, are detected by
+	// comparing the pc.
+	struct ReturnAddress
+	{
+		uint32_t pc = 0;
+		BasicBlock* caller = nullptr;
+	};
+	static constexpr uint32_t ReturnStackSize = 16; // deeper calls overwrite the oldest entries
+	std::array<ReturnAddress, ReturnStackSize> returnStack;
+	uint32_t returnStackTop = 0;
+
+	// Updates the return address stack after a block that ends with a call or return was executed, returns the block
+	// that was returned to if it was predicted, or nullptr.
+	BasicBlock* predictReturn(BasicBlock& block);
+
+	std::unordered_map<uint32_t, std::unique_ptr<BasicBlock>> blockCache;
+	std::vector<bool> blockPages; // the predecode pages that contain code used by a block
+	bool blockCacheStale = false; // set when a block was overwritten, the block cache is flushed at the next block boundary
+
+private:
+	static constexpr uint32_t JitThreshold = 32; // the amount of executions after which a block is queued for translation
+
+	// Runs the native code of block if it was translated and there is no reason to interpret it, the instructions
+	// executed natively are retired at once. Returns how many instructions of block were executed.
+	uint32_t runNative(BasicBlock& block, uint64_t& count);
+
+	static constexpr uint32_t MaxLoopIterations = 1 << 20; // so a bulk loop can't run for too long between interrupt checks
+
+	// Runs as many iterations of block->loop at once as fit in count, they are retired at once. Returns false if the
+	// loop has to be interpreted.
+	bool runLoopIdiom(BasicBlock& block, uint64_t& count);
+
+	std::unique_ptr<JIT> jit; // nullptr when RAM can't be accessed directly
+	std::unique_ptr<AOT> aot; // nullptr when no AOT module is loaded
+	uint8_t* ramHostPointer = nullptr;
+	uint32_t ramHostSize = 0; // the amount of bytes of RAM that ramHostPointer backs, 0 when it is nullptr
+
+public:
+	// Loads a module created by AOT::generate for the program identified by imageHash, the JIT engine then runs its blocks
+	// natively without warming up. Returns false if the module can't be loaded or was made for another program.
+	bool loadAOT(const std::string& fileName, uint64_t imageHash);
+
+public:
 	// instruction execute functions
 	// Immediate
-	void AddI(); void SltI(); void SltIU(); void XorI(); void OrI(); void AndI(); void SllI(); void SrlI(); void SraI(); 
+	void AddI(const MicroOp& op); void SltI(const MicroOp& op); void SltIU(const MicroOp& op); void XorI(const MicroOp& op); void OrI(const MicroOp& op); 
+	void AndI(const MicroOp& op); void SllI(const MicroOp& op); void SrlI(const MicroOp& op); void SraI(const MicroOp& op); 
 	// Register
-	void Add(); void Sub(); void Sll(); void Slt(); void SltU(); void Xor(); void Srl(); void Sra(); void Or(); void And();
-	void Mul(); void MulH(); void MulHSU(); void MulHU(); void Div(); void DivU(); void Rem(); void RemU();
-	// Load
-	void Lb(); void Lh(); void Lw(); void LbU(); void LhU(); 
+	void Add(const MicroOp& op); void Sub(const MicroOp& op); void Sll(const MicroOp& op); void Slt(const MicroOp& op); void SltU(const MicroOp& op); 
+	void Xor(const MicroOp& op); void Srl(const MicroOp& op); void Sra(const MicroOp& op); void Or(const MicroOp& op); void And(const MicroOp& op);
+	void Mul(const MicroOp& op); void MulH(const MicroOp& op); void MulHSU(const MicroOp& op); void MulHU(const MicroOp& op); 
+	void Div(const MicroOp& op); void DivU(const MicroOp& op); void Rem(const MicroOp& op); void RemU(const MicroOp& op);
+	// Load, Direct is false for cores that send every access through the bus
+	template <bool Direct = true> void Lb(const MicroOp& op); template <bool Direct = true> void Lh(const MicroOp& op);
+	template <bool Direct = true> void Lw(const MicroOp& op); template <bool Direct = true> void LbU(const MicroOp& op);
+	template <bool Direct = true> void LhU(const MicroOp& op);
 	// Store
-	void Sb(); void Sh(); void Sw();
+	template <bool Direct = true> void Sb(const MicroOp& op); template <bool Direct = true> void Sh(const MicroOp& op);
+	template <bool Direct = true> void Sw(const MicroOp& op);
 	// Lui
-	void Lui();
+	void Lui(const MicroOp& op);
 	// Auipc
-	void Auipc();
+	void Auipc(const MicroOp& op);
 	// Branch
-	void Beq(); void Bne(); void Blt(); void Bge(); void BltU(); void BgeU();
+	void Beq(const MicroOp& op); void Bne(const MicroOp& op); void Blt(const MicroOp& op); void Bge(const MicroOp& op); void BltU(const MicroOp& op); void BgeU(const MicroOp& op);
 	// Jal
-	void Jal();
+	void Jal(const MicroOp& op);
 	// Jalr
-	void Jalr();
+	void Jalr(const MicroOp& op);
 	// Fence
-	void Fence();
+	void Fence(const MicroOp& op);
 	// System
-	void CsrRW(); void CsrRS(); void CsrRC(); void CsrRWI(); void CsrRSI(); void CsrRCI();
-	void Ebreak(); void Ecall();
-	void Mret();
+	void CsrRW(const MicroOp& op); void CsrRS(const MicroOp& op); void CsrRC(const MicroOp& op); void CsrRWI(const MicroOp& op); void CsrRSI(const MicroOp& op); void CsrRCI(const MicroOp& op);
+	void Ebreak(const MicroOp& op); void Ecall(const MicroOp& op);
+	void Mret(const MicroOp& op);
+	// Illegal instruction
+	void Illegal(const MicroOp& op);
 	// Nop
-	void Nop();
+	void Nop(const MicroOp& op);
+
+	// Macro-op fusion: common instruction pairs are executed by one handler, which is passed the first of the two MicroOps
+	// (the second one directly follows it). First never traps or jumps, so it is executed, pc moves on to the second
+	// instruction and Second is executed as usual.
+	template <ExecuteFunction First, ExecuteFunction Second>
+	void Fused(const MicroOp& op)
+	{
+		(this->*First)(op);
+		pc += 4;
+		(this->*Second)((&op)[1]);
+	}
+	// Returns the fused handler for first followed by second, or nullptr if they aren't a pair that is fused
+	static ExecuteFunction fuse(const MicroOp& first, const MicroOp& second);
 
 public:
 	// Exceptions and interrupts
@@ -205,18 +441,7 @@ public:
 
 public:
 	// convenience functions
-	template <typename T>
-	T punnInstruction(uint32_t instr)
-	{
-		return *((T*)&instr);
-	}
-
 	std::wstring disassemble(uint32_t instr);
 	std::wstring regName(uint32_t reg);
 	std::wstring hex(uint32_t n);
-	uint32_t getImm(InstructionType::I instr); // Signed
-	uint32_t getImm(InstructionType::S instr); // Signed
-	uint32_t getImm(InstructionType::B instr); // Signed
-	uint32_t getImm(InstructionType::U instr); // Signed
-	uint32_t getImm(InstructionType::J instr); // Signed
 };
\ No newline at end of file
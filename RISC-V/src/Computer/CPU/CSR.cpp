@@ -1,5 +1,6 @@
 #include <cstdint>
 #include <chrono>
+#include <algorithm>
 #include "CSR.h"
 #include "CPU.h"
 
@@ -60,236 +61,276 @@ void CSR::reset(uint32_t cause)
 {
 	mstatus.MIE = 0;
 	mcause = cause;
+	interruptCheckPending = true;
 }
 
 bool CSR::read(uint32_t address, uint32_t& value, bool bReadOnly)
 {
-	switch (address)
-	{
-	case MSTATUS:
-		value = *(uint32_t*)&mstatus;
-		return true;
-	case MISA:
-		value = 0b01'0000'00000000100010000000000000U;
-		return true;
-
-	case MIE:
-		value = *(uint32_t*)&mie;
-		return true;
-	case MTVEC:
-		value = mtvec;
-		return true;
-
-	case MCOUNTINHIBIT:
-		value = countinhibit;
-		return true;
-
-	case MSCRATCH:
-		value = mscratch;
-		return true;
-	case MEPC:
-		value = mepc;
-		return true;
-	case MCAUSE:
-		value = mcause;
-		return true;
-	case MTVAL:
-		value = mtval;
-		return true;
-	case MIP:
-		updateMip();
-		value = *(uint32_t*)&mipInternal;
-		return true;
-
-	case DEBUG:
-		value = debug;
-		return true;
-
-	case UREG00:
-		value = ureg00;
-		return true;
-
-	case MCYCLE:
-	case CYCLE:
-		value = cycle & 0xFFFF'FFFFU;
-		return true;
-	case TIME:
-		value = this->cpu->timer->getTimeLow();
-		return true;
-	case MINSTRET:
-	case INSTRET:
-		value = instret & 0xFFFF'FFFFU;
-		return true;
-
-	case MCYCLEH:
-	case CYCLEH:
-		value = cycle >> 32;
-		return true;
-	case TIMEH:
-		value = this->cpu->timer->getTimeHigh();
-		return true;
-	case MINSTRETH:
-	case INSTRETH:
-		value = instret >> 32;
-		return true;
-
-	case MVENDORID:
-	case MARCHID:
-	case MIMPID:
-	case MHARTID:
-		value = 0;
-		return true;
-
-	default:
+	const Accessor& accessor = accessors[address & 0xFFF];
+	if (address > 0xFFF || accessor.read == nullptr)
 		return false;
-	}
+	value = (this->*accessor.read)();
+	return true;
 }
 
 bool CSR::write(uint32_t address, uint32_t value)
 {
-	switch (address)
-	{
-	case MSTATUS:
-	{
-		MStatus castValue = *(MStatus*)&value;
-		mstatus.MIE = castValue.MIE;
-		mstatus.MPIE = castValue.MPIE;
-		return true;
-	}
-	case MISA:
-		return true; // immutable but writable
-
-	case MIE:
-	{
-		MInterruptCSR castValue = *(MInterruptCSR*)&value;
-		mie.bits.MEI = castValue.bits.MEI;
-		mie.bits.MSI = castValue.bits.MSI;
-		mie.bits.MTI = castValue.bits.MTI;
-		return true;
-	}
-	case MTVEC:
-		mtvec = value & 0xFFFF'FFFDU;
-		return true;
-
-	case MCOUNTINHIBIT:
-		countinhibit = value & 0b101;
-		return true;
-
-	case MSCRATCH:
-		mscratch = value;
-		return true;
-	case MEPC:
-		mepc = value & 0xFFFF'FFFCU;
-		return true;
-	case MCAUSE:
-		mcause = value;
-		return true;
-	case MTVAL:
-		mtval = value;
-		return true;
-	case MIP:
-		// M-level ip bits are not writable directly, U- or S-level bits would be writable if they were implemented
-		return true;
-	
-	case DEBUG:
-		debug = value;
-		if (debug == 0)
-			startDebug();
-		return true;
-
-	case UREG00:
-		ureg00 = value;
-		return true;
-	
-	case MCYCLE:
-		cycle = (cycle & 0xFFFF'FFFF'0000'0000U) | value;
-		return true;
-	case MINSTRET:
-		instret = (instret & 0xFFFF'FFFF'0000'0000U) | value;
-		return true;
-
-	case MCYCLEH:
-		cycle = (cycle & 0x0000'0000'FFFF'FFFFU) | ((uint64_t)value << 32);
-		return true;
-	case MINSTRETH:
-		instret = (instret & 0x0000'0000'FFFF'FFFFU) | ((uint64_t)value << 32);
-		return true;
-
-	// others are read-only, so treat as non-existant
-	default:
+	// read-only CSRs are treated as non-existant
+	const Accessor& accessor = accessors[address & 0xFFF];
+	if (address > 0xFFF || accessor.write == nullptr)
 		return false;
-	}
+	(this->*accessor.write)(value);
+	return true;
 }
 
 std::wstring CSR::getName(uint32_t address)
 {
-	switch (address)
-	{
-	case MSTATUS:
-		return L"mstatus";
-	case MISA:
-		return L"misa";
-
-	case MIE:
-		return L"mie";
-	case MTVEC:
-		return L"mtvec";
-
-	case MCOUNTINHIBIT:
-		return L"mcountinhibit";
-
-	case MSCRATCH:
-		return L"mscratch";
-	case MEPC:
-		return L"mepc";
-	case MCAUSE:
-		return L"mcause";
-	case MTVAL:
-		return L"mtval";
-	case MIP:
-		return L"mip";
-
-	case DEBUG:
-		return L"debug";
-
-	case UREG00:
-		return L"ureg00";
-
-	case MCYCLE:
-		return L"mcycle";
-	case MINSTRET:
-		return L"minstret";
-	case MCYCLEH:
-		return L"mcycleh";
-	case MINSTRETH:
-		return L"minstreth";
-
-	case CYCLE:
-		return L"cycle";
-	case TIME:
-		return L"time";
-	case INSTRET:
-		return L"instret";
-
-	case CYCLEH:
-		return L"cycleh";
-	case TIMEH:
-		return L"timeh";
-	case INSTRETH:
-		return L"instreth";
-
-	case MVENDORID:
-		return L"mvendorid";
-	case MARCHID:
-		return L"marchid";
-	case MIMPID:
-		return L"mimpid";
-	case MHARTID:
-		return L"mhartid";
-
-	default:
-		return L"???";
-	}
+	return address > 0xFFF ? L"???" : accessors[address].name;
+}
+
+const std::array<CSR::Accessor, 4096> CSR::accessors = CSR::createAccessors();
+
+std::array<CSR::Accessor, 4096> CSR::createAccessors()
+{
+	std::array<Accessor, 4096> table;
+
+	table[MSTATUS] = { &CSR::readMStatus, &CSR::writeMStatus, L"mstatus" };
+	table[MISA] = { &CSR::readMisa, &CSR::writeIgnored, L"misa" }; // immutable but writable
+
+	table[MIE] = { &CSR::readMie, &CSR::writeMie, L"mie" };
+	table[MTVEC] = { &CSR::readMtvec, &CSR::writeMtvec, L"mtvec" };
+
+	table[MCOUNTINHIBIT] = { &CSR::readCountInhibit, &CSR::writeCountInhibit, L"mcountinhibit" };
+
+	table[MSCRATCH] = { &CSR::readMScratch, &CSR::writeMScratch, L"mscratch" };
+	table[MEPC] = { &CSR::readMepc, &CSR::writeMepc, L"mepc" };
+	table[MCAUSE] = { &CSR::readMcause, &CSR::writeMcause, L"mcause" };
+	table[MTVAL] = { &CSR::readMtval, &CSR::writeMtval, L"mtval" };
+	// M-level ip bits are not writable directly, U- or S-level bits would be writable if they were implemented
+	table[MIP] = { &CSR::readMip, &CSR::writeIgnored, L"mip" };
+
+	table[DEBUG] = { &CSR::readDebug, &CSR::writeDebug, L"debug" };
+
+	table[UREG00] = { &CSR::readUreg00, &CSR::writeUreg00, L"ureg00" };
+
+	table[MCYCLE] = { &CSR::readCycle, &CSR::writeCycle, L"mcycle" };
+	table[MINSTRET] = { &CSR::readInstret, &CSR::writeInstret, L"minstret" };
+	table[MCYCLEH] = { &CSR::readCycleH, &CSR::writeCycleH, L"mcycleh" };
+	table[MINSTRETH] = { &CSR::readInstretH, &CSR::writeInstretH, L"minstreth" };
+
+	table[CYCLE] = { &CSR::readCycle, nullptr, L"cycle" };
+	table[TIME] = { &CSR::readTime, nullptr, L"time" };
+	table[INSTRET] = { &CSR::readInstret, nullptr, L"instret" };
+
+	table[CYCLEH] = { &CSR::readCycleH, nullptr, L"cycleh" };
+	table[TIMEH] = { &CSR::readTimeH, nullptr, L"timeh" };
+	table[INSTRETH] = { &CSR::readInstretH, nullptr, L"instreth" };
+
+	table[MVENDORID] = { &CSR::readZero, nullptr, L"mvendorid" };
+	table[MARCHID] = { &CSR::readZero, nullptr, L"marchid" };
+	table[MIMPID] = { &CSR::readZero, nullptr, L"mimpid" };
+	table[MHARTID] = { &CSR::readZero, nullptr, L"mhartid" };
+
+	return table;
+}
+
+uint32_t CSR::readMStatus()
+{
+	return *(uint32_t*)&mstatus;
+}
+
+uint32_t CSR::readMisa()
+{
+	return 0b01'0000'00000000100010000000000000U;
+}
+
+uint32_t CSR::readMie()
+{
+	return mie.word;
+}
+
+uint32_t CSR::readMtvec()
+{
+	return mtvec;
+}
+
+uint32_t CSR::readCountInhibit()
+{
+	return countinhibit;
+}
+
+uint32_t CSR::readMScratch()
+{
+	return mscratch;
+}
+
+uint32_t CSR::readMepc()
+{
+	return mepc;
+}
+
+uint32_t CSR::readMcause()
+{
+	return mcause;
+}
+
+uint32_t CSR::readMtval()
+{
+	return mtval;
+}
+
+uint32_t CSR::readMip()
+{
+	updateMip();
+	return mipInternal.word;
+}
+
+uint32_t CSR::readDebug()
+{
+	return getDebugCountdown();
+}
+
+uint32_t CSR::readUreg00()
+{
+	return ureg00;
+}
+
+uint32_t CSR::readCycle()
+{
+	return getCounter(cycleOffset, InhibitCycle) & 0xFFFF'FFFFU;
+}
+
+uint32_t CSR::readCycleH()
+{
+	return getCounter(cycleOffset, InhibitCycle) >> 32;
+}
+
+uint32_t CSR::readTime()
+{
+	return this->cpu->timer->getTimeLow();
+}
+
+uint32_t CSR::readTimeH()
+{
+	return this->cpu->timer->getTimeHigh();
+}
+
+uint32_t CSR::readInstret()
+{
+	return getCounter(instretOffset, InhibitInstret) & 0xFFFF'FFFFU;
+}
+
+uint32_t CSR::readInstretH()
+{
+	return getCounter(instretOffset, InhibitInstret) >> 32;
+}
+
+uint32_t CSR::readZero()
+{
+	return 0;
+}
+
+void CSR::writeMStatus(uint32_t value)
+{
+	MStatus castValue = *(MStatus*)&value;
+	mstatus.MIE = castValue.MIE;
+	mstatus.MPIE = castValue.MPIE;
+	interruptCheckPending = true;
+}
+
+void CSR::writeIgnored(uint32_t)
+{
+}
+
+void CSR::writeMie(uint32_t value)
+{
+	MInterruptCSR castValue = { value };
+	mie.bits.MEI = castValue.bits.MEI;
+	mie.bits.MSI = castValue.bits.MSI;
+	mie.bits.MTI = castValue.bits.MTI;
+	interruptCheckPending = true;
+}
+
+void CSR::writeMtvec(uint32_t value)
+{
+	mtvec = value & 0xFFFF'FFFDU;
+}
+
+void CSR::writeCountInhibit(uint32_t value)
+{
+	// A counter that stops keeps its current value, a counter that starts continues from it
+	uint64_t cycle = getCounter(cycleOffset, InhibitCycle);
+	uint64_t instret = getCounter(instretOffset, InhibitInstret);
+	countinhibit = value & (InhibitCycle | InhibitInstret);
+	setCounter(cycleOffset, InhibitCycle, cycle);
+	setCounter(instretOffset, InhibitInstret, instret);
+}
+
+void CSR::writeMScratch(uint32_t value)
+{
+	mscratch = value;
+}
+
+void CSR::writeMepc(uint32_t value)
+{
+	mepc = value & 0xFFFF'FFFCU;
+}
+
+void CSR::writeMcause(uint32_t value)
+{
+	mcause = value;
+}
+
+void CSR::writeMtval(uint32_t value)
+{
+	mtval = value;
+}
+
+void CSR::writeDebug(uint32_t value)
+{
+	debugDeadline = value == 0xFFFF'FFFF ? Scheduler::Never : executed + value;
+	if (value == 0 || value == 0xFFFF'FFFF)
+		scheduler.cancel(Scheduler::Event::Debug);
+	else
+		scheduler.schedule(Scheduler::Event::Debug, debugDeadline);
+
+	if (value == 0)
+		startDebug();
+}
+
+void CSR::writeUreg00(uint32_t value)
+{
+	ureg00 = value;
+}
+
+void CSR::writeCycle(uint32_t value)
+{
+	setCounter(cycleOffset, InhibitCycle, (getCounter(cycleOffset, InhibitCycle) & 0xFFFF'FFFF'0000'0000U) | value);
+}
+
+void CSR::writeCycleH(uint32_t value)
+{
+	setCounter(cycleOffset, InhibitCycle, (getCounter(cycleOffset, InhibitCycle) & 0x0000'0000'FFFF'FFFFU) | ((uint64_t)value << 32));
+}
+
+void CSR::writeInstret(uint32_t value)
+{
+	setCounter(instretOffset, InhibitInstret, (getCounter(instretOffset, InhibitInstret) & 0xFFFF'FFFF'0000'0000U) | value);
+}
+
+void CSR::writeInstretH(uint32_t value)
+{
+	setCounter(instretOffset, InhibitInstret, (getCounter(instretOffset, InhibitInstret) & 0x0000'0000'FFFF'FFFFU) | ((uint64_t)value << 32));
+}
+
+uint64_t CSR::getCounter(uint64_t offset, uint32_t inhibitBit)
+{
+	return (countinhibit & inhibitBit) != 0 ? offset : executed + offset;
+}
+
+void CSR::setCounter(uint64_t& offset, uint32_t inhibitBit, uint64_t value)
+{
+	offset = (countinhibit & inhibitBit) != 0 ? value : value - executed;
 }
 
 uint32_t CSR::executeException(uint32_t epc, uint32_t causeNum, uint32_t val, bool bInterrupt)
@@ -316,11 +357,16 @@ uint32_t CSR::returnExcepion()
 {
 	mstatus.MIE = mstatus.MPIE;
 	mstatus.MPIE = 1;
+	interruptCheckPending = true;
 	return mepc;
 }
 
 CSR::CheckInterruptsReturn CSR::checkInterrupts(uint32_t epc)
 {
+	if (!interruptCheckPending)
+		return { false, 0 };
+	interruptCheckPending = false;
+
 	if (!mstatus.MIE)
 		return { false, 0 };
 
@@ -354,20 +400,62 @@ CSR::CheckInterruptsReturn CSR::checkInterrupts(uint32_t epc)
 	return { true, newPc };
 }
 
-void CSR::clock()
+bool CSR::interruptsEnabled()
+{
+	return mstatus.MIE && mie.word != 0;
+}
+
+void CSR::interruptsChanged()
+{
+	interruptCheckPending = true;
+	// A poll that is already due sooner stays, otherwise frequent changes would keep pushing it back
+	scheduler.schedule(Scheduler::Event::TimerPoll,
+		std::min(scheduler.getDeadline(Scheduler::Event::TimerPoll), executed + TimerPollInterval));
+}
+
+void CSR::clock(uint32_t count)
 {
-	if ((countinhibit & 0b001) == 0)
-		instret++;
-	if ((countinhibit & 0b100) == 0)
-		cycle++;
-	if (debug != 0xFFFF'FFFF)
+	executed += count;
+	if (executed >= scheduler.getNextDeadline())
+		runEvents();
+}
+
+uint32_t CSR::getDebugCountdown()
+{
+	// The countdown stays at 0 for the instruction that started debugging and stops afterwards
+	if (debugDeadline == Scheduler::Never || executed > debugDeadline)
+		return 0xFFFF'FFFF;
+	return (uint32_t)(debugDeadline - executed);
+}
+
+void CSR::runEvents()
+{
+	Scheduler::Event event;
+	while (scheduler.takeDue(executed, event))
 	{
-		debug--;
-		if (debug == 0)
+		switch (event)
+		{
+		case Scheduler::Event::Debug:
 			startDebug();
+			break;
+		case Scheduler::Event::TimerPoll:
+			pollTimer();
+			break;
+		default:
+			break;
+		}
 	}
 }
 
+void CSR::pollTimer()
+{
+	interruptCheckPending = true;
+
+	// Once the timer interrupt started it stays until mtimecmp is written, which schedules the next poll
+	if (cpu->timer->getTimeCmpFull() != 0xFFFF'FFFF'FFFF'FFFFU && !cpu->timer->hasInterrupt())
+		scheduler.schedule(Scheduler::Event::TimerPoll, executed + TimerPollInterval);
+}
+
 void CSR::updateMip()
 {
 	mipInternal.bits.MTI = this->cpu->timer->hasInterrupt() ? 1 : 0;
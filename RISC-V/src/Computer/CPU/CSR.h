@@ -1,7 +1,10 @@
 #pragma once
 #include <cstdint>
 #include <string>
+#include <array>
+#include <vector>
 #include <functional>
+#include "Scheduler.h"
 
 class CPU;
 
@@ -29,12 +32,40 @@ public:
 public:
 	// Checks for interrupts. If there are any, executes them and returns true and the new pc, otherwise, returns false
 	// epc is the epc that will be used if there are any interrupts
+	// Interrupts are only looked at when something that can change them happened since the last check, see
+	// isInterruptCheckPending.
 	struct CheckInterruptsReturn {
 		bool hasInterrupt; uint32_t newPc;
-	} checkInterrupts(uint32_t epc);
+	};
+	CheckInterruptsReturn checkInterrupts(uint32_t epc);
+	// Returns false if checkInterrupts can't find an interrupt whatever is pending. This only changes when the CSRs are
+	// written or a trap is taken or returned from.
+	bool interruptsEnabled();
+	// True if an interrupt may have started or been enabled since checkInterrupts last looked
+	bool isInterruptCheckPending() const { return interruptCheckPending; }
+	// Devices call this (through the bus) when their interrupt starts or stops or the timer is written
+	void interruptsChanged();
 
 public:
-	void clock();
+	// Called for every instruction. The counters are calculated from the amount of executed instructions when they are
+	// read, so only the next scheduled event has to be checked.
+	void clock()
+	{
+		if (++executed >= scheduler.getNextDeadline())
+			runEvents();
+	}
+	// Advances the counters as if count instructions were executed
+	void clock(uint32_t count);
+	// True if a scheduled event is due within the next count calls to clock()
+	bool isEventDue(uint32_t count) const { return executed + count >= scheduler.getNextDeadline(); }
+	// Adds cycles that an instruction took on top of its own, for cores with a timing model. Only mcycle counts them.
+	void addCycles(uint64_t cycles)
+	{
+		if ((countinhibit & InhibitCycle) == 0)
+			cycleOffset += cycles;
+	}
+	// The amount of instructions left before debugging starts, 0xFFFF'FFFF if it isn't counting down
+	uint32_t getDebugCountdown();
 
 public:
 	// For drawing
@@ -104,10 +135,77 @@ private:
 	std::function<void()> startDebug;
 
 private:
-	uint64_t instret = 0; // amount of instructions executed
-	uint64_t cycle = 0; // amount of cycles
+	// Every CSR address has an entry, read is nullptr for CSRs that don't exist and write for read-only ones
+	struct Accessor
+	{
+		uint32_t (CSR::* read)() = nullptr;
+		void (CSR::* write)(uint32_t value) = nullptr;
+		const wchar_t* name = L"???";
+	};
+	static const std::array<Accessor, 4096> accessors;
+	static std::array<Accessor, 4096> createAccessors();
+
+	uint32_t readMStatus();
+	uint32_t readMisa();
+	uint32_t readMie();
+	uint32_t readMtvec();
+	uint32_t readCountInhibit();
+	uint32_t readMScratch();
+	uint32_t readMepc();
+	uint32_t readMcause();
+	uint32_t readMtval();
+	uint32_t readMip();
+	uint32_t readDebug();
+	uint32_t readUreg00();
+	uint32_t readCycle();
+	uint32_t readCycleH();
+	uint32_t readTime();
+	uint32_t readTimeH();
+	uint32_t readInstret();
+	uint32_t readInstretH();
+	uint32_t readZero();
+
+	void writeMStatus(uint32_t value);
+	void writeIgnored(uint32_t value);
+	void writeMie(uint32_t value);
+	void writeMtvec(uint32_t value);
+	void writeCountInhibit(uint32_t value);
+	void writeMScratch(uint32_t value);
+	void writeMepc(uint32_t value);
+	void writeMcause(uint32_t value);
+	void writeMtval(uint32_t value);
+	void writeDebug(uint32_t value);
+	void writeUreg00(uint32_t value);
+	void writeCycle(uint32_t value);
+	void writeCycleH(uint32_t value);
+	void writeInstret(uint32_t value);
+	void writeInstretH(uint32_t value);
+
+private:
+	// mcountinhibit bits
+	static constexpr uint32_t InhibitCycle = 0b001;
+	static constexpr uint32_t InhibitInstret = 0b100;
+
+	// A counter that is counting is executed + its offset, an inhibited counter keeps its value in the offset
+	uint64_t getCounter(uint64_t offset, uint32_t inhibitBit);
+	void setCounter(uint64_t& offset, uint32_t inhibitBit, uint64_t value);
+
+	uint64_t executed = 0; // amount of instructions executed
+	uint64_t cycleOffset = 0;
+	uint64_t instretOffset = 0;
 	uint32_t countinhibit = 0; // stopped counters
 
-	uint32_t debug = -1; // amount of cycles before debug starts
+	uint64_t debugDeadline = Scheduler::Never; // the value of executed at which debug starts
+
+private:
+	// mtime is real time, so a timer interrupt can't be given a deadline in executed instructions. While the timer is
+	// counting towards mtimecmp it is looked at every TimerPollInterval instructions instead.
+	static constexpr uint64_t TimerPollInterval = 1024;
+
+	void runEvents();
+	void pollTimer();
+
+	Scheduler scheduler;
+	bool interruptCheckPending = true;
 };
 
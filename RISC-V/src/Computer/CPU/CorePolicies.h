@@ -0,0 +1,85 @@
+#pragma once
+#include <cstdint>
+#include "CPU.h"
+
+// The policies the interpreter core (CPU::runInterpreted) is built from. Every hook of a disabled feature is an empty
+// inline function or a constant, so it compiles away completely: FastCore is exactly the plain interpreter.
+
+// Tracers see every instruction right before it is executed
+struct NoTracer
+{
+	static void trace(CPU&, const CPU::MicroOp&) {}
+};
+
+// Keeps the last CPU::TraceSize instructions, see CPU::getTrace
+struct RingTracer
+{
+	static void trace(CPU& cpu, const CPU::MicroOp& op) { cpu.recordTrace(cpu.pc, op.instruction); }
+};
+
+// Timing models see every instruction after it was executed (before it is retired), and add the cycles it took on top
+// of the one every instruction takes to mcycle
+struct NoTiming
+{
+	static void execute(CPU&, const CPU::MicroOp&) {}
+};
+
+// A simple in-order pipeline: multiplies and divides have a fixed latency, loads stall for a cycle and taken branches
+// and jumps flush the fetched instruction
+struct LatencyTiming
+{
+	static constexpr uint64_t LoadCycles = 1;
+	static constexpr uint64_t MulCycles = 2;
+	static constexpr uint64_t DivCycles = 33;
+	static constexpr uint64_t TakenJumpCycles = 2;
+
+	static void execute(CPU& cpu, const CPU::MicroOp& op)
+	{
+		using Operation = CPU::Operation;
+		if (Operation::Mul <= op.operation && op.operation <= Operation::MulHU)
+			cpu.csr.addCycles(MulCycles);
+		else if (Operation::Div <= op.operation && op.operation <= Operation::RemU)
+			cpu.csr.addCycles(DivCycles);
+		else if (Operation::Lb <= op.operation && op.operation <= Operation::LhU)
+			cpu.csr.addCycles(LoadCycles);
+		else if (Operation::Beq <= op.operation && op.operation <= Operation::Jalr && cpu.newPc != cpu.pc + 4)
+			cpu.csr.addCycles(TakenJumpCycles);
+	}
+};
+
+// The extensions that are implemented besides the base integer instruction set, the instructions of the others are illegal
+struct RV32IM
+{
+	static constexpr bool M = true;
+};
+
+struct RV32I
+{
+	static constexpr bool M = false;
+};
+
+// DirectMemory accesses pages that are plain memory on the host (through the TLBs or fastmem), BusMemory sends every
+// load and store through the bus, so every access is seen by the devices
+struct DirectMemory
+{
+	static constexpr bool Direct = true;
+};
+
+struct BusMemory
+{
+	static constexpr bool Direct = false;
+};
+
+template <typename TracerPolicy, typename TimingPolicy, typename ExtensionsPolicy, typename MemoryPolicy>
+struct CoreConfig
+{
+	typedef TracerPolicy Tracer;
+	typedef TimingPolicy Timing;
+	typedef ExtensionsPolicy Extensions;
+	typedef MemoryPolicy Memory;
+};
+
+// The configurations that are instantiated, selected with CPU::core
+typedef CoreConfig<NoTracer, NoTiming, RV32IM, DirectMemory> FastCore;
+typedef CoreConfig<RingTracer, LatencyTiming, RV32IM, BusMemory> InstrumentedCore;
+typedef CoreConfig<NoTracer, NoTiming, RV32I, DirectMemory> RV32ICore;
@@ -0,0 +1,182 @@
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include "Fastmem.h"
+#include "../Bus.h"
+
+#if defined(FASTMEM_AVAILABLE)
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace
+{
+	constexpr size_t WindowSize = 8ULL * 1024 * 1024 * 1024;
+
+	struct Fixup
+	{
+		const uint8_t* access;
+		const uint8_t* target;
+	};
+}
+
+extern "C"
+{
+	// Provided by the linker, they are the start and end of the fastmem_fixups section
+	extern const Fixup __start_fastmem_fixups[] __attribute__((weak, visibility("hidden")));
+	extern const Fixup __stop_fastmem_fixups[] __attribute__((weak, visibility("hidden")));
+}
+
+namespace
+{
+	struct CodeRange
+	{
+		const uint8_t* begin;
+		const uint8_t* end;
+	};
+
+	// The handler can't get to a Fastmem object, so the window is global
+	uint8_t* windowBase = nullptr;
+	std::array<CodeRange, 4> codeRanges = {};
+	struct sigaction previousAction;
+
+	void handleFault(int, siginfo_t* info, void* context)
+	{
+		ucontext_t* ucontext = (ucontext_t*)context;
+		const uint8_t* ip = (const uint8_t*)ucontext->uc_mcontext.gregs[REG_RIP];
+		const uint8_t* addr = (const uint8_t*)info->si_addr;
+
+		if (windowBase != nullptr && windowBase <= addr && addr < windowBase + WindowSize)
+		{
+			for (const Fixup* fixup = __start_fastmem_fixups; fixup != __stop_fastmem_fixups; fixup++)
+			{
+				if (fixup->access == ip)
+				{
+					ucontext->uc_mcontext.gregs[REG_RIP] = (greg_t)fixup->target;
+					return;
+				}
+			}
+
+			static const uint8_t marker[3] = { 0x0F, 0x1F, 0x80 };
+			for (const CodeRange& range : codeRanges)
+			{
+				if (range.begin + Fastmem::MarkerSize <= ip && ip < range.end && std::memcmp(ip - Fastmem::MarkerSize, marker, 3) == 0)
+				{
+					int32_t distance;
+					std::memcpy(&distance, ip - 4, 4);
+					ucontext->uc_mcontext.gregs[REG_RIP] = (greg_t)(ip + distance);
+					return;
+				}
+			}
+		}
+
+		// Not a fault of an access to the window, it faults again with the previous (usually the default) handler
+		sigaction(SIGSEGV, &previousAction, nullptr);
+	}
+}
+
+#endif
+
+Fastmem::Fastmem()
+{
+#if defined(FASTMEM_AVAILABLE)
+	if (windowBase != nullptr)
+		return;
+
+	void* window = mmap(nullptr, WindowSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (window == MAP_FAILED)
+		return;
+
+	struct sigaction action = {};
+	action.sa_sigaction = &handleFault;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGSEGV, &action, &previousAction) != 0)
+	{
+		munmap(window, WindowSize);
+		return;
+	}
+
+	base = (uint8_t*)window;
+	windowBase = base;
+#endif
+}
+
+Fastmem::~Fastmem()
+{
+#if defined(FASTMEM_AVAILABLE)
+	if (base == nullptr)
+		return;
+
+	sigaction(SIGSEGV, &previousAction, nullptr);
+	windowBase = nullptr;
+	codeRanges.fill({});
+	munmap(base, WindowSize);
+#endif
+}
+
+bool Fastmem::isAvailable()
+{
+	return base != nullptr;
+}
+
+uint8_t* Fastmem::getBase()
+{
+	return base;
+}
+
+uint8_t* Fastmem::allocate(uint32_t guestAddr, uint32_t size)
+{
+#if defined(FASTMEM_AVAILABLE)
+	uint32_t pageSize = (uint32_t)sysconf(_SC_PAGESIZE);
+	if (base == nullptr || size == 0 || guestAddr % pageSize != 0 || size % pageSize != 0 || (uint64_t)guestAddr + size > 0x1'0000'0000ULL)
+		return nullptr;
+
+	void* memory = mmap(base + guestAddr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	if (memory == MAP_FAILED)
+		return nullptr;
+
+	allocations.push_back({ guestAddr, size });
+	return (uint8_t*)memory;
+#else
+	return nullptr;
+#endif
+}
+
+bool Fastmem::matchesBus(Bus* bus)
+{
+	if (base == nullptr)
+		return false;
+
+	for (const Allocation& allocation : allocations)
+		for (uint64_t addr = allocation.guestAddr; addr < (uint64_t)allocation.guestAddr + allocation.size; addr += Bus::PageSize)
+			if (bus->getHostPage((uint32_t)addr) != base + addr)
+				return false;
+
+	return true;
+}
+
+void Fastmem::registerCode(const uint8_t* begin, const uint8_t* end)
+{
+#if defined(FASTMEM_AVAILABLE)
+	for (CodeRange& range : codeRanges)
+	{
+		if (range.begin == nullptr)
+		{
+			range.end = end;
+			range.begin = begin;
+			return;
+		}
+	}
+#endif
+}
+
+void Fastmem::unregisterCode(const uint8_t* begin)
+{
+#if defined(FASTMEM_AVAILABLE)
+	for (CodeRange& range : codeRanges)
+		if (range.begin == begin)
+			range = {};
+#endif
+}
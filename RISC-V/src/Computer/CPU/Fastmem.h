@@ -0,0 +1,118 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#if defined(__linux__) && defined(__x86_64__)
+#define FASTMEM_AVAILABLE
+#endif
+
+class Bus;
+
+// Reserves a window of host address space in which guest address addr is at getBase() + addr, so a load or store to
+// RAM is a single host access without any checks. Only the memory created with allocate() can be accessed, the pages of
+// devices and unmapped addresses fault. A SIGSEGV handler turns such a fault into a failed access, which is then done
+// through the bus like any other access that can't be done directly. The window is 8 GiB, the upper half is never
+// accessible so a 32-bit offset from anywhere in the lower half faults as well instead of hitting other memory.
+// This is only available on 64-bit Linux, and only one window can exist at a time.
+class Fastmem
+{
+public:
+	Fastmem();
+	~Fastmem();
+
+	Fastmem(const Fastmem&) = delete;
+	Fastmem& operator=(const Fastmem&) = delete;
+
+public:
+	bool isAvailable();
+	uint8_t* getBase();
+
+	// Makes size bytes at guestAddr accessible and returns their (zeroed) host memory, which a device like RAM then uses
+	// as its storage. guestAddr and size have to be multiples of the host page size. Returns nullptr if that isn't
+	// possible.
+	uint8_t* allocate(uint32_t guestAddr, uint32_t size);
+	// Returns true if the bus has the memory of the window at every allocated address, only then the window can be used
+	// instead of the bus
+	bool matchesBus(Bus* bus);
+
+	// Translated code can access the window directly as well. A fault in code between begin and end continues at the
+	// target of the marker right in front of the faulting instruction: a 7-byte nop (nopl disp32(%rax)) whose disp32 is
+	// the distance from the end of the marker to the code that handles the fault.
+	void registerCode(const uint8_t* begin, const uint8_t* end);
+	void unregisterCode(const uint8_t* begin);
+	static constexpr size_t MarkerSize = 7;
+
+public:
+	// Loads and stores on the window, they return false if the access faulted
+	static bool load(const uint8_t* host, int8_t& value);
+	static bool load(const uint8_t* host, uint8_t& value);
+	static bool load(const uint8_t* host, int16_t& value);
+	static bool load(const uint8_t* host, uint16_t& value);
+	static bool load(const uint8_t* host, uint32_t& value);
+	static bool store(uint8_t* host, uint8_t value);
+	static bool store(uint8_t* host, uint16_t value);
+	static bool store(uint8_t* host, uint32_t value);
+
+private:
+	struct Allocation
+	{
+		uint32_t guestAddr;
+		uint32_t size;
+	};
+
+	uint8_t* base = nullptr;
+	std::vector<Allocation> allocations;
+};
+
+// Every access is a single instruction at label 1. Its address and the address of the code that makes the access fail are
+// added to the fastmem_fixups section, which the SIGSEGV handler searches for the faulting instruction.
+#if defined(FASTMEM_AVAILABLE)
+#define FASTMEM_ACCESS(instruction) \
+	"1:\t" instruction "\n" \
+	"2:\n\t" \
+	".pushsection fastmem_fixups, \"aw\"\n\t" \
+	".balign 8\n\t" \
+	".quad 1b, 3f\n\t" \
+	".popsection\n\t" \
+	".pushsection .text.unlikely, \"ax\"\n" \
+	"3:\txorl %k[ok], %k[ok]\n\t" \
+	"jmp 2b\n\t" \
+	".popsection"
+
+#define FASTMEM_LOAD(type, instruction) \
+	inline bool Fastmem::load(const uint8_t* host, type& value) \
+	{ \
+		uint32_t ok = 1, result; \
+		asm volatile(FASTMEM_ACCESS(instruction " %[memory], %k[result]") \
+			: [result] "=r"(result), [ok] "+r"(ok) : [memory] "m"(*(const type*)host)); \
+		value = (type)result; \
+		return ok != 0; \
+	}
+
+#define FASTMEM_STORE(type, instruction, suffix) \
+	inline bool Fastmem::store(uint8_t* host, type value) \
+	{ \
+		uint32_t ok = 1; \
+		asm volatile(FASTMEM_ACCESS(instruction " %" suffix "[value], %[memory]") \
+			: [memory] "=m"(*(type*)host), [ok] "+r"(ok) : [value] "r"(value)); \
+		return ok != 0; \
+	}
+#else
+#define FASTMEM_LOAD(type, instruction) \
+	inline bool Fastmem::load(const uint8_t* host, type& value) { return false; }
+#define FASTMEM_STORE(type, instruction, suffix) \
+	inline bool Fastmem::store(uint8_t* host, type value) { return false; }
+#endif
+
+FASTMEM_LOAD(int8_t, "movsbl")
+FASTMEM_LOAD(uint8_t, "movzbl")
+FASTMEM_LOAD(int16_t, "movswl")
+FASTMEM_LOAD(uint16_t, "movzwl")
+FASTMEM_LOAD(uint32_t, "movl")
+FASTMEM_STORE(uint8_t, "movb", "b")
+FASTMEM_STORE(uint16_t, "movw", "w")
+FASTMEM_STORE(uint32_t, "movl", "k")
+
+#undef FASTMEM_LOAD
+#undef FASTMEM_STORE
@@ -0,0 +1,166 @@
+#pragma once
+#include <cstdint>
+#include <array>
+#include "CPU.h"
+
+// The encoding of every instruction, and the decode table generated from it at compile time. Adding an instruction is
+// adding its encoding to Encodings (and its Operation with an execute function to CPU).
+namespace ISA
+{
+	// The fields of an instruction
+	constexpr uint32_t opcode(uint32_t instr) { return instr & 0x7F; }
+	constexpr uint32_t rd(uint32_t instr) { return (instr >> 7) & 0x1F; }
+	constexpr uint32_t funct3(uint32_t instr) { return (instr >> 12) & 0x7; }
+	constexpr uint32_t rs1(uint32_t instr) { return (instr >> 15) & 0x1F; }
+	constexpr uint32_t rs2(uint32_t instr) { return (instr >> 20) & 0x1F; }
+	constexpr uint32_t funct7(uint32_t instr) { return instr >> 25; }
+	constexpr uint32_t csr(uint32_t instr) { return instr >> 20; } // not sign-extended
+
+	// The sign-extended immediate of every instruction format, the sign is always bit 31 of the instruction
+	constexpr uint32_t immI(uint32_t instr) { return (uint32_t)((int32_t)instr >> 20); }
+	constexpr uint32_t immS(uint32_t instr) { return (uint32_t)((int32_t)(instr & 0xFE00'0000U) >> 20) | ((instr >> 7) & 0x1F); }
+	constexpr uint32_t immB(uint32_t instr)
+	{
+		return (uint32_t)((int32_t)(instr & 0x8000'0000U) >> 19) | ((instr & 0x80) << 4) | ((instr >> 20) & 0x7E0) | ((instr >> 7) & 0x1E);
+	}
+	constexpr uint32_t immU(uint32_t instr) { return instr & 0xFFFF'F000U; }
+	constexpr uint32_t immJ(uint32_t instr)
+	{
+		return (uint32_t)((int32_t)(instr & 0x8000'0000U) >> 11) | (instr & 0x000F'F000U) | ((instr >> 9) & 0x800) | ((instr >> 20) & 0x7FE);
+	}
+
+	// An instruction is operation if the bits in mask are the bits in match
+	struct Encoding
+	{
+		CPU::Operation operation;
+		uint32_t mask;
+		uint32_t match;
+	};
+
+	// The masks of the instructions that are identified by their opcode, opcode and funct3, and all of opcode, funct3 and
+	// funct7
+	constexpr uint32_t Opcode = 0x0000'007FU;
+	constexpr uint32_t Funct3 = 0x0000'707FU;
+	constexpr uint32_t Funct7 = 0xFE00'707FU;
+	constexpr uint32_t Exact = 0xFFFF'FFFFU;
+
+	using Op = CPU::Operation;
+	constexpr std::array<Encoding, 55> Encodings = { {
+		// RV32I
+		{ Op::Lui,    Opcode, 0x0000'0037 },
+		{ Op::Auipc,  Opcode, 0x0000'0017 },
+		{ Op::Jal,    Opcode, 0x0000'006F },
+		{ Op::Jalr,   Funct3, 0x0000'0067 },
+		{ Op::Beq,    Funct3, 0x0000'0063 },
+		{ Op::Bne,    Funct3, 0x0000'1063 },
+		{ Op::Blt,    Funct3, 0x0000'4063 },
+		{ Op::Bge,    Funct3, 0x0000'5063 },
+		{ Op::BltU,   Funct3, 0x0000'6063 },
+		{ Op::BgeU,   Funct3, 0x0000'7063 },
+		{ Op::Lb,     Funct3, 0x0000'0003 },
+		{ Op::Lh,     Funct3, 0x0000'1003 },
+		{ Op::Lw,     Funct3, 0x0000'2003 },
+		{ Op::LbU,    Funct3, 0x0000'4003 },
+		{ Op::LhU,    Funct3, 0x0000'5003 },
+		{ Op::Sb,     Funct3, 0x0000'0023 },
+		{ Op::Sh,     Funct3, 0x0000'1023 },
+		{ Op::Sw,     Funct3, 0x0000'2023 },
+		{ Op::AddI,   Funct3, 0x0000'0013 },
+		{ Op::SltI,   Funct3, 0x0000'2013 },
+		{ Op::SltIU,  Funct3, 0x0000'3013 },
+		{ Op::XorI,   Funct3, 0x0000'4013 },
+		{ Op::OrI,    Funct3, 0x0000'6013 },
+		{ Op::AndI,   Funct3, 0x0000'7013 },
+		{ Op::SllI,   Funct7, 0x0000'1013 },
+		{ Op::SrlI,   Funct7, 0x0000'5013 },
+		{ Op::SraI,   Funct7, 0x4000'5013 },
+		{ Op::Add,    Funct7, 0x0000'0033 },
+		{ Op::Sub,    Funct7, 0x4000'0033 },
+		{ Op::Sll,    Funct7, 0x0000'1033 },
+		{ Op::Slt,    Funct7, 0x0000'2033 },
+		{ Op::SltU,   Funct7, 0x0000'3033 },
+		{ Op::Xor,    Funct7, 0x0000'4033 },
+		{ Op::Srl,    Funct7, 0x0000'5033 },
+		{ Op::Sra,    Funct7, 0x4000'5033 },
+		{ Op::Or,     Funct7, 0x0000'6033 },
+		{ Op::And,    Funct7, 0x0000'7033 },
+		{ Op::Fence,  Funct3, 0x0000'000F },
+		{ Op::Ecall,  Exact,  0x0000'0073 },
+		{ Op::Ebreak, Exact,  0x0010'0073 },
+		// Zicsr
+		{ Op::CsrRW,  Funct3, 0x0000'1073 },
+		{ Op::CsrRS,  Funct3, 0x0000'2073 },
+		{ Op::CsrRC,  Funct3, 0x0000'3073 },
+		{ Op::CsrRWI, Funct3, 0x0000'5073 },
+		{ Op::CsrRSI, Funct3, 0x0000'6073 },
+		{ Op::CsrRCI, Funct3, 0x0000'7073 },
+		// Machine mode
+		{ Op::Mret,   Exact,  0x3020'0073 },
+		// M
+		{ Op::Mul,    Funct7, 0x0200'0033 },
+		{ Op::MulH,   Funct7, 0x0200'1033 },
+		{ Op::MulHSU, Funct7, 0x0200'2033 },
+		{ Op::MulHU,  Funct7, 0x0200'3033 },
+		{ Op::Div,    Funct7, 0x0200'4033 },
+		{ Op::DivU,   Funct7, 0x0200'5033 },
+		{ Op::Rem,    Funct7, 0x0200'6033 },
+		{ Op::RemU,   Funct7, 0x0200'7033 },
+	} };
+
+	// The decode table is indexed by bits 2-6 of the opcode and funct3 (bits 0-1 are checked by the match). Every entry
+	// holds the encodings that can have those bits, which are then told apart by their mask and match.
+	constexpr uint32_t DecodeKeyBits = 8;
+	constexpr uint32_t MaxCandidates = 4;
+
+	constexpr uint32_t decodeKey(uint32_t instr) { return ((instr >> 2) & 0x1F) | (funct3(instr) << 5); }
+
+	struct DecodeEntry
+	{
+		uint8_t count = 0;
+		std::array<uint8_t, MaxCandidates> candidates{}; // indices into Encodings
+	};
+	typedef std::array<DecodeEntry, 1 << DecodeKeyBits> DecodeTable;
+
+	constexpr DecodeTable createDecodeTable()
+	{
+		DecodeTable table{};
+		for (uint32_t key = 0; key < table.size(); key++)
+		{
+			// The bits of an instruction with this key, and which of them the key covers
+			uint32_t bits = ((key & 0x1F) << 2) | ((key >> 5) << 12);
+			uint32_t keyMask = 0x7C | (0x7 << 12);
+			for (uint32_t index = 0; index < Encodings.size(); index++)
+			{
+				const Encoding& encoding = Encodings[index];
+				if ((bits & encoding.mask & keyMask) != (encoding.match & keyMask))
+					continue;
+
+				DecodeEntry& entry = table[key];
+				if (entry.count == MaxCandidates)
+					throw "Too many encodings with the same opcode and funct3";
+				entry.candidates[entry.count++] = (uint8_t)index;
+			}
+		}
+		return table;
+	}
+
+	constexpr DecodeTable decodeTable = createDecodeTable();
+
+	constexpr CPU::Operation decodeOperation(uint32_t instr)
+	{
+		const DecodeEntry& entry = decodeTable[decodeKey(instr)];
+		for (uint32_t i = 0; i < entry.count; i++)
+		{
+			const Encoding& encoding = Encodings[entry.candidates[i]];
+			if ((instr & encoding.mask) == encoding.match)
+				return encoding.operation;
+		}
+		return CPU::Operation::Illegal;
+	}
+
+	static_assert(decodeOperation(0x0000'0073) == Op::Ecall && decodeOperation(0x0010'0073) == Op::Ebreak, "");
+	static_assert(decodeOperation(0x4000'5013) == Op::SraI && decodeOperation(0x0200'5033) == Op::DivU, "");
+	static_assert(decodeOperation(0x0000'0000) == Op::Illegal && decodeOperation(0x0000'1073 & ~3U) == Op::Illegal, "");
+	static_assert(immB(0xFE00'0EE3) == 0xFFFF'FFFC && immJ(0xFFDF'F06F) == 0xFFFF'FFFC, "");
+	static_assert(immS(0xFE11'2E23) == 0xFFFF'FFFC && immI(0xFFC1'0113) == 0xFFFF'FFFC, "");
+}
@@ -0,0 +1,615 @@
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include "JIT.h"
+#include "Fastmem.h"
+#include "../MemoryMap.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_X86_64
+#endif
+
+static_assert(MemoryMap::RAM.BaseAddr <= MemoryMap::Text.BaseAddr && MemoryMap::Text.LimitAddr <= MemoryMap::RAM.LimitAddr,
+	"the JIT expects the Text range to be part of RAM");
+
+namespace
+{
+	enum HostReg : uint8_t
+	{
+		RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15
+	};
+
+	enum Condition : uint8_t
+	{
+		CondB = 0x2, CondAE = 0x3, CondE = 0x4, CondNE = 0x5, CondBE = 0x6, CondA = 0x7, CondL = 0xC, CondGE = 0xD
+	};
+
+	// The opcode of the 'op r/m32, r32' form and the /digit of the 'op r/m32, imm32' form
+	struct AluOp
+	{
+		uint8_t opcode;
+		uint8_t ext;
+	};
+	constexpr AluOp Add = { 0x01, 0 }, Or = { 0x09, 1 }, And = { 0x21, 4 }, Sub = { 0x29, 5 }, Xor = { 0x31, 6 }, Cmp = { 0x39, 7 };
+
+	// The /digit of the shift instructions
+	constexpr uint8_t Shl = 4, Shr = 5, Sar = 7;
+
+	// rax, rcx and rdx are used as scratch registers, these two hold the pointers passed to the block
+	constexpr HostReg RegsBase = R15; // CPU::regs
+	constexpr HostReg RamBase = R14; // the host memory backing the start of RAM
+	// The host registers guest registers can be cached in
+	constexpr std::array<HostReg, 10> AllocatableRegs = { RBX, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13 };
+	// The registers that have to be preserved in either the System V or the Windows calling convention
+	constexpr std::array<HostReg, 8> SavedRegs = { RBX, RBP, RSI, RDI, R12, R13, R14, R15 };
+
+	// Emits x86-64 instructions, all operations work on 32-bit registers unless their name ends in 64
+	class Emitter
+	{
+	public:
+		std::vector<uint8_t> code;
+
+	public:
+		void byte(uint8_t b) { code.push_back(b); }
+		void imm32(uint32_t v) { for (int i = 0; i < 4; i++) byte((v >> (8 * i)) & 0xFF); }
+		void imm64(uint64_t v) { for (int i = 0; i < 8; i++) byte((v >> (8 * i)) & 0xFF); }
+
+		void rex(bool w, uint8_t reg, uint8_t index, uint8_t base)
+		{
+			uint8_t prefix = 0x40 | (w ? 0b1000 : 0) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+			if (prefix != 0x40)
+				byte(prefix);
+		}
+		void modrm(uint8_t mod, uint8_t reg, uint8_t rm) { byte((mod << 6) | ((reg & 7) << 3) | (rm & 7)); }
+
+	public:
+		// register and immediate operands
+		void mov(HostReg dst, HostReg src) { rex(false, src, 0, dst); byte(0x89); modrm(3, src, dst); }
+		void mov(HostReg dst, uint32_t imm) { rex(false, 0, 0, dst); byte(0xB8 + (dst & 7)); imm32(imm); }
+		void alu(AluOp op, HostReg dst, HostReg src) { rex(false, src, 0, dst); byte(op.opcode); modrm(3, src, dst); }
+		void alu(AluOp op, HostReg dst, uint32_t imm) { rex(false, 0, 0, dst); byte(0x81); modrm(3, op.ext, dst); imm32(imm); }
+		void test(HostReg dst, uint32_t imm) { rex(false, 0, 0, dst); byte(0xF7); modrm(3, 0, dst); imm32(imm); }
+		void shift(uint8_t ext, HostReg dst, uint8_t amount) { rex(false, 0, 0, dst); byte(0xC1); modrm(3, ext, dst); byte(amount); }
+		void shiftCl(uint8_t ext, HostReg dst) { rex(false, 0, 0, dst); byte(0xD3); modrm(3, ext, dst); }
+		void imul(HostReg dst, HostReg src) { rex(false, dst, 0, src); byte(0x0F); byte(0xAF); modrm(3, dst, src); }
+		void cdq() { byte(0x99); }
+		// divides edx:eax by src
+		void div(HostReg src, bool isSigned) { rex(false, 0, 0, src); byte(0xF7); modrm(3, isSigned ? 7 : 6, src); }
+		// sets eax to 1 if the condition holds, 0 otherwise
+		void setEax(Condition condition)
+		{
+			byte(0x0F); byte(0x90 + condition); modrm(3, 0, RAX); // setcc al
+			byte(0x0F); byte(0xB6); modrm(3, RAX, RAX); // movzx eax, al
+		}
+
+		void mov64(HostReg dst, HostReg src) { rex(true, src, 0, dst); byte(0x89); modrm(3, src, dst); }
+		void mov64(HostReg dst, uint64_t imm) { rex(true, 0, 0, dst); byte(0xB8 + (dst & 7)); imm64(imm); }
+		void or64(HostReg dst, HostReg src) { rex(true, src, 0, dst); byte(0x09); modrm(3, src, dst); }
+		void imul64(HostReg dst, HostReg src) { rex(true, dst, 0, src); byte(0x0F); byte(0xAF); modrm(3, dst, src); }
+		void movsxd64(HostReg dst, HostReg src) { rex(true, dst, 0, src); byte(0x63); modrm(3, dst, src); }
+		void shr64(HostReg dst, uint8_t amount) { rex(true, 0, 0, dst); byte(0xC1); modrm(3, Shr, dst); byte(amount); }
+
+		void push(HostReg reg) { rex(false, 0, 0, reg); byte(0x50 + (reg & 7)); }
+		void pop(HostReg reg) { rex(false, 0, 0, reg); byte(0x58 + (reg & 7)); }
+		void ret() { byte(0xC3); }
+
+	public:
+		// [base + disp32] operands
+		void load(HostReg dst, HostReg base, int32_t disp) { rex(false, dst, 0, base); byte(0x8B); memOperand(dst, base, disp); }
+		void store(HostReg base, int32_t disp, HostReg src) { rex(false, src, 0, base); byte(0x89); memOperand(src, base, disp); }
+
+		// [RamBase + rax] operands
+		void loadRam(HostReg dst, DataSize dataSize, bool isSigned)
+		{
+			rex(false, dst, RAX, RamBase);
+			switch (dataSize)
+			{
+			case DataSize::Word:
+				byte(0x8B);
+				break;
+			case DataSize::HalfWord:
+				byte(0x0F); byte(isSigned ? 0xBF : 0xB7);
+				break;
+			case DataSize::Byte:
+			default:
+				byte(0x0F); byte(isSigned ? 0xBE : 0xB6);
+				break;
+			}
+			ramOperand(dst);
+		}
+
+		void storeRam(HostReg src, DataSize dataSize)
+		{
+			if (dataSize == DataSize::HalfWord)
+				byte(0x66);
+			rex(false, src, RAX, RamBase);
+			byte(dataSize == DataSize::Byte ? 0x88 : 0x89);
+			ramOperand(src);
+		}
+
+	public:
+		// Jumps return the position right after them, which is passed to patch once the target is known
+		size_t jcc(Condition condition) { byte(0x0F); byte(0x80 + condition); imm32(0); return code.size(); }
+		size_t jmp() { byte(0xE9); imm32(0); return code.size(); }
+		// The Fastmem marker (nopl disp32(%rax)) in front of an access that can fault, it is patched like a jump
+		size_t faultMarker() { byte(0x0F); byte(0x1F); byte(0x80); imm32(0); return code.size(); }
+		void patch(size_t jump, size_t target)
+		{
+			int32_t rel = (int32_t)(target - jump);
+			std::memcpy(&code[jump - 4], &rel, 4);
+		}
+
+	private:
+		void memOperand(HostReg reg, HostReg base, int32_t disp)
+		{
+			modrm(2, reg, base);
+			if ((base & 7) == RSP)
+				byte(0x24); // SIB without index
+			imm32(disp);
+		}
+
+		void ramOperand(HostReg reg)
+		{
+			modrm(0, reg, 0b100); // SIB follows
+			byte(((RAX & 7) << 3) | (RamBase & 7));
+		}
+	};
+
+	uint32_t getAccessSize(DataSize dataSize)
+	{
+		switch (dataSize)
+		{
+		case DataSize::Word:
+			return 4;
+		case DataSize::HalfWord:
+			return 2;
+		case DataSize::Byte:
+		default:
+			return 1;
+		}
+	}
+}
+
+JIT::JIT(uint32_t ramBaseAddr, uint32_t ramSize, Fastmem* fastmem)
+	: ramBaseAddr(ramBaseAddr), ramSize(ramSize), fastmem(fastmem)
+{
+#if defined(JIT_X86_64)
+#if defined(_WIN32)
+	codeCache = (uint8_t*)VirtualAlloc(nullptr, CodeCacheSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	void* memory = mmap(nullptr, CodeCacheSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	codeCache = (memory == MAP_FAILED) ? nullptr : (uint8_t*)memory;
+#endif
+#endif
+
+	if (codeCache != nullptr && fastmem != nullptr)
+		fastmem->registerCode(codeCache, codeCache + CodeCacheSize);
+	if (codeCache != nullptr)
+		compileThread = std::thread(&JIT::compileLoop, this);
+}
+
+JIT::~JIT()
+{
+	if (codeCache == nullptr)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	queueChanged.notify_one();
+	compileThread.join();
+
+	if (fastmem != nullptr)
+		fastmem->unregisterCode(codeCache);
+#if defined(_WIN32)
+	VirtualFree(codeCache, 0, MEM_RELEASE);
+#else
+	munmap(codeCache, CodeCacheSize);
+#endif
+}
+
+bool JIT::isAvailable()
+{
+	return codeCache != nullptr;
+}
+
+bool JIT::isFull()
+{
+	return full;
+}
+
+void JIT::queue(CPU::BasicBlock* block)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		compileQueue.push_back(block);
+	}
+	queueChanged.notify_one();
+}
+
+void JIT::flush()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	compileQueue.clear();
+	compileDone.wait(lock, [this] { return !compiling; });
+
+	// Nothing runs the old code anymore, so it can be written again
+	if (codeCacheSealed > 0)
+	{
+#if defined(_WIN32)
+		DWORD oldProtect;
+		VirtualProtect(codeCache, codeCacheSealed, PAGE_READWRITE, &oldProtect);
+#else
+		mprotect(codeCache, codeCacheSealed, PROT_READ | PROT_WRITE);
+#endif
+	}
+	codeCacheUsed = 0;
+	codeCacheSealed = 0;
+	full = false;
+}
+
+void JIT::compileLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		queueChanged.wait(lock, [this] { return stopping || !compileQueue.empty(); });
+		if (stopping)
+			return;
+
+		// Everything that is queued is translated before any of it is published, so the blocks that are queued together
+		// share their pages
+		std::vector<CPU::BasicBlock*> blocks(compileQueue.begin(), compileQueue.end());
+		compileQueue.clear();
+		compiling = true;
+		lock.unlock();
+
+		std::vector<CPU::NativeBlock> natives(blocks.size());
+		std::vector<uint32_t> nativeLengths(blocks.size());
+		for (size_t i = 0; i < blocks.size(); i++)
+			natives[i] = translate(*blocks[i], nativeLengths[i]);
+
+		if (sealCode())
+		{
+			for (size_t i = 0; i < blocks.size(); i++)
+			{
+				if (natives[i] == nullptr)
+					continue;
+				blocks[i]->nativeLength = nativeLengths[i];
+				blocks[i]->native.store(natives[i], std::memory_order_release);
+			}
+		}
+
+		lock.lock();
+		compiling = false;
+		compileDone.notify_all();
+	}
+}
+
+bool JIT::isTranslatable(const CPU::DecodedInstruction& op, uint32_t pc)
+{
+	switch (op.operation)
+	{
+	case CPU::Operation::CsrRW: case CPU::Operation::CsrRS: case CPU::Operation::CsrRC:
+	case CPU::Operation::CsrRWI: case CPU::Operation::CsrRSI: case CPU::Operation::CsrRCI:
+	case CPU::Operation::Ebreak: case CPU::Operation::Ecall: case CPU::Operation::Mret:
+	case CPU::Operation::Illegal:
+		return false;
+	case CPU::Operation::Beq: case CPU::Operation::Bne: case CPU::Operation::Blt:
+	case CPU::Operation::Bge: case CPU::Operation::BltU: case CPU::Operation::BgeU:
+	case CPU::Operation::Jal:
+		// A misaligned target is an exception, leave it to the interpreter
+		return ((pc + op.imm) & 3) == 0;
+	default:
+		return true;
+	}
+}
+
+CPU::NativeBlock JIT::translate(const CPU::BasicBlock& block, uint32_t& nativeLength)
+{
+#if !defined(JIT_X86_64)
+	return nullptr;
+#else
+	if (codeCache == nullptr || full)
+		return nullptr;
+
+	uint32_t length = 0;
+	while (length < block.ops.size() && isTranslatable(block.ops[length], block.startPc + 4 * length))
+		length++;
+	if (length == 0)
+		return nullptr;
+
+	// Cache the most used guest registers in host registers. Operands that an instruction doesn't use are always 0, which
+	// is never cached, so all operand fields can be counted.
+	std::array<uint32_t, 32> uses = {};
+	std::array<bool, 32> written = {};
+	for (uint32_t i = 0; i < length; i++)
+	{
+		const CPU::MicroOp& op = block.ops[i];
+		uses[op.rd]++; uses[op.rs1]++; uses[op.rs2]++;
+		written[op.rd] = true;
+	}
+
+	std::array<uint32_t, 31> byUse;
+	for (uint32_t i = 0; i < byUse.size(); i++)
+		byUse[i] = i + 1;
+	std::stable_sort(byUse.begin(), byUse.end(), [&uses](uint32_t a, uint32_t b) { return uses[a] > uses[b]; });
+
+	std::array<int, 32> hostRegs;
+	hostRegs.fill(-1);
+	for (uint32_t i = 0; i < AllocatableRegs.size() && uses[byUse[i]] > 0; i++)
+		hostRegs[byUse[i]] = AllocatableRegs[i];
+
+	Emitter e;
+	auto readGuest = [&](HostReg dst, uint32_t reg) {
+		if (reg == 0)
+			e.alu(Xor, dst, dst);
+		else if (hostRegs[reg] >= 0)
+			e.mov(dst, (HostReg)hostRegs[reg]);
+		else
+			e.load(dst, RegsBase, 4 * reg);
+	};
+	auto writeGuest = [&](uint32_t reg, HostReg src) {
+		if (reg == 0)
+			return;
+		else if (hostRegs[reg] >= 0)
+			e.mov((HostReg)hostRegs[reg], src);
+		else
+			e.store(RegsBase, 4 * reg, src);
+	};
+
+	// The block returns the next pc in the low 32 bits and the amount of executed instructions in the high 32 bits
+	auto exitValue = [](uint32_t executed, uint32_t nextPc) { return ((uint64_t)executed << 32) | nextPc; };
+	std::vector<size_t> epilogueJumps;
+	auto exitTo = [&](uint64_t value) {
+		e.mov64(RAX, value);
+		epilogueJumps.push_back(e.jmp());
+	};
+	// Side exits leave the block right before instruction index, so it can be executed by the interpreter
+	struct SideExit
+	{
+		size_t jump;
+		uint32_t index;
+	};
+	std::vector<SideExit> sideExits;
+	auto sideExit = [&](Condition condition, uint32_t index) { sideExits.push_back({ e.jcc(condition), index }); };
+
+	// Prologue
+	for (HostReg reg : SavedRegs)
+		e.push(reg);
+#if defined(_WIN32)
+	e.mov64(RegsBase, RCX);
+	e.mov64(RamBase, RDX);
+#else
+	e.mov64(RegsBase, RDI);
+	e.mov64(RamBase, RSI);
+#endif
+	for (uint32_t reg = 1; reg < 32; reg++)
+		if (hostRegs[reg] >= 0)
+			e.load((HostReg)hostRegs[reg], RegsBase, 4 * reg);
+
+	bool endsWithJump = false;
+	for (uint32_t i = 0; i < length; i++)
+	{
+		const CPU::MicroOp& op = block.ops[i];
+		uint32_t pc = block.startPc + 4 * i;
+
+		switch (op.operation)
+		{
+		// Immediate
+		case CPU::Operation::AddI: readGuest(RAX, op.rs1); e.alu(Add, RAX, op.imm); writeGuest(op.rd, RAX); break;
+		case CPU::Operation::SltI: readGuest(RAX, op.rs1); e.alu(Cmp, RAX, op.imm); e.setEax(CondL); writeGuest(op.rd, RAX); break;
+		case CPU::Operation::SltIU: readGuest(RAX, op.rs1); e.alu(Cmp, RAX, op.imm); e.setEax(CondB); writeGuest(op.rd, RAX); break;
+		case CPU::Operation::XorI: readGuest(RAX, op.rs1); e.alu(Xor, RAX, op.imm); writeGuest(op.rd, RAX); break;
+		case CPU::Operation::OrI: readGuest(RAX, op.rs1); e.alu(Or, RAX, op.imm); writeGuest(op.rd, RAX); break;
+		case CPU::Operation::AndI: readGuest(RAX, op.rs1); e.alu(And, RAX, op.imm); writeGuest(op.rd, RAX); break;
+		case CPU::Operation::SllI: readGuest(RAX, op.rs1); e.shift(Shl, RAX, op.imm & 0x1F); writeGuest(op.rd, RAX); break;
+		case CPU::Operation::SrlI: readGuest(RAX, op.rs1); e.shift(Shr, RAX, op.imm & 0x1F); writeGuest(op.rd, RAX); break;
+		case CPU::Operation::SraI: readGuest(RAX, op.rs1); e.shift(Sar, RAX, op.imm & 0x1F); writeGuest(op.rd, RAX); break;
+
+		// Register
+		case CPU::Operation::Add: case CPU::Operation::Sub: case CPU::Operation::Xor: case CPU::Operation::Or: case CPU::Operation::And:
+		{
+			AluOp aluOp = op.operation == CPU::Operation::Add ? Add : op.operation == CPU::Operation::Sub ? Sub :
+				op.operation == CPU::Operation::Xor ? Xor : op.operation == CPU::Operation::Or ? Or : And;
+			readGuest(RAX, op.rs1); readGuest(RCX, op.rs2); e.alu(aluOp, RAX, RCX); writeGuest(op.rd, RAX);
+			break;
+		}
+		case CPU::Operation::Sll: case CPU::Operation::Srl: case CPU::Operation::Sra:
+		{
+			// x86 masks the shift amount in cl to 5 bits, just like RISC-V
+			uint8_t ext = op.operation == CPU::Operation::Sll ? Shl : op.operation == CPU::Operation::Srl ? Shr : Sar;
+			readGuest(RAX, op.rs1); readGuest(RCX, op.rs2); e.shiftCl(ext, RAX); writeGuest(op.rd, RAX);
+			break;
+		}
+		case CPU::Operation::Slt: readGuest(RAX, op.rs1); readGuest(RCX, op.rs2); e.alu(Cmp, RAX, RCX); e.setEax(CondL); writeGuest(op.rd, RAX); break;
+		case CPU::Operation::SltU: readGuest(RAX, op.rs1); readGuest(RCX, op.rs2); e.alu(Cmp, RAX, RCX); e.setEax(CondB); writeGuest(op.rd, RAX); break;
+		case CPU::Operation::Mul: readGuest(RAX, op.rs1); readGuest(RCX, op.rs2); e.imul(RAX, RCX); writeGuest(op.rd, RAX); break;
+		case CPU::Operation::MulH: case CPU::Operation::MulHSU: case CPU::Operation::MulHU:
+			// 32-bit moves zero the upper half, so the operands only have to be sign-extended when they are signed
+			readGuest(RAX, op.rs1); readGuest(RCX, op.rs2);
+			if (op.operation != CPU::Operation::MulHU)
+				e.movsxd64(RAX, RAX);
+			if (op.operation == CPU::Operation::MulH)
+				e.movsxd64(RCX, RCX);
+			e.imul64(RAX, RCX); e.shr64(RAX, 32); writeGuest(op.rd, RAX);
+			break;
+		case CPU::Operation::Div: case CPU::Operation::Rem: case CPU::Operation::DivU: case CPU::Operation::RemU:
+		{
+			// Division by 0 (and by -1, which can overflow) is left to the interpreter
+			bool isSigned = op.operation == CPU::Operation::Div || op.operation == CPU::Operation::Rem;
+			readGuest(RAX, op.rs1); readGuest(RCX, op.rs2);
+			e.alu(Cmp, RCX, 0); sideExit(CondE, i);
+			if (isSigned)
+			{
+				e.alu(Cmp, RCX, 0xFFFF'FFFFU); sideExit(CondE, i);
+				e.cdq();
+			}
+			else
+				e.alu(Xor, RDX, RDX);
+			e.div(RCX, isSigned);
+			writeGuest(op.rd, (op.operation == CPU::Operation::Div || op.operation == CPU::Operation::DivU) ? RAX : RDX);
+			break;
+		}
+
+		// Load and store
+		case CPU::Operation::Lb: case CPU::Operation::Lh: case CPU::Operation::Lw: case CPU::Operation::LbU: case CPU::Operation::LhU:
+		case CPU::Operation::Sb: case CPU::Operation::Sh: case CPU::Operation::Sw:
+		{
+			bool isStore = op.operation == CPU::Operation::Sb || op.operation == CPU::Operation::Sh || op.operation == CPU::Operation::Sw;
+			bool isSigned = op.operation == CPU::Operation::Lb || op.operation == CPU::Operation::Lh;
+			DataSize dataSize = (op.operation == CPU::Operation::Lw || op.operation == CPU::Operation::Sw) ? DataSize::Word :
+				(op.operation == CPU::Operation::Lh || op.operation == CPU::Operation::LhU || op.operation == CPU::Operation::Sh) ? DataSize::HalfWord :
+				DataSize::Byte;
+			uint32_t size = getAccessSize(dataSize);
+
+			// Accesses outside RAM and misaligned accesses are left to the interpreter. With fastmem an access outside
+			// RAM faults instead, and the fault handler continues at the side exit.
+			readGuest(RAX, op.rs1);
+			e.alu(Add, RAX, op.imm);
+			if (ramBaseAddr != 0)
+				e.alu(Sub, RAX, ramBaseAddr);
+			if (fastmem == nullptr)
+			{
+				e.alu(Cmp, RAX, ramSize - size); sideExit(CondA, i);
+			}
+			if (size > 1)
+			{
+				e.test(RAX, size - 1); sideExit(CondNE, i);
+			}
+
+			if (isStore)
+			{
+				// Stores to the Text range go through the interpreter, so any cached code is invalidated
+				e.mov(RDX, RAX);
+				e.alu(Sub, RDX, MemoryMap::Text.BaseAddr - ramBaseAddr);
+				e.alu(Cmp, RDX, MemoryMap::Text.LimitAddr - MemoryMap::Text.BaseAddr); sideExit(CondBE, i);
+				readGuest(RCX, op.rs2);
+				if (fastmem != nullptr)
+					sideExits.push_back({ e.faultMarker(), i });
+				e.storeRam(RCX, dataSize);
+			}
+			else
+			{
+				if (fastmem != nullptr)
+					sideExits.push_back({ e.faultMarker(), i });
+				e.loadRam(RAX, dataSize, isSigned);
+				writeGuest(op.rd, RAX);
+			}
+			break;
+		}
+
+		// Lui and Auipc
+		case CPU::Operation::Lui: e.mov(RAX, op.imm); writeGuest(op.rd, RAX); break;
+		case CPU::Operation::Auipc: e.mov(RAX, pc + op.imm); writeGuest(op.rd, RAX); break;
+
+		// Branch
+		case CPU::Operation::Beq: case CPU::Operation::Bne: case CPU::Operation::Blt:
+		case CPU::Operation::Bge: case CPU::Operation::BltU: case CPU::Operation::BgeU:
+		{
+			Condition condition = op.operation == CPU::Operation::Beq ? CondE : op.operation == CPU::Operation::Bne ? CondNE :
+				op.operation == CPU::Operation::Blt ? CondL : op.operation == CPU::Operation::Bge ? CondGE :
+				op.operation == CPU::Operation::BltU ? CondB : CondAE;
+			readGuest(RAX, op.rs1); readGuest(RCX, op.rs2); e.alu(Cmp, RAX, RCX);
+			size_t taken = e.jcc(condition);
+			exitTo(exitValue(i + 1, pc + 4));
+			e.patch(taken, e.code.size());
+			exitTo(exitValue(i + 1, pc + op.imm));
+			endsWithJump = true;
+			break;
+		}
+
+		// Jal and Jalr
+		case CPU::Operation::Jal:
+			e.mov(RAX, pc + 4); writeGuest(op.rd, RAX);
+			exitTo(exitValue(i + 1, pc + op.imm));
+			endsWithJump = true;
+			break;
+		case CPU::Operation::Jalr:
+			// CPU::Jalr writes rd before reading rs1, so when they are the same register the target is relative to pc + 4
+			if (op.rd == op.rs1 && op.rd != 0)
+				e.mov(RCX, pc + 4);
+			else
+				readGuest(RCX, op.rs1);
+			e.alu(Add, RCX, op.imm);
+			e.alu(And, RCX, 0xFFFF'FFFEU);
+			e.test(RCX, 3); sideExit(CondNE, i);
+			e.mov(RAX, pc + 4); writeGuest(op.rd, RAX);
+			e.mov(RAX, RCX);
+			e.mov64(RDX, exitValue(i + 1, 0));
+			e.or64(RAX, RDX);
+			epilogueJumps.push_back(e.jmp());
+			endsWithJump = true;
+			break;
+
+		// Fence and Nop
+		case CPU::Operation::Fence:
+		case CPU::Operation::Nop:
+		default:
+			break;
+		}
+	}
+
+	if (!endsWithJump)
+		exitTo(exitValue(length, block.startPc + 4 * length));
+
+	for (const SideExit& sideExit : sideExits)
+	{
+		e.patch(sideExit.jump, e.code.size());
+		exitTo(exitValue(sideExit.index, block.startPc + 4 * sideExit.index));
+	}
+
+	// Epilogue, rax holds the return value
+	for (size_t jump : epilogueJumps)
+		e.patch(jump, e.code.size());
+	for (uint32_t reg = 1; reg < 32; reg++)
+		if (hostRegs[reg] >= 0 && written[reg])
+			e.store(RegsBase, 4 * reg, (HostReg)hostRegs[reg]);
+	for (auto it = SavedRegs.rbegin(); it != SavedRegs.rend(); it++)
+		e.pop(*it);
+	e.ret();
+
+	if (codeCacheUsed + e.code.size() > CodeCacheSize)
+	{
+		full = true;
+		return nullptr;
+	}
+
+	uint8_t* code = codeCache + codeCacheUsed;
+	std::memcpy(code, e.code.data(), e.code.size());
+	codeCacheUsed += (e.code.size() + 15) & ~(size_t)15;
+
+	nativeLength = length;
+	return (CPU::NativeBlock)code;
+#endif
+}
+
+bool JIT::sealCode()
+{
+	size_t end = (codeCacheUsed + CodePageSize - 1) & ~(CodePageSize - 1);
+	bool sealed = true;
+	if (end > codeCacheSealed)
+	{
+#if defined(_WIN32)
+		DWORD oldProtect;
+		sealed = VirtualProtect(codeCache + codeCacheSealed, end - codeCacheSealed, PAGE_EXECUTE_READ, &oldProtect) != 0;
+		FlushInstructionCache(GetCurrentProcess(), codeCache + codeCacheSealed, end - codeCacheSealed);
+#else
+		sealed = mprotect(codeCache + codeCacheSealed, end - codeCacheSealed, PROT_READ | PROT_EXEC) == 0;
+#endif
+	}
+	codeCacheUsed = end;
+	codeCacheSealed = end;
+	return sealed;
+}
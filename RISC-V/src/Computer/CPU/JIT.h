@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "CPU.h"
+
+class Fastmem;
+
+// Translates basic blocks into native x86-64 code. Only the instructions that can run without the rest of the computer are
+// translated: CSR and other SYSTEM instructions are left to the interpreter, and memory accesses are only done natively
+// when they hit RAM (and, for stores, not the Text range). Everything else leaves the native code right before the
+// instruction, so the interpreter can execute it and take any exceptions.
+// Blocks are translated on a compile thread, so translating never stalls the emulation: queued blocks keep being
+// interpreted until their native code is published in BasicBlock::native. The code cache is never writable and
+// executable at once: code is written to writable pages, which are made executable right before it is published.
+class JIT
+{
+public:
+	// ramBaseAddr and ramSize describe the guest addresses that are backed by the host memory passed to every NativeBlock.
+	// With fastmem that memory is RAM in fastmem's window: accesses aren't checked against ramSize, the ones outside RAM
+	// fault and continue at their side exit.
+	JIT(uint32_t ramBaseAddr, uint32_t ramSize, Fastmem* fastmem = nullptr);
+	~JIT();
+
+public:
+	// Returns false if the host isn't x86-64 or no executable memory could be allocated
+	bool isAvailable();
+	// Returns true once a translation didn't fit in the code cache anymore, until flush() is called
+	bool isFull();
+
+	// Queues block to be translated on the compile thread. The block must stay alive until it is published or flush()
+	// is called.
+	void queue(CPU::BasicBlock* block);
+
+	// Drops all queued blocks, waits for the block that is being translated and throws away all translated code. Every
+	// NativeBlock that was returned or published becomes invalid.
+	void flush();
+
+	// Whether an instruction at pc can be executed natively, the rest is left to the interpreter. This is shared with the
+	// AOT translator so both produce blocks with the same exits.
+	static bool isTranslatable(const CPU::DecodedInstruction& op, uint32_t pc);
+
+private:
+	void compileLoop();
+	// Translates the first instructions of block into writable memory, sets nativeLength to the amount of translated
+	// instructions. Returns nullptr if nothing could be translated or the code cache is full.
+	CPU::NativeBlock translate(const CPU::BasicBlock& block, uint32_t& nativeLength);
+	// Makes the code written since the last call executable. The rest of its last page is skipped, so published code
+	// is never written to again until flush().
+	bool sealCode();
+
+private:
+	uint32_t ramBaseAddr;
+	uint32_t ramSize;
+	Fastmem* fastmem;
+
+	uint8_t* codeCache = nullptr;
+	// Only used by the compile thread, or by flush() while the compile thread is idle
+	size_t codeCacheUsed = 0;
+	size_t codeCacheSealed = 0; // the code before this is executable, the rest is writable
+	std::atomic<bool> full{ false };
+
+	std::mutex mutex;
+	std::condition_variable queueChanged;
+	std::condition_variable compileDone;
+	std::deque<CPU::BasicBlock*> compileQueue;
+	bool compiling = false; // set while the compile thread is translating a block outside of the mutex
+	bool stopping = false;
+	std::thread compileThread;
+	static constexpr size_t CodeCacheSize = 16 * 1024 * 1024;
+	static constexpr size_t CodePageSize = 4096;
+};
@@ -0,0 +1,388 @@
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include "LockstepCPU.h"
+#include "../HostMemory.h"
+
+LockstepCPU::LockstepCPU()
+{
+	// Untouched pages of a lane's RAM aren't allocated by the host
+	for (uint8_t*& laneMemory : memory)
+	{
+		laneMemory = HostMemory::allocate(RamSize);
+		if (laneMemory == nullptr)
+			throw "Out of memory";
+	}
+
+	reset();
+}
+
+LockstepCPU::~LockstepCPU()
+{
+	images = {};
+	for (uint8_t* laneMemory : memory)
+		HostMemory::free(laneMemory, RamSize);
+}
+
+void LockstepCPU::fillFromFile(const char* fileName, uint32_t startAddr)
+{
+	std::ifstream file(fileName, std::ios::in | std::ios::binary);
+	std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	load(startAddr, data.data(), data.size());
+}
+
+void LockstepCPU::load(uint32_t addr, const uint8_t* data, size_t size)
+{
+	if (addr < MemoryMap::RAM.BaseAddr || MemoryMap::RAM.LimitAddr < addr)
+		return;
+	size = std::min<size_t>(size, (size_t)MemoryMap::RAM.LimitAddr - addr + 1);
+
+	for (uint8_t* laneMemory : memory)
+		std::memcpy(laneMemory + (addr - MemoryMap::RAM.BaseAddr), data, size);
+
+	// Decode every word of the Text range that was (partly) loaded
+	uint64_t first = std::max<uint64_t>(addr & ~3U, MemoryMap::Text.BaseAddr);
+	uint64_t end = std::min<uint64_t>((uint64_t)addr + size, (uint64_t)MemoryMap::Text.LimitAddr + 1);
+	for (uint64_t instrAddr = first; instrAddr < end; instrAddr += 4)
+	{
+		size_t index = (size_t)(instrAddr - MemoryMap::Text.BaseAddr) / 4;
+		if (index >= text.size())
+			text.resize(index + 1);
+
+		uint32_t instr;
+		std::memcpy(&instr, memory[0] + (instrAddr - MemoryMap::RAM.BaseAddr), 4);
+		text[index] = CPU::decode(instr);
+	}
+}
+
+bool LockstepCPU::fillLaneFromFile(uint32_t lane, const char* fileName, uint32_t startAddr)
+{
+	std::ifstream file(fileName, std::ios::in | std::ios::binary);
+	if (!file.is_open() || lane >= LaneCount || startAddr < MemoryMap::RAM.BaseAddr || MemoryMap::RAM.LimitAddr < startAddr)
+		return false;
+
+	file.read((char*)memory[lane] + (startAddr - MemoryMap::RAM.BaseAddr), (std::streamsize)MemoryMap::RAM.LimitAddr - startAddr + 1);
+	return true;
+}
+
+uint8_t* LockstepCPU::getLaneMemory(uint32_t lane)
+{
+	return memory[lane];
+}
+
+void LockstepCPU::freeze()
+{
+	for (uint32_t lane = 0; lane < LaneCount; lane++)
+	{
+		images[lane].reset();
+		images[lane] = std::make_unique<MemoryImage>(memory[lane], RamSize);
+	}
+}
+
+void LockstepCPU::reset(uint32_t pc)
+{
+	for (std::unique_ptr<MemoryImage>& image : images)
+		if (image)
+			image->restore();
+
+	std::memset(regs, 0, sizeof(regs));
+	for (uint32_t lane = 0; lane < LaneCount; lane++)
+	{
+		pcs[lane] = pc;
+		running[lane] = 0xFFFF'FFFF;
+	}
+	instret.fill(0);
+	stopReason.fill(CPU::ExceptionType::NoException);
+	stopValue.fill(0);
+}
+
+uint64_t LockstepCPU::run(uint64_t maxSteps)
+{
+	uint64_t steps = 0;
+	for (; steps < maxSteps && isAnyRunning(); steps++)
+	{
+		// The lanes at the lowest pc go first, so lanes that were left behind by a branch catch up with the others
+		uint32_t pc = 0xFFFF'FFFF;
+		for (uint32_t lane = 0; lane < LaneCount; lane++)
+			pc = std::min(pc, pcs[lane] | ~running[lane]);
+
+		alignas(32) uint32_t mask[LaneCount];
+		for (uint32_t lane = 0; lane < LaneCount; lane++)
+			mask[lane] = running[lane] & (pcs[lane] == pc ? 0xFFFF'FFFF : 0);
+
+		size_t index = (size_t)(pc - MemoryMap::Text.BaseAddr) / 4;
+		if (pc < MemoryMap::Text.BaseAddr || MemoryMap::Text.LimitAddr < pc || (pc & 3) != 0 || index >= text.size())
+		{
+			for (uint32_t lane = 0; lane < LaneCount; lane++)
+				if (mask[lane])
+					stop(lane, CPU::ExceptionType::InstructionAccessFault, pc);
+			continue;
+		}
+
+		step(text[index], pc, mask);
+	}
+
+	return steps;
+}
+
+bool LockstepCPU::isRunning(uint32_t lane) const
+{
+	return running[lane] != 0;
+}
+
+bool LockstepCPU::isAnyRunning() const
+{
+	uint32_t any = 0;
+	for (uint32_t lane = 0; lane < LaneCount; lane++)
+		any |= running[lane];
+	return any != 0;
+}
+
+uint32_t LockstepCPU::readReg(uint32_t lane, uint32_t index) const
+{
+	return index == 0 ? 0 : regs[index][lane];
+}
+
+void LockstepCPU::writeReg(uint32_t lane, uint32_t index, uint32_t data)
+{
+	if (index != 0)
+		regs[index][lane] = data;
+}
+
+void LockstepCPU::step(const CPU::DecodedInstruction& op, uint32_t pc, const uint32_t* mask)
+{
+	typedef CPU::Operation Operation;
+
+	alignas(32) uint32_t imm[LaneCount];
+	for (uint32_t lane = 0; lane < LaneCount; lane++)
+		imm[lane] = op.imm;
+	const uint32_t* rs2 = regs[op.rs2];
+
+	bool isControlFlow = false;
+	switch (op.operation)
+	{
+	// Immediate
+	case Operation::AddI: apply(op, imm, mask, [](uint32_t a, uint32_t b) { return a + b; }); break;
+	case Operation::SltI: apply(op, imm, mask, [](uint32_t a, uint32_t b) { return (uint32_t)((int32_t)a < (int32_t)b); }); break;
+	case Operation::SltIU: apply(op, imm, mask, [](uint32_t a, uint32_t b) { return (uint32_t)(a < b); }); break;
+	case Operation::XorI: apply(op, imm, mask, [](uint32_t a, uint32_t b) { return a ^ b; }); break;
+	case Operation::OrI: apply(op, imm, mask, [](uint32_t a, uint32_t b) { return a | b; }); break;
+	case Operation::AndI: apply(op, imm, mask, [](uint32_t a, uint32_t b) { return a & b; }); break;
+	case Operation::SllI: apply(op, imm, mask, [](uint32_t a, uint32_t b) { return a << (b & 0x1F); }); break;
+	case Operation::SrlI: apply(op, imm, mask, [](uint32_t a, uint32_t b) { return a >> (b & 0x1F); }); break;
+	case Operation::SraI: apply(op, imm, mask, [](uint32_t a, uint32_t b) { return (uint32_t)((int32_t)a >> (b & 0x1F)); }); break;
+
+	// Register
+	case Operation::Add: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return a + b; }); break;
+	case Operation::Sub: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return a - b; }); break;
+	case Operation::Sll: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return a << (b & 0x1F); }); break;
+	case Operation::Slt: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return (uint32_t)((int32_t)a < (int32_t)b); }); break;
+	case Operation::SltU: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return (uint32_t)(a < b); }); break;
+	case Operation::Xor: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return a ^ b; }); break;
+	case Operation::Srl: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return a >> (b & 0x1F); }); break;
+	case Operation::Sra: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return (uint32_t)((int32_t)a >> (b & 0x1F)); }); break;
+	case Operation::Or: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return a | b; }); break;
+	case Operation::And: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return a & b; }); break;
+	case Operation::Mul: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return a * b; }); break;
+	case Operation::MulH: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return (uint32_t)((uint64_t)((int64_t)(int32_t)a * (int64_t)(int32_t)b) >> 32); }); break;
+	case Operation::MulHSU: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return (uint32_t)((uint64_t)((int64_t)(int32_t)a * (int64_t)(uint64_t)b) >> 32); }); break;
+	case Operation::MulHU: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return (uint32_t)(((uint64_t)a * (uint64_t)b) >> 32); }); break;
+	// Masked lanes are calculated as well, so the overflowing INT_MIN / -1 has to give the result of the specification
+	case Operation::Div:
+		apply(op, rs2, mask, [](uint32_t a, uint32_t b) {
+			return b == 0 ? 0xFFFF'FFFFU : (a == 0x8000'0000U && b == 0xFFFF'FFFFU) ? a : (uint32_t)((int32_t)a / (int32_t)b);
+		});
+		break;
+	case Operation::DivU: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return b == 0 ? 0xFFFF'FFFFU : a / b; }); break;
+	case Operation::Rem:
+		apply(op, rs2, mask, [](uint32_t a, uint32_t b) {
+			return b == 0 ? a : (a == 0x8000'0000U && b == 0xFFFF'FFFFU) ? 0 : (uint32_t)((int32_t)a % (int32_t)b);
+		});
+		break;
+	case Operation::RemU: apply(op, rs2, mask, [](uint32_t a, uint32_t b) { return b == 0 ? a : a % b; }); break;
+
+	// Load and store
+	case Operation::Lb: loadOp(op, mask, 1, true); break;
+	case Operation::Lh: loadOp(op, mask, 2, true); break;
+	case Operation::Lw: loadOp(op, mask, 4, true); break;
+	case Operation::LbU: loadOp(op, mask, 1, false); break;
+	case Operation::LhU: loadOp(op, mask, 2, false); break;
+	case Operation::Sb: storeOp(op, mask, 1); break;
+	case Operation::Sh: storeOp(op, mask, 2); break;
+	case Operation::Sw: storeOp(op, mask, 4); break;
+
+	// Upper
+	case Operation::Lui: apply(op, imm, mask, [](uint32_t, uint32_t b) { return b; }); break;
+	case Operation::Auipc:
+	{
+		uint32_t value = pc + op.imm;
+		apply(op, imm, mask, [value](uint32_t, uint32_t) { return value; });
+		break;
+	}
+
+	// Branch
+	case Operation::Beq: branch(op, pc, mask, [](uint32_t a, uint32_t b) { return a == b; }); isControlFlow = true; break;
+	case Operation::Bne: branch(op, pc, mask, [](uint32_t a, uint32_t b) { return a != b; }); isControlFlow = true; break;
+	case Operation::Blt: branch(op, pc, mask, [](uint32_t a, uint32_t b) { return (int32_t)a < (int32_t)b; }); isControlFlow = true; break;
+	case Operation::Bge: branch(op, pc, mask, [](uint32_t a, uint32_t b) { return (int32_t)a >= (int32_t)b; }); isControlFlow = true; break;
+	case Operation::BltU: branch(op, pc, mask, [](uint32_t a, uint32_t b) { return a < b; }); isControlFlow = true; break;
+	case Operation::BgeU: branch(op, pc, mask, [](uint32_t a, uint32_t b) { return a >= b; }); isControlFlow = true; break;
+
+	// Jumps write rd before the target is calculated, like CPU::Jal and CPU::Jalr
+	case Operation::Jal:
+	case Operation::Jalr:
+	{
+		uint32_t link = pc + 4;
+		apply(op, imm, mask, [link](uint32_t, uint32_t) { return link; });
+		for (uint32_t lane = 0; lane < LaneCount; lane++)
+		{
+			if (!mask[lane])
+				continue;
+			uint32_t target = op.operation == Operation::Jal ? pc + op.imm : (readReg(lane, op.rs1) + op.imm) & 0xFFFF'FFFEU;
+			if ((target & 3) != 0)
+				stop(lane, CPU::ExceptionType::InstructionAddressMisaligned, target);
+			else
+				pcs[lane] = target;
+		}
+		isControlFlow = true;
+		break;
+	}
+
+	case Operation::Fence:
+	case Operation::Nop:
+		break;
+
+	// System, there are no CSRs or traps
+	case Operation::Ecall:
+	case Operation::Ebreak:
+		for (uint32_t lane = 0; lane < LaneCount; lane++)
+			if (mask[lane])
+				stop(lane, op.operation == Operation::Ecall ? CPU::ExceptionType::MEnvironmentCall : CPU::ExceptionType::EnvironmentBreak, 0);
+		break;
+
+	default:
+		for (uint32_t lane = 0; lane < LaneCount; lane++)
+			if (mask[lane])
+				stop(lane, CPU::ExceptionType::IllegalInstruction, op.instruction);
+		break;
+	}
+
+	// Retire the instruction in the lanes that didn't stop
+	for (uint32_t lane = 0; lane < LaneCount; lane++)
+	{
+		uint32_t retired = mask[lane] & running[lane];
+		if (!isControlFlow)
+			pcs[lane] = retired ? pc + 4 : pcs[lane];
+		instret[lane] += retired & 1;
+	}
+}
+
+template <typename F>
+void LockstepCPU::apply(const CPU::DecodedInstruction& op, const uint32_t* b, const uint32_t* mask, F f)
+{
+	if (op.rd == 0)
+		return;
+
+	// All lanes are calculated and only the masked ones are written, so the loops don't branch
+	const uint32_t* a = regs[op.rs1];
+	uint32_t* d = regs[op.rd];
+	alignas(32) uint32_t result[LaneCount];
+	for (uint32_t lane = 0; lane < LaneCount; lane++)
+		result[lane] = f(a[lane], b[lane]);
+	for (uint32_t lane = 0; lane < LaneCount; lane++)
+		d[lane] = (result[lane] & mask[lane]) | (d[lane] & ~mask[lane]);
+}
+
+template <typename F>
+void LockstepCPU::branch(const CPU::DecodedInstruction& op, uint32_t pc, const uint32_t* mask, F taken)
+{
+	const uint32_t* a = regs[op.rs1];
+	const uint32_t* b = regs[op.rs2];
+	uint32_t target = pc + op.imm;
+
+	alignas(32) uint32_t isTaken[LaneCount];
+	for (uint32_t lane = 0; lane < LaneCount; lane++)
+		isTaken[lane] = mask[lane] & (taken(a[lane], b[lane]) ? 0xFFFF'FFFF : 0);
+
+	if ((target & 3) != 0)
+		for (uint32_t lane = 0; lane < LaneCount; lane++)
+			if (isTaken[lane])
+				stop(lane, CPU::ExceptionType::InstructionAddressMisaligned, target);
+
+	for (uint32_t lane = 0; lane < LaneCount; lane++)
+	{
+		uint32_t next = (target & isTaken[lane]) | ((pc + 4) & ~isTaken[lane]);
+		pcs[lane] = (next & mask[lane] & running[lane]) | (pcs[lane] & ~(mask[lane] & running[lane]));
+	}
+}
+
+void LockstepCPU::loadOp(const CPU::DecodedInstruction& op, const uint32_t* mask, uint32_t size, bool isSigned)
+{
+	// Every lane reads its own RAM, this is a gather
+	for (uint32_t lane = 0; lane < LaneCount; lane++)
+	{
+		if (!mask[lane])
+			continue;
+
+		uint32_t addr = readReg(lane, op.rs1) + op.imm;
+		if (addr < MemoryMap::RAM.BaseAddr || MemoryMap::RAM.LimitAddr - (size - 1) < addr)
+		{
+			stop(lane, CPU::ExceptionType::LoadAccessFault, addr);
+			continue;
+		}
+		if (addr % size != 0)
+		{
+			stop(lane, CPU::ExceptionType::LoadAddressMisaligned, addr);
+			continue;
+		}
+
+		const uint8_t* data = memory[lane] + (addr - MemoryMap::RAM.BaseAddr);
+		uint32_t value;
+		if (size == 4)
+			std::memcpy(&value, data, 4);
+		else if (size == 2)
+		{
+			uint16_t value16;
+			std::memcpy(&value16, data, 2);
+			value = isSigned ? (uint32_t)(int32_t)(int16_t)value16 : value16;
+		}
+		else
+			value = isSigned ? (uint32_t)(int32_t)(int8_t)data[0] : data[0];
+		writeReg(lane, op.rd, value);
+	}
+}
+
+void LockstepCPU::storeOp(const CPU::DecodedInstruction& op, const uint32_t* mask, uint32_t size)
+{
+	for (uint32_t lane = 0; lane < LaneCount; lane++)
+	{
+		if (!mask[lane])
+			continue;
+
+		// The code is shared by all lanes, so it can't be written
+		uint32_t addr = readReg(lane, op.rs1) + op.imm;
+		bool isText = MemoryMap::Text.BaseAddr <= addr + (size - 1) && addr <= MemoryMap::Text.LimitAddr;
+		if (addr < MemoryMap::RAM.BaseAddr || MemoryMap::RAM.LimitAddr - (size - 1) < addr || isText)
+		{
+			stop(lane, CPU::ExceptionType::StoreAccessFault, addr);
+			continue;
+		}
+		if (addr % size != 0)
+		{
+			stop(lane, CPU::ExceptionType::StoreAddressMisaligned, addr);
+			continue;
+		}
+
+		uint32_t value = readReg(lane, op.rs2);
+		std::memcpy(memory[lane] + (addr - MemoryMap::RAM.BaseAddr), &value, size);
+	}
+}
+
+void LockstepCPU::stop(uint32_t lane, CPU::ExceptionType reason, uint32_t value)
+{
+	// pc is left at the instruction that stopped the lane
+	running[lane] = 0;
+	stopReason[lane] = reason;
+	stopValue[lane] = value;
+}
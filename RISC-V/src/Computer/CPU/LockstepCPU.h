@@ -0,0 +1,90 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <vector>
+#include <memory>
+#include "CPU.h"
+#include "../MemoryMap.h"
+#include "../MemoryImage.h"
+
+// Runs LaneCount copies of the same RV32IM program in lockstep, every lane with its own registers and its own RAM, so a
+// batch of inputs can be run through one program at once. The registers are kept per register for all lanes
+// (structure of arrays), an instruction is executed for all lanes by one loop over the lanes that the compiler turns
+// into SSE/AVX2 code. Lanes that branch differently are masked: every step executes the instruction at the lowest pc of
+// the running lanes, only in the lanes that are at that pc, so the lanes that are ahead wait and the lanes reconverge
+// as soon as they reach the same pc again.
+// The lanes are bare programs: there are no devices, CSRs, traps or interrupts. A lane stops at ecall and ebreak, and at
+// any exception, with the reason in stopReason. The Text range is decoded once and shared, so a lane also stops when it
+// writes to it.
+class LockstepCPU
+{
+public:
+	static constexpr uint32_t LaneCount = 8; // one AVX2 register of 32 bit values
+
+	LockstepCPU();
+	~LockstepCPU();
+
+	LockstepCPU(const LockstepCPU&) = delete;
+	LockstepCPU& operator=(const LockstepCPU&) = delete;
+
+public:
+	// Loads a file into the RAM of every lane, like RAM::fillFromFile. Code loaded into the Text range is decoded.
+	void fillFromFile(const char* fileName, uint32_t startAddr);
+	void load(uint32_t addr, const uint8_t* data, size_t size);
+	// Loads a file into the RAM of one lane only, eg. the input of that lane. Returns false if it can't be read.
+	bool fillLaneFromFile(uint32_t lane, const char* fileName, uint32_t startAddr);
+
+	// The host memory backing the RAM of lane, starting at MemoryMap::RAM.BaseAddr
+	uint8_t* getLaneMemory(uint32_t lane);
+
+	// Saves the RAM of every lane as it is now, eg. right after loading the program. Every reset sets it back to that,
+	// so a lane doesn't see the memory the previous run in it left behind. See MemoryImage.
+	void freeze();
+	// Starts every lane at pc with all registers 0, and with the RAM saved by freeze if it was called
+	void reset(uint32_t pc = MemoryMap::Text.BaseAddr);
+
+	// Runs until every lane stopped or maxSteps steps were taken, a step executes one instruction in every lane at the
+	// same pc. Returns the amount of steps.
+	uint64_t run(uint64_t maxSteps);
+
+	bool isRunning(uint32_t lane) const;
+	bool isAnyRunning() const;
+
+	uint32_t readReg(uint32_t lane, uint32_t index) const;
+	void writeReg(uint32_t lane, uint32_t index, uint32_t data);
+
+public:
+	// Every register of every lane, indexed as regs[register][lane]. x0 is always 0.
+	alignas(32) uint32_t regs[32][LaneCount];
+	alignas(32) uint32_t pcs[LaneCount];
+	std::array<uint64_t, LaneCount> instret;
+
+	// Why a lane stopped: ecall, ebreak or an exception. NoException while the lane is running. The value is the
+	// exception value, eg. the faulting address.
+	std::array<CPU::ExceptionType, LaneCount> stopReason;
+	std::array<uint32_t, LaneCount> stopValue;
+
+private:
+	static constexpr uint32_t RamSize = MemoryMap::RAM.LimitAddr - MemoryMap::RAM.BaseAddr + 1;
+
+	// Executes op in the lanes whose mask is all ones
+	void step(const CPU::DecodedInstruction& op, uint32_t pc, const uint32_t* mask);
+
+	// regs[rd] = f(regs[rs1], b) in the masked lanes
+	template <typename F>
+	void apply(const CPU::DecodedInstruction& op, const uint32_t* b, const uint32_t* mask, F f);
+	template <typename F>
+	void branch(const CPU::DecodedInstruction& op, uint32_t pc, const uint32_t* mask, F taken);
+	void loadOp(const CPU::DecodedInstruction& op, const uint32_t* mask, uint32_t size, bool isSigned);
+	void storeOp(const CPU::DecodedInstruction& op, const uint32_t* mask, uint32_t size);
+
+	void stop(uint32_t lane, CPU::ExceptionType reason, uint32_t value);
+
+private:
+	std::array<uint8_t*, LaneCount> memory;
+	std::array<std::unique_ptr<MemoryImage>, LaneCount> images; // set by freeze
+	// The decoded instructions of the Text range, up to the highest address that was loaded
+	std::vector<CPU::DecodedInstruction> text;
+	alignas(32) uint32_t running[LaneCount]; // all ones for lanes that haven't stopped
+};
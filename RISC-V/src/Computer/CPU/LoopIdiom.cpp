@@ -0,0 +1,291 @@
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include "LoopIdiom.h"
+#include "../MemoryMap.h"
+
+namespace
+{
+	uint32_t readReg(const std::array<uint32_t, 32>& regs, uint8_t reg)
+	{
+		return reg == 0 ? 0 : regs[reg];
+	}
+
+	uint32_t extend(const uint8_t* data, uint32_t size, bool isSigned)
+	{
+		switch (size)
+		{
+		case 4:
+		{
+			uint32_t value;
+			std::memcpy(&value, data, 4);
+			return value;
+		}
+		case 2:
+		{
+			uint16_t value;
+			std::memcpy(&value, data, 2);
+			return isSigned ? (uint32_t)(int32_t)(int16_t)value : value;
+		}
+		default:
+			return isSigned ? (uint32_t)(int32_t)(int8_t)data[0] : data[0];
+		}
+	}
+}
+
+std::unique_ptr<LoopIdiom> LoopIdiom::recognize(const std::vector<CPU::MicroOp>& ops, uint32_t startPc)
+{
+	if (ops.size() < 2)
+		return nullptr;
+
+	// The block has to end with a branch back to its start
+	const CPU::MicroOp& last = ops.back();
+	uint32_t lastPc = startPc + 4 * ((uint32_t)ops.size() - 1);
+	if ((last.operation != CPU::Operation::Bne && last.operation != CPU::Operation::Blt && last.operation != CPU::Operation::BltU)
+		|| lastPc + last.imm != startPc)
+		return nullptr;
+
+	std::unique_ptr<LoopIdiom> loop = std::make_unique<LoopIdiom>();
+	loop->length = (uint32_t)ops.size();
+	loop->branch = last.operation;
+	loop->branchRs1 = last.rs1;
+	loop->branchRs2 = last.rs2;
+
+	// The body may only contain counters, one load and one store
+	std::array<bool, 32> written = {};
+	for (uint32_t i = 0; i + 1 < ops.size(); i++)
+	{
+		const CPU::MicroOp& op = ops[i];
+		switch (op.operation)
+		{
+		case CPU::Operation::Nop:
+		case CPU::Operation::Fence:
+			break;
+
+		case CPU::Operation::AddI:
+			if (op.rd == 0 || op.rd != op.rs1 || written[op.rd])
+				return nullptr;
+			loop->inductions.push_back({ op.rd, (int32_t)op.imm, i });
+			written[op.rd] = true;
+			break;
+
+		case CPU::Operation::Lb: case CPU::Operation::LbU: case CPU::Operation::Lh: case CPU::Operation::LhU: case CPU::Operation::Lw:
+			if (loop->load.present || op.rd == 0 || written[op.rd])
+				return nullptr;
+			loop->load.present = true;
+			loop->load.base = op.rs1;
+			loop->load.offset = op.imm;
+			loop->load.size = op.operation == CPU::Operation::Lw ? 4 : (op.operation == CPU::Operation::Lh || op.operation == CPU::Operation::LhU) ? 2 : 1;
+			loop->load.position = i;
+			loop->load.isSigned = op.operation == CPU::Operation::Lb || op.operation == CPU::Operation::Lh;
+			loop->loadRd = op.rd;
+			written[op.rd] = true;
+			break;
+
+		case CPU::Operation::Sb: case CPU::Operation::Sh: case CPU::Operation::Sw:
+			if (loop->store.present)
+				return nullptr;
+			loop->store.present = true;
+			loop->store.base = op.rs1;
+			loop->store.offset = op.imm;
+			loop->store.size = op.operation == CPU::Operation::Sw ? 4 : op.operation == CPU::Operation::Sh ? 2 : 1;
+			loop->store.position = i;
+			loop->storeValue = op.rs2;
+			break;
+
+		default:
+			return nullptr;
+		}
+	}
+
+	// Every access walks through memory with a counter that is incremented by the access size
+	for (const Access* access : { &loop->load, &loop->store })
+	{
+		if (!access->present)
+			continue;
+		const Induction* base = loop->findInduction(access->base);
+		if (base == nullptr || base->step != (int32_t)access->size)
+			return nullptr;
+	}
+
+	bool branchesOnLoad = loop->load.present && (last.rs1 == loop->loadRd || last.rs2 == loop->loadRd);
+	if (loop->load.present && loop->store.present)
+	{
+		loop->kind = Kind::Copy;
+		if (loop->storeValue != loop->loadRd || loop->store.position < loop->load.position || loop->load.size != loop->store.size)
+			return nullptr;
+	}
+	else if (loop->store.present)
+	{
+		loop->kind = Kind::Fill;
+		if (written[loop->storeValue])
+			return nullptr;
+	}
+	else if (loop->load.present && branchesOnLoad)
+		loop->kind = Kind::Scan;
+	else
+		return nullptr;
+
+	if (branchesOnLoad)
+	{
+		// Copies and scans that stop at a byte, like strcpy and strlen
+		uint8_t other = last.rs1 == loop->loadRd ? last.rs2 : last.rs1;
+		if (last.operation != CPU::Operation::Bne || loop->load.size != 1 || written[other])
+			return nullptr;
+	}
+	else
+	{
+		// Loops that stop when a counter reaches an unchanging limit
+		bool counterFirst = loop->findInduction(last.rs1) != nullptr && !written[last.rs2];
+		bool counterSecond = loop->findInduction(last.rs2) != nullptr && !written[last.rs1];
+		if (!(counterFirst || (counterSecond && last.operation == CPU::Operation::Bne)))
+			return nullptr;
+	}
+
+	return loop;
+}
+
+uint32_t LoopIdiom::execute(std::array<uint32_t, 32>& regs, uint8_t* ram, uint32_t ramSize, uint32_t maxIterations, bool& finished)
+{
+	finished = false;
+	uint32_t iterations = 0;
+	uint32_t loadAddr = 0, storeAddr = 0;
+	if ((load.present && !getFirstAddr(regs, load, loadAddr)) || (store.present && !getFirstAddr(regs, store, storeAddr)))
+		return 0;
+
+	bool branchesOnLoad = load.present && (branchRs1 == loadRd || branchRs2 == loadRd);
+	if (branchesOnLoad)
+	{
+		// Look for the byte that stops the loop, as far as the loop can be run at once
+		uint64_t window = maxIterations;
+		while (window > 0 && !isRamRange(loadAddr, window, ramSize))
+			window /= 2;
+		if (store.present)
+			while (window > 0 && !isRamRange(storeAddr, window, ramSize))
+				window /= 2;
+		if (window == 0)
+			return 0;
+
+		uint32_t stopValue = readReg(regs, branchRs1 == loadRd ? branchRs2 : branchRs1);
+		bool canStop = load.isSigned ? (int32_t)stopValue == (int32_t)(int8_t)stopValue : stopValue <= 0xFF;
+		const uint8_t* source = ram + (loadAddr - MemoryMap::RAM.BaseAddr);
+		const uint8_t* stop = canStop ? (const uint8_t*)std::memchr(source, (uint8_t)stopValue, (size_t)window) : nullptr;
+		iterations = stop != nullptr ? (uint32_t)(stop - source) + 1 : (uint32_t)window;
+		finished = stop != nullptr;
+	}
+	else
+	{
+		uint32_t tripCount = getTripCount(regs);
+		if (tripCount == 0)
+			return 0;
+		iterations = std::min(tripCount, maxIterations);
+		finished = iterations == tripCount;
+	}
+
+	uint64_t bytes = (uint64_t)iterations * (load.present ? load.size : store.size);
+	if ((load.present && !isRamRange(loadAddr, bytes, ramSize)) || (store.present && !isRamRange(storeAddr, bytes, ramSize)))
+		return 0;
+
+	uint8_t* source = ram + (loadAddr - MemoryMap::RAM.BaseAddr);
+	uint8_t* destination = ram + (storeAddr - MemoryMap::RAM.BaseAddr);
+	switch (kind)
+	{
+	case Kind::Copy:
+		// A forward copy into a destination that overlaps the end of the source repeats the data, memmove doesn't
+		if (loadAddr < storeAddr && storeAddr < loadAddr + bytes)
+			return 0;
+		regs[loadRd] = extend(source + bytes - load.size, load.size, load.isSigned);
+		std::memmove(destination, source, (size_t)bytes);
+		break;
+
+	case Kind::Fill:
+	{
+		uint32_t value = readReg(regs, storeValue);
+		if (store.size == 1)
+			std::memset(destination, value & 0xFF, (size_t)bytes);
+		else
+			for (uint64_t offset = 0; offset < bytes; offset += store.size)
+				std::memcpy(destination + offset, &value, store.size);
+		break;
+	}
+
+	case Kind::Scan:
+		regs[loadRd] = extend(source + bytes - load.size, load.size, load.isSigned);
+		break;
+	}
+
+	for (const Induction& induction : inductions)
+		regs[induction.reg] += iterations * (uint32_t)induction.step;
+
+	return iterations;
+}
+
+const LoopIdiom::Induction* LoopIdiom::findInduction(uint8_t reg) const
+{
+	for (const Induction& induction : inductions)
+		if (induction.reg == reg)
+			return &induction;
+	return nullptr;
+}
+
+bool LoopIdiom::getFirstAddr(const std::array<uint32_t, 32>& regs, const Access& access, uint32_t& addr) const
+{
+	const Induction* base = findInduction(access.base);
+	if (base == nullptr)
+		return false;
+
+	// The counter may already have been incremented when the access is done
+	addr = readReg(regs, access.base) + access.offset + (base->position < access.position ? (uint32_t)base->step : 0);
+	return addr % access.size == 0;
+}
+
+uint32_t LoopIdiom::getTripCount(const std::array<uint32_t, 32>& regs) const
+{
+	const Induction* counter = findInduction(branchRs1);
+	uint32_t limit = readReg(regs, branchRs2);
+	if (counter == nullptr)
+	{
+		counter = findInduction(branchRs2);
+		limit = readReg(regs, branchRs1);
+	}
+	if (counter == nullptr || counter->step == 0)
+		return 0;
+
+	// The branch compares the counter after it was incremented, the loop runs at least once
+	uint32_t start = readReg(regs, counter->reg);
+	int64_t step = counter->step;
+	switch (branch)
+	{
+	case CPU::Operation::Bne:
+	{
+		uint32_t distance = step > 0 ? limit - start : start - limit;
+		uint32_t stepSize = (uint32_t)(step > 0 ? step : -step);
+		if (distance == 0 || distance % stepSize != 0)
+			return 0; // it would wrap around
+		return distance / stepSize;
+	}
+	case CPU::Operation::BltU:
+	case CPU::Operation::Blt:
+	{
+		int64_t first = branch == CPU::Operation::BltU ? (int64_t)start : (int64_t)(int32_t)start;
+		int64_t end = branch == CPU::Operation::BltU ? (int64_t)limit : (int64_t)(int32_t)limit;
+		int64_t max = branch == CPU::Operation::BltU ? 0xFFFF'FFFFLL : 0x7FFF'FFFFLL;
+		if (step < 0 || end + step - 1 > max)
+			return 0; // the counter could overflow
+		if (first + step >= end)
+			return 1;
+		int64_t tripCount = (end - first + step - 1) / step;
+		return tripCount > 0xFFFF'FFFFLL ? 0 : (uint32_t)tripCount;
+	}
+	default:
+		return 0;
+	}
+}
+
+bool LoopIdiom::isRamRange(uint32_t addr, uint64_t size, uint32_t ramSize)
+{
+	uint64_t end = (uint64_t)addr + size; // exclusive
+	bool inRam = MemoryMap::RAM.BaseAddr <= addr && end <= (uint64_t)MemoryMap::RAM.BaseAddr + ramSize;
+	bool touchesText = addr <= MemoryMap::Text.LimitAddr && MemoryMap::Text.BaseAddr < end;
+	return size > 0 && inRam && !touchesText;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <array>
+#include <vector>
+#include <memory>
+#include "CPU.h"
+
+// A block that loops back to itself and only copies, fills or scans memory. Such a loop is run in one go with memmove,
+// memset or memchr on the memory backing RAM, after which the registers are set as if it had run instruction by
+// instruction. Recognised loops look like (in any order, with any amount of extra counters):
+//   copy: lb t, 0(src); sb t, 0(dst); addi src, src, 1; addi dst, dst, 1; bne src, end, loop
+//   fill: sw value, 0(dst); addi dst, dst, 4; addi n, n, -1; bnez n, loop
+//   scan: lbu t, 0(p); addi p, p, 1; bne t, c, loop
+// Every access has to be contiguous, and a loop touching anything but RAM (MMIO) or the Text range isn't run at once.
+class LoopIdiom
+{
+public:
+	// Returns nullptr if the block isn't a loop that can be run at once
+	static std::unique_ptr<LoopIdiom> recognize(const std::vector<CPU::MicroOp>& ops, uint32_t startPc);
+
+	// Runs at most maxIterations iterations of the loop, ram is the host memory backing the first ramSize bytes of RAM.
+	// Returns the amount of iterations that were run, which is 0 if the loop has to be run normally. finished is set when
+	// the loop was left.
+	uint32_t execute(std::array<uint32_t, 32>& regs, uint8_t* ram, uint32_t ramSize, uint32_t maxIterations, bool& finished);
+
+	// The amount of instructions in one iteration
+	uint32_t length = 0;
+
+private:
+	enum class Kind
+	{
+		Copy, Fill, Scan
+	};
+
+	// A register that is incremented by a constant once every iteration
+	struct Induction
+	{
+		uint8_t reg = 0;
+		int32_t step = 0;
+		uint32_t position = 0; // the index of its addi in the block
+	};
+
+	struct Access
+	{
+		bool present = false;
+		uint8_t base = 0;
+		uint32_t offset = 0;
+		uint32_t size = 0;
+		uint32_t position = 0;
+		bool isSigned = false;
+	};
+
+private:
+	const Induction* findInduction(uint8_t reg) const;
+	// The address of access in the first iteration, or false if the loop can't be run at once
+	bool getFirstAddr(const std::array<uint32_t, 32>& regs, const Access& access, uint32_t& addr) const;
+	// Returns the amount of iterations until the branch falls through, or 0 if it can't be calculated
+	uint32_t getTripCount(const std::array<uint32_t, 32>& regs) const;
+	static bool isRamRange(uint32_t addr, uint64_t size, uint32_t ramSize);
+
+private:
+	Kind kind = Kind::Copy;
+	std::vector<Induction> inductions;
+	Access load;
+	Access store;
+	uint8_t loadRd = 0;
+	uint8_t storeValue = 0;
+
+	CPU::Operation branch = CPU::Operation::Bne;
+	uint8_t branchRs1 = 0;
+	uint8_t branchRs2 = 0;
+};
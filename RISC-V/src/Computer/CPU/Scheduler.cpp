@@ -0,0 +1,47 @@
+#include <cstdint>
+#include <algorithm>
+#include "Scheduler.h"
+
+Scheduler::Scheduler()
+{
+	deadlines.fill(Never);
+}
+
+Scheduler::~Scheduler()
+{
+}
+
+void Scheduler::schedule(Event event, uint64_t time)
+{
+	deadlines[(size_t)event] = time;
+	updateNextDeadline();
+}
+
+void Scheduler::cancel(Event event)
+{
+	deadlines[(size_t)event] = Never;
+	updateNextDeadline();
+}
+
+uint64_t Scheduler::getDeadline(Event event) const
+{
+	return deadlines[(size_t)event];
+}
+
+bool Scheduler::takeDue(uint64_t time, Event& event)
+{
+	if (nextDeadline > time)
+		return false;
+
+	// There are only a few events, so finding the earliest one is faster than keeping them in a heap
+	size_t earliest = std::min_element(deadlines.begin(), deadlines.end()) - deadlines.begin();
+	event = (Event)earliest;
+	deadlines[earliest] = Never;
+	updateNextDeadline();
+	return true;
+}
+
+void Scheduler::updateNextDeadline()
+{
+	nextDeadline = *std::min_element(deadlines.begin(), deadlines.end());
+}
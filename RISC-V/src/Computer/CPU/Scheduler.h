@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+#include <array>
+
+// Keeps the deadlines of the events that happen at a point in simulated time, which is counted in executed instructions.
+// The execution loop only compares the time with the next deadline, instead of looking at every event source after
+// every instruction.
+class Scheduler
+{
+public:
+	enum class Event {
+		Debug = 0, TimerPoll, Count
+	};
+
+	static constexpr uint64_t Never = 0xFFFF'FFFF'FFFF'FFFFU;
+
+public:
+	Scheduler();
+	~Scheduler();
+
+public:
+	// Replaces the deadline of event if it is already scheduled
+	void schedule(Event event, uint64_t time);
+	void cancel(Event event);
+
+	uint64_t getDeadline(Event event) const;
+	uint64_t getNextDeadline() const { return nextDeadline; }
+
+	// Removes an event whose deadline is at or before time and returns true, returns false if there are none
+	bool takeDue(uint64_t time, Event& event);
+
+private:
+	void updateNextDeadline();
+
+private:
+	std::array<uint64_t, (size_t)Event::Count> deadlines;
+	uint64_t nextDeadline = Never;
+};
@@ -0,0 +1,40 @@
+#include <cstdint>
+#include "HostMemory.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+uint8_t* HostMemory::allocate(size_t size, bool hugePages)
+{
+#if defined(_WIN32)
+	// Committed pages are only backed by physical memory once they are touched
+	return (uint8_t*)VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (memory == MAP_FAILED)
+		return nullptr;
+
+#if defined(MADV_HUGEPAGE)
+	if (hugePages)
+		madvise(memory, size, MADV_HUGEPAGE);
+#endif
+	return (uint8_t*)memory;
+#endif
+}
+
+void HostMemory::free(uint8_t* memory, size_t size)
+{
+	if (memory == nullptr)
+		return;
+
+#if defined(_WIN32)
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munmap(memory, size);
+#endif
+}
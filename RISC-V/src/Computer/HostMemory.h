@@ -0,0 +1,14 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// Large blocks of zeroed host memory that are only reserved when they are allocated: the OS maps (zeroed) physical memory
+// on the first touch of every page, so allocating is quick and only the pages that are used take up memory.
+class HostMemory
+{
+public:
+	// Returns nullptr if size bytes can't be reserved. With hugePages the OS is advised to back the memory with transparent
+	// huge pages (only on Linux), which means less TLB misses but a bigger footprint for sparsely used memory.
+	static uint8_t* allocate(size_t size, bool hugePages = false);
+	static void free(uint8_t* memory, size_t size);
+};
@@ -386,3 +386,9 @@ MemAccessResult Keyboard::read(uint32_t addr, uint32_t& result, bool bReadOnly,
 	result = 0;
 	return MemAccessResult::Success;
 }
+
+AddressRange Keyboard::getAddressRange()
+{
+	// Read only, writes to the same address go to the terminal
+	return { addr, addr, true, false };
+}
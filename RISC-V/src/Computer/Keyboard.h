@@ -30,6 +30,7 @@ public:
 public:
 	MemAccessResult write(uint32_t addr, uint32_t data, DataSize dataSize = DataSize::Word) override;
 	MemAccessResult read(uint32_t addr, uint32_t& result, bool bReadOnly = false, DataSize dataSize = DataSize::Word, bool isSigned = true) override;
+	AddressRange getAddressRange() override;
 	
 private:
 	void addCharacter(wchar_t character);
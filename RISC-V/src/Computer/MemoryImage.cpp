@@ -0,0 +1,65 @@
+#include <cstdint>
+#include <cstring>
+#include "MemoryImage.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+MemoryImage::MemoryImage(uint8_t* memory, size_t size)
+	: memory(memory), size(size)
+{
+	if (!mapImage())
+		copy.assign(memory, memory + size);
+}
+
+MemoryImage::~MemoryImage()
+{
+#if defined(__linux__)
+	// The mapping keeps the memfd alive
+	if (fd >= 0)
+		close(fd);
+#endif
+}
+
+void MemoryImage::restore()
+{
+#if defined(__linux__)
+	if (fd >= 0)
+	{
+		// Drops the private copies of the pages that were written, they are read from the image again
+		madvise(memory, size, MADV_DONTNEED);
+		return;
+	}
+#endif
+
+	std::memcpy(memory, copy.data(), size);
+}
+
+bool MemoryImage::mapImage()
+{
+#if defined(__linux__)
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	if ((uintptr_t)memory % pageSize != 0 || size % pageSize != 0)
+		return false;
+
+	fd = memfd_create("memory-image", MFD_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	// Only the pages that aren't all zero are written, the rest of the file stays a hole that reads as zeros
+	bool ok = ftruncate(fd, size) == 0;
+	std::vector<uint8_t> zeroPage(pageSize);
+	for (size_t offset = 0; ok && offset < size; offset += pageSize)
+		if (std::memcmp(memory + offset, zeroPage.data(), pageSize) != 0)
+			ok = pwrite(fd, memory + offset, pageSize, offset) == (ssize_t)pageSize;
+
+	if (ok && mmap(memory, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED)
+		return true;
+
+	close(fd);
+	fd = -1;
+#endif
+	return false;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// A frozen copy of a block of memory that the memory can be reset to. On Linux the copy is a memfd that the memory is
+// remapped onto copy-on-write, so resetting only drops the pages that were written since, and the cost of both freezing
+// and resetting depends on the pages that are used instead of the size of the memory. Elsewhere (or when the memory
+// isn't page aligned) the copy is a plain buffer, which is copied back on reset.
+class MemoryImage
+{
+public:
+	// Freezes the current contents of memory. memory has to stay allocated as long as the image is used.
+	MemoryImage(uint8_t* memory, size_t size);
+	~MemoryImage();
+
+	MemoryImage(const MemoryImage&) = delete;
+	MemoryImage& operator=(const MemoryImage&) = delete;
+
+public:
+	// Sets memory back to the contents it had when it was frozen
+	void restore();
+
+private:
+	bool mapImage();
+
+private:
+	uint8_t* memory;
+	size_t size;
+	int fd = -1; // the memfd memory is mapped onto, -1 if copy is used
+	std::vector<uint8_t> copy;
+};
@@ -1,74 +1,116 @@
 #pragma once
 #include <cstdint>
-#include <array>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <memory>
 #include "Bus.h"
+#include "HostMemory.h"
+#include "MemoryImage.h"
 
-template <uint32_t START_ADDR, uint32_t END_ADDR>
+// How RAM handles an access that isn't aligned to its size: Fault makes it fail with MemAccessResult::Misaligned (so the
+// CPU raises an address misaligned exception), Allow performs it like an aligned access
+enum class MisalignedAccess {
+	Fault = 0, Allow
+};
+
+// The memory is a byte array in guest (little endian) byte order, accesses of every size are a copy from or to it. This
+// assumes a little endian host, like the rest of the emulator.
+// START_ADDR to END_ADDR is the most the RAM can cover, its size is chosen when it's created and it only responds to the
+// addresses from START_ADDR up to START_ADDR + size - 1. The memory is reserved with HostMemory, so pages the guest never
+// touches don't cost anything.
+template <uint32_t START_ADDR, uint32_t END_ADDR, MisalignedAccess MISALIGNED_ACCESS = MisalignedAccess::Fault>
 class RAM : public BusDevice
 {
 public:
-	RAM()
-		: memory()
+	RAM(uint32_t size = MaxSize, bool hugePages = false)
+		: size(size), memory(nullptr), ownsMemory(true)
+	{
+		if (START_ADDR % 4 != 0 || END_ADDR % 4 != 3) throw "Invalid adress";
+		if (size == 0 || size % 4 != 0 || MaxSize < size) throw "Invalid size";
+
+		memory = HostMemory::allocate(size, hugePages);
+		if (memory == nullptr) throw "Out of memory";
+	}
+
+	// Uses storage (zeroed and at least size bytes) as the memory, e.g. memory allocated in a Fastmem window
+	RAM(uint8_t* storage, uint32_t size = MaxSize)
+		: size(size), memory(storage), ownsMemory(false)
 	{
 		if (START_ADDR % 4 != 0 || END_ADDR % 4 != 3) throw "Invalid adress";
+		if (size == 0 || size % 4 != 0 || MaxSize < size) throw "Invalid size";
 	}
 
 	~RAM()
 	{
+		if (ownsMemory)
+			HostMemory::free(memory, size);
 	}
 
+	RAM(const RAM&) = delete;
+	RAM& operator=(const RAM&) = delete;
+
 public:
 	void fillFromFile(const char* fileName, uint32_t startAddr)
 	{
+		if (startAddr < START_ADDR || size <= startAddr - START_ADDR) return;
+
 		std::ifstream file;
 		file.open(fileName, std::ios::in | std::ios::binary | std::ios::ate);
 
-		std::streampos size = file.tellg();
+		std::streamoff fileSize = file.tellg();
+		if (fileSize < 0) fileSize = 0; // the file can't be read
 		file.seekg(0, std::ios::beg);
 
-		file.read((char*)&memory[(startAddr - START_ADDR) / 4], size);
+		uint8_t* bytes = memory + (startAddr - START_ADDR);
+		file.read((char*)bytes, std::min<std::streamoff>(fileSize, size - (startAddr - START_ADDR)));
+		std::streamsize loaded = file.gcount();
 
 		file.close();
+
+		// FNV-1a over the start address and the loaded bytes
+		for (int i = 0; i < 4; i++)
+			imageHash = (imageHash ^ ((startAddr >> (8 * i)) & 0xFF)) * 0x100'0000'01B3ULL;
+		for (std::streamsize i = 0; i < loaded; i++)
+			imageHash = (imageHash ^ bytes[i]) * 0x100'0000'01B3ULL;
+	}
+
+	// The whole memory, getSize() bytes starting at the byte of START_ADDR, for bulk operations like loading and snapshotting
+	uint8_t* getData()
+	{
+		return memory;
+	}
+
+	uint32_t getSize()
+	{
+		return size;
 	}
 
 public:
 	MemAccessResult write(uint32_t addr, uint32_t data, enum DataSize dataSize = DataSize::Word) override
 	{
-		if (addr < START_ADDR || END_ADDR < addr) return MemAccessResult::NotInRange;
-
-		uint32_t memoryAddr = (addr - START_ADDR) / 4;
-		uint32_t offset = addr & 0b11;
+		MemAccessResult result = checkAccess(addr, getAccessSize(dataSize));
+		if (result != MemAccessResult::Success)
+			return result;
 
+		uint8_t* bytes = memory + (addr - START_ADDR);
 		switch (dataSize)
 		{
 		case DataSize::Word:
-			if (offset != 0)
-				return MemAccessResult::Misaligned;
-			memory[memoryAddr] = data;
+			std::memcpy(bytes, &data, 4);
 			return MemAccessResult::Success;
 
 		case DataSize::HalfWord:
-			switch (offset)
-			{
-			case 0:
-				memory[memoryAddr] = (memory[memoryAddr] & 0xFFFF'0000U) | (data & 0x0000'FFFFU);
-				return MemAccessResult::Success;
-			case 2:
-				memory[memoryAddr] = (memory[memoryAddr] & 0x0000'FFFFU) | ((data << 16) & 0xFFFF'0000U);
-				return MemAccessResult::Success;
-			default:
-				return MemAccessResult::Misaligned;
-			}
-
-		case DataSize::Byte:
 		{
-			uint32_t bitMask = 0xFFU;
-			uint32_t shiftAmount = offset * 8;
-
-			memory[memoryAddr] = (memory[memoryAddr] & ~(bitMask << shiftAmount)) | ((data & bitMask) << shiftAmount);
+			uint16_t data16 = (uint16_t)data;
+			std::memcpy(bytes, &data16, 2);
 			return MemAccessResult::Success;
 		}
 
+		case DataSize::Byte:
+			*bytes = (uint8_t)data;
+			return MemAccessResult::Success;
+
 		default: // Shouldn't happen
 			return MemAccessResult::Misaligned;
 		}
@@ -76,54 +118,90 @@ public:
 
 	MemAccessResult read(uint32_t addr, uint32_t& result, bool bReadOnly = false, DataSize dataSize = DataSize::Word, bool isSigned = true) override
 	{
-		if (addr < START_ADDR || END_ADDR < addr) return MemAccessResult::NotInRange;
-
-		uint32_t memoryAddr = (addr - START_ADDR) / 4;
-		uint32_t offset = addr & 0b11;
-
-		uint16_t data16;
-		uint8_t data8;
+		MemAccessResult accessResult = checkAccess(addr, getAccessSize(dataSize));
+		if (accessResult != MemAccessResult::Success)
+			return accessResult;
 
+		const uint8_t* bytes = memory + (addr - START_ADDR);
 		switch (dataSize)
 		{
 		case DataSize::Word:
-			if (offset != 0)
-				return MemAccessResult::Misaligned;
-			result = memory[memoryAddr];
+			std::memcpy(&result, bytes, 4);
 			return MemAccessResult::Success;
 
 		case DataSize::HalfWord:
-			switch (offset)
-			{
-			case 0:
-				data16 = memory[memoryAddr] & 0x0000'FFFFU;
-				result = isSigned ? (uint32_t)(int32_t)(int16_t)data16 : (uint32_t)data16;
-				return MemAccessResult::Success;
-			case 2:
-				data16 = (memory[memoryAddr] & 0xFFFF'0000U) >> 16;
-				result = isSigned ? (uint32_t)(int32_t)(int16_t)data16 : (uint32_t)data16;
-				return MemAccessResult::Success;
-			default:
-				return MemAccessResult::Misaligned;
-			}
-
-		case DataSize::Byte:
 		{
-			uint32_t shiftAmount = offset * 8;
-			uint32_t bitMask = 0xFFU << shiftAmount;
-
-			data8 = (memory[memoryAddr] & bitMask) >> shiftAmount;
-
-			result = isSigned ? (uint32_t)(int32_t)(int8_t)data8 : (uint32_t)data8;
+			uint16_t data16;
+			std::memcpy(&data16, bytes, 2);
+			result = isSigned ? (uint32_t)(int32_t)(int16_t)data16 : (uint32_t)data16;
 			return MemAccessResult::Success;
 		}
-		
+
+		case DataSize::Byte:
+			result = isSigned ? (uint32_t)(int32_t)(int8_t)*bytes : (uint32_t)*bytes;
+			return MemAccessResult::Success;
+
 		default: // Shouldn't happen
 			return MemAccessResult::Misaligned;
 		}
 	}
 
+	uint8_t* getHostPointer(uint32_t addr) override
+	{
+		if (addr < START_ADDR || size <= addr - START_ADDR) return nullptr;
+
+		return memory + (addr - START_ADDR);
+	}
+
+	AddressRange getAddressRange() override
+	{
+		return { START_ADDR, START_ADDR + (size - 1), true, true };
+	}
+
+	// The memory becomes a copy-on-write view of the frozen image where possible, see MemoryImage
+	void freeze() override
+	{
+		image.reset();
+		image = std::make_unique<MemoryImage>(memory, size);
+	}
+
+	void restore() override
+	{
+		if (image)
+			image->restore();
+	}
+
+private:
+	static uint32_t getAccessSize(DataSize dataSize)
+	{
+		return dataSize == DataSize::Word ? 4 : dataSize == DataSize::HalfWord ? 2 : 1;
+	}
+
+	MemAccessResult checkAccess(uint32_t addr, uint32_t accessSize)
+	{
+		if (addr < START_ADDR || size <= addr - START_ADDR) return MemAccessResult::NotInRange;
+
+		if (MISALIGNED_ACCESS == MisalignedAccess::Fault && addr % accessSize != 0)
+			return MemAccessResult::Misaligned;
+		// A misaligned access can reach past the end of the memory
+		if (size - (addr - START_ADDR) < accessSize)
+			return MemAccessResult::Misaligned;
+
+		return MemAccessResult::Success;
+	}
+
 public:
-	std::array<uint32_t, (END_ADDR - START_ADDR) / 4> memory;
-};
+	static constexpr uint32_t BaseAddr = START_ADDR;
+	static constexpr uint32_t LimitAddr = END_ADDR;
+	static constexpr uint32_t MaxSize = END_ADDR - START_ADDR + 1;
 
+private:
+	uint32_t size;
+	uint8_t* memory;
+	bool ownsMemory;
+	std::unique_ptr<MemoryImage> image; // set by freeze
+
+public:
+	// A hash of everything loaded with fillFromFile, identifies the program that is loaded
+	uint64_t imageHash = 0xCBF2'9CE4'8422'2325ULL;
+};
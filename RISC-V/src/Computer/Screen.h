@@ -71,9 +71,30 @@ public:
 		return MemAccessResult::NotInRange;
 	}
 
+	AddressRange getAddressRange() override
+	{
+		return { BaseAddr, LimitAddr, false, true }; // write only
+	}
+
+	void freeze() override
+	{
+		frozenMemory = memory;
+	}
+
+	void restore() override
+	{
+		memory = frozenMemory;
+	}
+
 public:
+	static constexpr uint32_t BaseAddr = START_ADDR;
+	static constexpr uint32_t LimitAddr = START_ADDR + ROWS * 4 - 1;
+
 	std::array<uint32_t, ROWS> memory;
 	short colour;
+
+private:
+	std::array<uint32_t, ROWS> frozenMemory{};
 };
 
 
@@ -0,0 +1,113 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <tuple>
+#include <vector>
+#include "Bus.h"
+#include "Timer.h"
+
+// A bus whose devices are known at compile time. Every device type gives its address range as BaseAddr and LimitAddr
+// (the whole address space if it only knows its address at run time), so an access only goes to the devices whose
+// range contains the address. Those calls aren't virtual and can be inlined. read and write switch once on the data size
+// and signedness, so in each of the paths they pick those are constants and the switches of the devices on them fold away.
+// The devices are tried in the order they are given, followed by the timer, exactly like Bus does.
+template <typename... Devices>
+class StaticBus : public Bus
+{
+public:
+	StaticBus(Devices*... devices)
+		: Bus(std::vector<BusDevice*>{ devices... }), typedDevices(devices...)
+	{
+		// Bus adds the timer after the other devices
+		timerDevice = static_cast<TimerDevice*>(Bus::devices.back());
+	}
+
+	~StaticBus()
+	{
+	}
+
+public:
+	MemAccessResult write(uint32_t addr, uint32_t data, enum DataSize dataSize = DataSize::Word) override
+	{
+		switch (dataSize)
+		{
+		case DataSize::Word:
+			return writeSized<DataSize::Word>(addr, data);
+		case DataSize::HalfWord:
+			return writeSized<DataSize::HalfWord>(addr, data);
+		case DataSize::Byte:
+			return writeSized<DataSize::Byte>(addr, data);
+		default: // Shouldn't happen
+			return MemAccessResult::Misaligned;
+		}
+	}
+
+	MemAccessResult read(uint32_t addr, uint32_t& result, bool bReadOnly = false, enum DataSize dataSize = DataSize::Word, bool isSigned = true) override
+	{
+		switch (dataSize)
+		{
+		case DataSize::Word:
+			return isSigned ? readSized<DataSize::Word, true>(addr, result, bReadOnly) : readSized<DataSize::Word, false>(addr, result, bReadOnly);
+		case DataSize::HalfWord:
+			return isSigned ? readSized<DataSize::HalfWord, true>(addr, result, bReadOnly) : readSized<DataSize::HalfWord, false>(addr, result, bReadOnly);
+		case DataSize::Byte:
+			return isSigned ? readSized<DataSize::Byte, true>(addr, result, bReadOnly) : readSized<DataSize::Byte, false>(addr, result, bReadOnly);
+		default: // Shouldn't happen
+			return MemAccessResult::Misaligned;
+		}
+	}
+
+private:
+	template <DataSize dataSize>
+	MemAccessResult writeSized(uint32_t addr, uint32_t data)
+	{
+		return writeFrom<0, dataSize>(addr, data);
+	}
+
+	template <DataSize dataSize, bool isSigned>
+	MemAccessResult readSized(uint32_t addr, uint32_t& result, bool bReadOnly)
+	{
+		return readFrom<0, dataSize, isSigned>(addr, result, bReadOnly);
+	}
+
+	// Tries the device at index and the ones after it
+	template <size_t index, DataSize dataSize>
+	MemAccessResult writeFrom(uint32_t addr, uint32_t data)
+	{
+		if constexpr (index == sizeof...(Devices))
+			return timerDevice->TimerDevice::write(addr, data, dataSize);
+		else
+		{
+			using Device = std::tuple_element_t<index, std::tuple<Devices...>>;
+			if (Device::BaseAddr <= addr && addr <= Device::LimitAddr)
+			{
+				MemAccessResult accessResult = std::get<index>(typedDevices)->Device::write(addr, data, dataSize);
+				if (accessResult != MemAccessResult::NotInRange)
+					return accessResult;
+			}
+			return writeFrom<index + 1, dataSize>(addr, data);
+		}
+	}
+
+	template <size_t index, DataSize dataSize, bool isSigned>
+	MemAccessResult readFrom(uint32_t addr, uint32_t& result, bool bReadOnly)
+	{
+		if constexpr (index == sizeof...(Devices))
+			return timerDevice->TimerDevice::read(addr, result, bReadOnly, dataSize, isSigned);
+		else
+		{
+			using Device = std::tuple_element_t<index, std::tuple<Devices...>>;
+			if (Device::BaseAddr <= addr && addr <= Device::LimitAddr)
+			{
+				MemAccessResult accessResult = std::get<index>(typedDevices)->Device::read(addr, result, bReadOnly, dataSize, isSigned);
+				if (accessResult != MemAccessResult::NotInRange)
+					return accessResult;
+			}
+			return readFrom<index + 1, dataSize, isSigned>(addr, result, bReadOnly);
+		}
+	}
+
+private:
+	std::tuple<Devices*...> typedDevices;
+	TimerDevice* timerDevice;
+};
@@ -72,6 +72,28 @@ public:
 		return MemAccessResult::NotInRange;
 	}
 
+	// Write only, reads of the same address go to the keyboard
+	AddressRange getAddressRange() override
+	{
+		return { ADDR, ADDR, false, true };
+	}
+
+	void freeze() override
+	{
+		frozenRows = rows;
+		frozenCurrentRow = currentRow;
+	}
+
+	void restore() override
+	{
+		rows = frozenRows;
+		currentRow = frozenCurrentRow;
+	}
+
+public:
+	static constexpr uint32_t BaseAddr = ADDR;
+	static constexpr uint32_t LimitAddr = ADDR;
+
 private:
 	void newLine()
 	{
@@ -97,5 +119,8 @@ private:
 private:
 	std::array<std::wstring, ROWS> rows;
 	uint32_t currentRow = 0;
+
+	std::array<std::wstring, ROWS> frozenRows;
+	uint32_t frozenCurrentRow = 0;
 };
 
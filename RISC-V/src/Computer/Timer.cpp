@@ -108,6 +108,10 @@ MemAccessResult TimerDevice::write(uint32_t addr, uint32_t data, enum DataSize d
 	else
 		timer.setTimeCmpHigh(data);
 
+	// The timer interrupt can start or stop with any write
+	if (bus != nullptr)
+		bus->interruptsChanged();
+
 	return MemAccessResult::Success;
 }
 
@@ -130,3 +134,21 @@ MemAccessResult TimerDevice::read(uint32_t addr, uint32_t& result, bool bReadOnl
 
 	return MemAccessResult::Success;
 }
+
+AddressRange TimerDevice::getAddressRange()
+{
+	return { address, address + 15, true, true };
+}
+
+// mtime continues from the value it had when it was frozen
+void TimerDevice::freeze()
+{
+	frozenTime = timer.getTimeFull();
+	frozenTimeCmp = timer.getTimeCmpFull();
+}
+
+void TimerDevice::restore()
+{
+	timer.setTimeFull(frozenTime);
+	timer.setTimeCmpFull(frozenTimeCmp);
+}
@@ -46,8 +46,15 @@ public:
 public:
 	MemAccessResult write(uint32_t addr, uint32_t data, enum DataSize dataSize = DataSize::Word) override;
 	MemAccessResult read(uint32_t addr, uint32_t& result, bool bReadOnly = false, enum DataSize dataSize = DataSize::Word, bool isSigned = true) override;
+	AddressRange getAddressRange() override;
+	void freeze() override;
+	void restore() override;
 
 public:
 	Timer timer;
 	uint32_t address;
+
+private:
+	uint64_t frozenTime = 0;
+	uint64_t frozenTimeCmp = 0xFFFF'FFFF'FFFF'FFFFU;
 }; 
@@ -1,17 +1,34 @@
-﻿#define OLC_CGE_APPLICATION
-#include <iostream>
+﻿#include <iostream>
 #include <iomanip>
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <chrono>
 #include "Computer/Bus.h"
+#include "Computer/StaticBus.h"
 #include "Computer/RAM.h"
-#include "Computer/Screen.h"
-#include "Computer/Terminal.h"
-#include "Computer/Keyboard.h"
 #include "Computer/Timer.h"
 #include "Computer/CPU/CPU.h"
+#include "Computer/CPU/AOT.h"
+#include "Computer/CPU/LockstepCPU.h"
+#include "Computer/CPU/Fastmem.h"
 #include "Computer/MemoryMap.h"
+
+#if defined(_WIN32)
+static const char* AOTLibrary = "text.aot.dll";
+#else
+static const char* AOTLibrary = "./text.aot.so";
+#endif
+
+// The Visualiser uses olcConsoleGameEngine, which only runs on Windows. Elsewhere only the headless modes are built.
+#if defined(_WIN32)
+#define OLC_CGE_APPLICATION
+#include "Computer/Screen.h"
+#include "Computer/Terminal.h"
+#include "Computer/Keyboard.h"
 #include "Drawing/Button.h"
 #include "Drawing/Tabs.h"
 
@@ -30,6 +47,7 @@ public:
 	Terminal<MemoryMap::TerminalAddr, 16, 40>* terminal;
 	Keyboard* keyboard;
 	CPU* cpu;
+	Fastmem* fastmem = nullptr; // set by --fastmem, RAM is allocated in its window
 
 private:
 	Tabs<3>* tabs = nullptr;
@@ -40,6 +58,7 @@ private:
 
 private:
 	bool running = false;
+	bool usesBlocks = false; // set if the engine runs basic blocks, which are saved in the block profile
 	double cps = 1.0; // clocks per second
 	double timeSinceLastCycle = 0.0;
 
@@ -134,7 +153,11 @@ public:
 	bool OnUserCreate() override
 	{
 		// Build computer
-		ram = new RAM<MemoryMap::RAM.BaseAddr, MemoryMap::RAM.LimitAddr>();
+		uint8_t* ramStorage = fastmem != nullptr ? fastmem->allocate(MemoryMap::RAM.BaseAddr, MemoryMap::RAM.LimitAddr - MemoryMap::RAM.BaseAddr + 1) : nullptr;
+		if (ramStorage != nullptr)
+			ram = new RAM<MemoryMap::RAM.BaseAddr, MemoryMap::RAM.LimitAddr>(ramStorage);
+		else
+			ram = new RAM<MemoryMap::RAM.BaseAddr, MemoryMap::RAM.LimitAddr>();
 		ram->fillFromFile("data.bin", MemoryMap::Data.BaseAddr);
 		ram->fillFromFile("text.bin", MemoryMap::Text.BaseAddr);
 
@@ -144,10 +167,21 @@ public:
 
 		keyboard = new Keyboard(MemoryMap::KeyboardAddr);
 
-		bus = new Bus({ ram, screen, terminal, keyboard });
+		bus = new StaticBus<RAM<MemoryMap::RAM.BaseAddr, MemoryMap::RAM.LimitAddr>, Screen<MemoryMap::ScreenBaseAddr, 32, 32>,
+			Terminal<MemoryMap::TerminalAddr, 16, 40>, Keyboard>(ram, screen, terminal, keyboard);
 
 		cpu = new CPU([this]() mutable { running = false; playButton->colour = FG_WHITE | BG_CYAN; });
+		if (ramStorage != nullptr)
+			cpu->useFastmem(fastmem);
 		cpu->connectBus(bus);
+		// The native code of an AOT module is only run by the JIT engine. Loading it flushes the block cache, so it is
+		// loaded before the profile.
+		if (cpu->loadAOT(AOTLibrary, ram->imageHash))
+			cpu->engine = CPU::Engine::JIT;
+		// The interpreter doesn't build blocks, its profile would be empty
+		usesBlocks = cpu->engine == CPU::Engine::Blocks || cpu->engine == CPU::Engine::JIT;
+		if (usesBlocks)
+			cpu->loadBlockProfile("blockprofile.bin", ram->imageHash);
 
 		// create interface
 		std::wstring tabNames[] = { std::wstring(L"Memory"), std::wstring(L"Terminal"), std::wstring(L"CSR") };
@@ -174,10 +208,13 @@ public:
 		{
 			timeSinceLastCycle += fElapsedTime;
 
-			while (timeSinceLastCycle > 1 / cps)
+			uint64_t cycles = (uint64_t)(timeSinceLastCycle * cps);
+			if (cycles > 0)
 			{
-				cpu->clock();
-				timeSinceLastCycle -= 1 / cps;
+				CPU::RunResult result = cpu->run(cycles);
+				timeSinceLastCycle -= result.executed / cps;
+				if (result.reason == CPU::StopReason::Debug)
+					timeSinceLastCycle = 0.0;
 			}
 		}
 		
@@ -206,14 +243,154 @@ public:
 
 		return true;
 	}
+
+	bool OnUserDestroy() override
+	{
+		if (usesBlocks)
+			cpu->saveBlockProfile("blockprofile.bin", ram->imageHash);
+		return true;
+	}
 };
+#endif
+
+// Translates text.bin and data.bin ahead of time into AOTLibrary, which is loaded by the Visualiser and --headless when it
+// matches. The Visualiser switches to the JIT engine then.
+bool buildAOT()
+{
+	auto* ram = new RAM<MemoryMap::RAM.BaseAddr, MemoryMap::RAM.LimitAddr>();
+	ram->fillFromFile("data.bin", MemoryMap::Data.BaseAddr);
+	ram->fillFromFile("text.bin", MemoryMap::Text.BaseAddr);
+	Bus bus({ ram });
+
+	std::string sourceFile = std::string(AOTLibrary) + ".cpp";
+	std::ofstream source(sourceFile);
+	uint32_t blocks = AOT::generate(&bus, ram->imageHash, source);
+	source.close();
+	std::cout << "translated " << blocks << " blocks into " << sourceFile << std::endl;
+
+	return AOT::compile(sourceFile, AOTLibrary);
+}
+
+// Runs text.bin once for every data file given, LockstepCPU::LaneCount at a time, and prints a0 of every run when it stopped
+int runBatch(int fileCount, char** dataFiles)
+{
+	static constexpr uint64_t MaxSteps = 1'000'000'000;
+
+	LockstepCPU* lanes = new LockstepCPU();
+	lanes->fillFromFile("text.bin", MemoryMap::Text.BaseAddr);
+	lanes->freeze(); // every batch starts from the loaded program and zeroed memory
+	for (int first = 0; first < fileCount; first += LockstepCPU::LaneCount)
+	{
+		lanes->reset();
+		uint32_t laneCount = std::min<uint32_t>(LockstepCPU::LaneCount, fileCount - first);
+		for (uint32_t lane = 0; lane < LockstepCPU::LaneCount; lane++)
+		{
+			// Unused lanes run the last file again
+			const char* dataFile = dataFiles[first + std::min(lane, laneCount - 1)];
+			if (!lanes->fillLaneFromFile(lane, dataFile, MemoryMap::Data.BaseAddr))
+				std::cout << dataFile << ": can't be read" << std::endl;
+		}
+
+		lanes->run(MaxSteps);
+
+		for (uint32_t lane = 0; lane < laneCount; lane++)
+		{
+			std::cout << dataFiles[first + lane] << ": a0 = " << lanes->readReg(lane, 10) << ", " << lanes->instret[lane] << " instructions";
+			if (lanes->isRunning(lane))
+				std::cout << ", still running";
+			else if (lanes->stopReason[lane] != CPU::ExceptionType::MEnvironmentCall && lanes->stopReason[lane] != CPU::ExceptionType::EnvironmentBreak)
+				std::cout << ", exception " << (uint32_t)lanes->stopReason[lane] << " at 0x" << std::hex << lanes->pcs[lane] << std::dec;
+			std::cout << std::endl;
+		}
+	}
 
-int main()
+	delete lanes;
+	return 0;
+}
+
+// Runs text.bin and data.bin without the Visualiser, so only RAM and the timer are connected, with the JIT engine, the
+// block profile and AOTLibrary if they match. Stops after maxInstructions or when the debug countdown runs out, and
+// prints where the program is and how fast it ran.
+int runHeadless(uint64_t maxInstructions, Fastmem* fastmem)
 {
-	Visualiser visualiser;
-	if (visualiser.ConstructConsole(97, 37, 10, 20) == 1)
-		visualiser.Start();
+	uint8_t* ramStorage = fastmem != nullptr ? fastmem->allocate(MemoryMap::RAM.BaseAddr, MemoryMap::RAM.LimitAddr - MemoryMap::RAM.BaseAddr + 1) : nullptr;
+	RAM<MemoryMap::RAM.BaseAddr, MemoryMap::RAM.LimitAddr>* ram;
+	if (ramStorage != nullptr)
+		ram = new RAM<MemoryMap::RAM.BaseAddr, MemoryMap::RAM.LimitAddr>(ramStorage);
+	else
+		ram = new RAM<MemoryMap::RAM.BaseAddr, MemoryMap::RAM.LimitAddr>();
+	ram->fillFromFile("data.bin", MemoryMap::Data.BaseAddr);
+	ram->fillFromFile("text.bin", MemoryMap::Text.BaseAddr);
+	StaticBus<RAM<MemoryMap::RAM.BaseAddr, MemoryMap::RAM.LimitAddr>> bus(ram);
+
+	CPU cpu([]() {});
+	cpu.engine = CPU::Engine::JIT;
+	if (ramStorage != nullptr)
+		cpu.useFastmem(fastmem);
+	bus.connectCPU(&cpu);
+	cpu.loadAOT(AOTLibrary, ram->imageHash);
+	cpu.loadBlockProfile("blockprofile.bin", ram->imageHash);
+
+	auto start = std::chrono::steady_clock::now();
+	CPU::RunResult result = cpu.run(maxInstructions);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	cpu.saveBlockProfile("blockprofile.bin", ram->imageHash);
 
+	std::cout << "pc = 0x" << std::hex << cpu.pc << std::dec << ", a0 = " << cpu.readReg(10) << ", " << result.executed << " instructions";
+	if (result.reason == CPU::StopReason::Debug)
+		std::cout << ", stopped for debugging";
+	std::cout << ", " << (seconds > 0.0 ? result.executed / seconds / 1e6 : 0.0) << " MIPS" << std::endl;
 	return 0;
 }
 
+int main(int argc, char** argv)
+{
+	static constexpr uint64_t HeadlessInstructions = 1'000'000'000;
+
+	if (argc > 1 && std::string(argv[1]) == "--aot")
+		return buildAOT() ? 0 : 1;
+	if (argc > 1 && std::string(argv[1]) == "--batch")
+		return runBatch(argc - 2, argv + 2);
+
+	// --headless [instructions] runs without the Visualiser, on other hosts than Windows it always runs headless
+	bool headless = false;
+	bool useFastmem = false;
+	uint64_t maxInstructions = HeadlessInstructions;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--headless")
+			headless = true;
+		else if (arg == "--fastmem")
+			useFastmem = true;
+		else if (headless && !arg.empty() && std::all_of(arg.begin(), arg.end(), ::isdigit))
+			maxInstructions = std::stoull(arg);
+		else
+		{
+			std::cout << "unknown argument " << arg << std::endl;
+			return 1;
+		}
+	}
+
+	// Loads and stores to RAM are host accesses in a reserved address space window, only on 64-bit Linux
+	Fastmem fastmem;
+	if (useFastmem && !fastmem.isAvailable())
+	{
+		std::cout << "fastmem isn't available on this host" << std::endl;
+		useFastmem = false;
+	}
+
+#if defined(_WIN32)
+	if (!headless)
+	{
+		Visualiser visualiser;
+		visualiser.fastmem = useFastmem ? &fastmem : nullptr;
+		if (visualiser.ConstructConsole(97, 37, 10, 20) == 1)
+			visualiser.Start();
+		return 0;
+	}
+#endif
+
+	return runHeadless(maxInstructions, useFastmem ? &fastmem : nullptr);
+}
+